@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Compares Remapper with CompiledRemapper, on the same workload as profile.
+//
+// Run `./compiled_benchmark`. The config in profile.keyshift is compiled in
+// by keyshift_compile_config() in CMakeLists.txt.
+
+#include <chrono>
+#include <iostream>
+
+#include "compiled_benchmark_config.h"
+#include "config_parser.h"
+#include "profile_workload.h"
+#include "remap_operator.h"
+
+const int kIterations = 200000;
+
+// Returns nano seconds per event.
+template <typename RemapperType>
+double Benchmark(RemapperType& remapper, long& num_emitted) {
+  remapper.SetCallback([&num_emitted](int, int) { ++num_emitted; });
+  // Warm up.
+  RunProfileWorkload(remapper, kIterations / 10);
+  num_emitted = 0;
+  const auto start = std::chrono::steady_clock::now();
+  const long num_events = RunProfileWorkload(remapper, kIterations);
+  const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start);
+  return double(elapsed.count()) / num_events;
+}
+
+int main() {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  if (!config_parser.Parse(ReadConfigLines(KEYSHIFT_PROFILE_CONFIG))) {
+    throw std::runtime_error("Could not parse the config!");
+  }
+  CompiledConfigRemapper compiled_remapper;
+
+  long emitted = 0;
+  long compiled_emitted = 0;
+  const double ns = Benchmark(remapper, emitted);
+  const double compiled_ns = Benchmark(compiled_remapper, compiled_emitted);
+
+  std::cout << "Remapper:         " << ns << " ns/event" << std::endl;
+  std::cout << "CompiledRemapper: " << compiled_ns << " ns/event" << std::endl;
+  std::cout << "Speedup:          " << ns / compiled_ns << "x" << std::endl;
+  if (emitted != compiled_emitted) {
+    std::cerr << "ERROR: Emitted " << emitted << " vs " << compiled_emitted
+              << " events." << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __COMPILED_REMAPPER_H
+#define __COMPILED_REMAPPER_H
+
+// Runs a config which was compiled to C++ by `keyshift --emit-cpp`.
+//
+// Behaves exactly as Remapper. The difference is that the config is in
+// constant tables generated for it, lookups are switch statements, and all
+// other state is in fixed size arrays. See docs/compiled_config.md.
+//
+// The generated Tables provide -
+// - kActions, all action lists back to back, and kRanges into it.
+// - kAllowOtherKeys and kNullEventActions (index in kRanges), per state.
+// - kMappings, only to show the config in DumpConfig().
+// - kPassthroughKeys, bitmap of keys the config does not use.
+// - Lookup(state, key_code, value), the index in kRanges of the actions, or
+//   -1 if not mapped. Repeats already resolve as Remapper would resolve them.
+
+#include <linux/input-event-codes.h>
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "keycode_lookup.h"
+#include "remap_operator.h"
+#include "sequence_matcher.h"
+#include "utility/trace_points.h"
+
+// Same as Action, in a form that can be constexpr.
+struct CompiledAction {
+  enum class Type : uint8_t { kKey, kLayerChange, kWait };
+  Type type;
+  // Key code, state index, or milli seconds for the type.
+  int code;
+  // Only for kKey.
+  KeyEventType value;
+};
+
+// Range [begin, end) in kActions.
+struct CompiledActionRange {
+  int begin;
+  int end;
+};
+
+struct CompiledMapping {
+  int state;
+  KeyEvent trigger;
+  int range;
+};
+
+template <int kNumStates, typename Tables>
+class CompiledRemapper {
+  static_assert(kNumStates >= 1, "There must be a default state.");
+
+ public:
+  CompiledRemapper() {
+    combo_matcher_.Add(KillComboKeyCodes());
+    combo_matcher_.Build();
+    held_index_.fill(-1);
+  }
+
+  void SetCallback(std::function<void(int, int)> emit_key_code) {
+    emit_key_code_ = emit_key_code;
+  }
+
+  void SetWaitCallback(std::function<void()> before_wait) {
+    before_wait_ = before_wait;
+  }
+
+  void Process(const int key_code, const int value) {
+    TRACE_POINT(process_enter, key_code, value);
+    if (key_code < 0 || key_code >= KEY_CNT) [[unlikely]] {
+      TRACE_POINT(process_exit, key_code, value);
+      return;
+    }
+    if (fast_keys_held_.any()) [[unlikely]] {
+      TakeOverFastKeysHeld();
+    }
+    if (KeyEventType(value) == KeyEventType::kKeyPress) {
+      input_pressed_.set(key_code);
+    } else if (KeyEventType(value) == KeyEventType::kKeyRelease) {
+      input_pressed_.reset(key_code);
+    }
+    currently_processing_ = key_code;
+
+    ProcessCombos(key_code, value);
+    if (DeactivateLayerByKey(key_code, value)) [[unlikely]] {
+      TRACE_POINT(process_exit, key_code, value);
+      return;
+    }
+
+    const auto [begin, end] = ExpandToActions(key_code, value);
+    if (begin != end) {
+      null_event_applicable_[active_state()] = false;
+      ProcessActions(begin, end);
+    }
+
+    if (KeyEventType(value) == KeyEventType::kKeyRelease &&
+        held_index_[key_code] >= 0) {
+      ProcessKeyEvent(key_code, KeyEventType::kKeyRelease);
+    }
+    TRACE_POINT(process_exit, key_code, value);
+  }
+
+  // See Remapper::ProcessFast().
+  inline bool ProcessFast(const int key_code, const int value) {
+    if (num_active_layers_ != 0 || key_code < 0 || key_code >= KEY_CNT ||
+        !((Tables::kPassthroughKeys[key_code / 64] >> (key_code % 64)) & 1)) {
+      return false;
+    }
+    switch (KeyEventType(value)) {
+      case KeyEventType::kKeyPress:
+        ProcessCombos(key_code, value);
+        fast_keys_held_.set(key_code);
+        break;
+      case KeyEventType::kKeyRepeat:
+        break;
+      case KeyEventType::kKeyRelease:
+        if (!fast_keys_held_.test(key_code)) return false;
+        fast_keys_held_.reset(key_code);
+        break;
+      default:
+        return false;
+    }
+    TRACE_POINT(process_fast, key_code, value);
+    return true;
+  }
+
+  // See Remapper::AdoptHeldKeys().
+  void AdoptHeldKeys(const std::vector<int>& key_codes) {
+    for (const int key_code : key_codes) {
+      if (key_code < 0 || key_code >= KEY_CNT || held_index_[key_code] >= 0) {
+        continue;
+      }
+      Hold(key_code, key_code);
+      input_pressed_.set(key_code);
+      EmitKeyCode(key_code, KeyEventType::kKeyPress);
+    }
+  }
+
+  // See Remapper::ReleaseAll().
+  void ReleaseAll() {
+    TakeOverFastKeysHeld();
+    while (num_active_layers_ > 0) {
+      is_active_[active_layers_[--num_active_layers_].state] = false;
+    }
+    std::vector<std::pair<int, int>> held_keys;
+    for (int i = 0; i < num_held_; ++i) {
+      held_keys.push_back({held_[i].event_seq_num, held_[i].key_code});
+      held_index_[held_[i].key_code] = -1;
+    }
+    num_held_ = 0;
+    input_pressed_.reset();
+    std::sort(held_keys.rbegin(), held_keys.rend());
+    for (const auto& [_, key_code] : held_keys) {
+      EmitKeyCode(key_code, KeyEventType::kKeyRelease);
+    }
+    combo_state_ = SequenceMatcher::kStart;
+  }
+
+  // See Remapper::Reconcile().
+  int Reconcile(const std::bitset<KEY_CNT>& keyboard_pressed) {
+    const auto seen = input_pressed_ | fast_keys_held_;
+    const auto missed_releases = seen & ~keyboard_pressed;
+    const auto missed_presses = keyboard_pressed & ~seen;
+    if (missed_releases.none() && missed_presses.none()) [[likely]] {
+      return 0;
+    }
+    for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+      if (missed_releases.test(key_code)) Process(key_code, 0);
+    }
+    for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+      if (missed_presses.test(key_code)) Process(key_code, 1);
+    }
+    return missed_releases.count() + missed_presses.count();
+  }
+
+  // See Remapper::HeldKeys().
+  std::bitset<KEY_CNT> HeldKeys() const {
+    auto held = fast_keys_held_;
+    for (int i = 0; i < num_held_; ++i) held.set(held_[i].key_code);
+    return held;
+  }
+
+  int num_active_layers() const { return num_active_layers_; }
+  // See Remapper::ActiveLayerKeys().
+  std::vector<int> ActiveLayerKeys() const {
+    std::vector<int> key_codes;
+    for (int i = 0; i < num_active_layers_; ++i) {
+      key_codes.push_back(active_layers_[i].key_code);
+    }
+    return key_codes;
+  }
+
+  // Compiled configs have no chords, texts, autofire or mouse keys, see
+  // EmitCpp().
+  bool has_timers() const { return false; }
+  int64_t NextTimerUs() const { return -1; }
+  void RunTimers(int64_t) {}
+  bool UsesMouseKeys() const { return false; }
+  PointerMotion TakePointerMotion() { return {}; }
+
+  // Nor profiles, the config is the one compiled in.
+  int profile() const { return 0; }
+  int num_profiles() const { return 0; }
+  const std::string& profile_name() const {
+    static const std::string kNoProfile;
+    return kNoProfile;
+  }
+  int ProfileIndex(const std::string&) const { return -1; }
+  void SwitchProfile(int) {}
+
+  // See Remapper::emitted().
+  const std::vector<KeyEvent>& emitted() const { return emitted_; }
+  void ClearEmitted() { emitted_.clear(); }
+
+  // Same format as Remapper::DumpConfig().
+  void DumpConfig(std::ostream& os = std::cout) const {
+    const auto ShowActions = [&os](int range_index) {
+      const auto& range = Tables::kRanges[range_index];
+      for (int i = range.begin; i < range.end; ++i) {
+        const auto& action = Tables::kActions[i];
+        switch (action.type) {
+          case CompiledAction::Type::kKey:
+            os << "    Key: " << KeyEvent{action.code, action.value}
+               << std::endl;
+            break;
+          case CompiledAction::Type::kWait:
+            os << "    Wait: " << action.code << "ms" << std::endl;
+            break;
+          case CompiledAction::Type::kLayerChange:
+            os << "    Layer Change: " << action.code << std::endl;
+            break;
+        }
+      }
+    };
+    for (int state = 0; state < kNumStates; ++state) {
+      os << "State #" << state << std::endl;
+      os << "  Other keys: "
+         << (Tables::kAllowOtherKeys[state] ? "Allow" : "Block") << std::endl;
+      for (const auto& mapping : Tables::kMappings) {
+        if (mapping.state != state) continue;
+        os << "  On: " << mapping.trigger << std::endl;
+        ShowActions(mapping.range);
+      }
+      const auto& null_range =
+          Tables::kRanges[Tables::kNullEventActions[state]];
+      if (null_range.begin != null_range.end) {
+        os << "  On nothing:" << std::endl;
+        ShowActions(Tables::kNullEventActions[state]);
+      }
+    }
+  }
+
+ private:
+  using ActionIterator = const CompiledAction*;
+
+  struct LayerActivation {
+    int event_seq_num;
+    int key_code;
+    int state;
+  };
+
+  struct KeyHeldInfo {
+    int key_code;
+    int key_origin;
+    int event_seq_num;
+  };
+
+  inline int active_state() const {
+    return num_active_layers_ > 0 ? active_layers_[num_active_layers_ - 1].state
+                                  : 0;
+  }
+
+  void EmitKeyCode(int key_code, KeyEventType value) {
+    if (emit_key_code_ != nullptr) {
+      emit_key_code_(key_code, int(value));
+    } else {
+      emitted_.push_back({key_code, value});
+    }
+  }
+
+  void Hold(int key_code, int key_origin) {
+    const KeyHeldInfo info{key_code, key_origin, event_seq_num_++};
+    if (held_index_[key_code] >= 0) {
+      held_[held_index_[key_code]] = info;
+    } else {
+      held_index_[key_code] = num_held_;
+      held_[num_held_++] = info;
+    }
+  }
+
+  void Unhold(int key_code) {
+    const int index = held_index_[key_code];
+    held_[index] = held_[--num_held_];
+    held_index_[held_[index].key_code] = index;
+    held_index_[key_code] = -1;
+  }
+
+  void TakeOverFastKeysHeld() {
+    for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+      if (fast_keys_held_.test(key_code)) Hold(key_code, key_code);
+    }
+    input_pressed_ |= fast_keys_held_;
+    fast_keys_held_.reset();
+  }
+
+  bool DeactivateLayerByKey(int key_code, int value) {
+    if (KeyEventType(value) != KeyEventType::kKeyRelease) return false;
+    for (int index = 0; index < num_active_layers_; ++index) {
+      if (active_layers_[index].key_code == key_code) {
+        DeactivateNLayers(num_active_layers_ - index);
+        ProcessKeyEvent(key_code, KeyEventType::kKeyRelease);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void DeactivateNLayers(const int n) {
+    for (int count = 0; count < n; ++count) {
+      if (num_active_layers_ == 0) {
+        std::cerr << "WARNING: Trying to deactivate when no layer is active."
+                  << std::endl;
+        return;
+      }
+      const LayerActivation layer = active_layers_[num_active_layers_ - 1];
+      is_active_[layer.state] = false;
+      if (null_event_applicable_[layer.state]) {
+        const auto& range =
+            Tables::kRanges[Tables::kNullEventActions[layer.state]];
+        ProcessActions(Tables::kActions.data() + range.begin,
+                       Tables::kActions.data() + range.end);
+      }
+      // Release keys held due to this layer, in reverse order.
+      std::vector<std::pair<int, int>> removed_keys;
+      for (int i = 0; i < num_held_; ++i) {
+        const auto& info = held_[i];
+        if (info.event_seq_num > layer.event_seq_num &&
+            info.key_origin != info.key_code) {
+          removed_keys.push_back({info.event_seq_num, info.key_code});
+        }
+      }
+      std::sort(removed_keys.begin(), removed_keys.end());
+      for (auto it = removed_keys.rbegin(); it != removed_keys.rend(); ++it) {
+        Unhold(it->second);
+        EmitKeyCode(it->second, KeyEventType::kKeyRelease);
+      }
+      --num_active_layers_;
+    }
+  }
+
+  void ProcessKeyEvent(int key_code, KeyEventType value) {
+    switch (value) {
+      case KeyEventType::kKeyPress:
+        Hold(key_code, currently_processing_);
+        EmitKeyCode(key_code, value);
+        break;
+      case KeyEventType::kKeyRepeat:
+        // If the repeating key was used to activate a layer, do nothing.
+        for (int i = 0; i < num_active_layers_; ++i) {
+          if (active_layers_[i].key_code == key_code) return;
+        }
+        EmitKeyCode(key_code, value);
+        break;
+      case KeyEventType::kKeyRelease:
+        if (held_index_[key_code] < 0) return;
+        Unhold(key_code);
+        EmitKeyCode(key_code, value);
+        break;
+      default:
+        std::cerr << "WARNING: Unimplemented key code value " << int(value)
+                  << std::endl;
+        break;
+    }
+  }
+
+  std::pair<ActionIterator, ActionIterator> ExpandToActions(int key_code,
+                                                            int value) {
+    for (int index = num_active_layers_ - 1; index >= -1; --index) {
+      const int state = index >= 0 ? active_layers_[index].state : 0;
+      const int range_index = Tables::Lookup(state, key_code, value);
+      if (range_index >= 0) {
+        const auto& range = Tables::kRanges[range_index];
+        return {Tables::kActions.data() + range.begin,
+                Tables::kActions.data() + range.end};
+      }
+      if (!Tables::kAllowOtherKeys[state]) return {nullptr, nullptr};
+    }
+    // Nothing matched or blocked.
+    pass_through_ = {CompiledAction::Type::kKey, key_code, KeyEventType(value)};
+    return {&pass_through_, &pass_through_ + 1};
+  }
+
+  void ProcessActions(ActionIterator begin, ActionIterator end) {
+    for (auto it = begin; it != end; ++it) {
+      switch (it->type) {
+        case CompiledAction::Type::kKey:
+          ProcessKeyEvent(it->code, it->value);
+          break;
+        case CompiledAction::Type::kWait:
+          if (before_wait_ != nullptr) before_wait_();
+          std::this_thread::sleep_for(std::chrono::milliseconds(it->code));
+          break;
+        case CompiledAction::Type::kLayerChange:
+          if (is_active_[it->code]) {
+            std::cerr << "WARNING: Attempt to activate an already active "
+                         "layer. Denied."
+                      << std::endl;
+            break;
+          }
+          is_active_[it->code] = true;
+          null_event_applicable_[it->code] = true;
+          active_layers_[num_active_layers_++] = LayerActivation{
+              event_seq_num_++, currently_processing_, it->code};
+          break;
+      }
+    }
+  }
+
+  void ProcessCombos(int key_code, int value) {
+    if (KeyEventType(value) != KeyEventType::kKeyPress) return;
+    combo_state_ = combo_matcher_.Next(combo_state_, key_code);
+    if (combo_matcher_.Match(combo_state_) == 0) [[unlikely]] {
+      throw std::runtime_error("Kill combo accepted.");
+    }
+  }
+
+  // A state can be active only once, so there are at most kNumStates layers.
+  std::array<LayerActivation, kNumStates> active_layers_;
+  int num_active_layers_ = 0;
+  std::array<bool, kNumStates> is_active_{};
+  std::array<bool, kNumStates> null_event_applicable_{};
+
+  // Keys held, in no particular order, and index of each key in it or -1.
+  std::array<KeyHeldInfo, KEY_CNT> held_;
+  int num_held_ = 0;
+  std::array<int16_t, KEY_CNT> held_index_;
+  std::bitset<KEY_CNT> fast_keys_held_;
+  // See RemapState::input_pressed.
+  std::bitset<KEY_CNT> input_pressed_;
+
+  int event_seq_num_ = 0;
+  int currently_processing_ = 0;
+  CompiledAction pass_through_;
+
+  std::function<void(int, int)> emit_key_code_ = nullptr;
+  std::function<void()> before_wait_ = nullptr;
+  std::vector<KeyEvent> emitted_;
+
+  // Only has kKillCombo. Compiled configs have no other sequences.
+  SequenceMatcher combo_matcher_;
+  int combo_state_ = SequenceMatcher::kStart;
+};
+
+#endif  // __COMPILED_REMAPPER_H
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <linux/input-event-codes.h>
+
+#include <catch2/catch_test_macros.hpp>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compiled_remapper_test_config.h"
+#include "config_parser.h"
+#include "profile_workload.h"
+#include "remap_operator.h"
+#include "test_utils.h"
+
+// Random sequence of presses, repeats and releases, as a keyboard would send.
+std::vector<std::pair<int, int>> RandomEvents(int count) {
+  const std::vector<int> keys = {
+      KEY_CAPSLOCK, KEY_RIGHTCTRL, KEY_LEFTSHIFT, KEY_DELETE, KEY_END,
+      KEY_ESC,      KEY_A,         KEY_D,         KEY_1,      KEY_2,
+      KEY_X,        KEY_Z,         KEY_W,         KEY_F1};
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<std::size_t> key_index(0, keys.size() - 1);
+  std::bernoulli_distribution release(0.6);
+  std::set<int> pressed;
+  std::vector<std::pair<int, int>> events;
+  while (int(events.size()) < count) {
+    const int key = keys[key_index(generator)];
+    if (!pressed.contains(key)) {
+      pressed.insert(key);
+      events.push_back({key, 1});
+    } else if (release(generator)) {
+      pressed.erase(key);
+      events.push_back({key, 0});
+    } else {
+      events.push_back({key, 2});
+    }
+  }
+  return events;
+}
+
+SCENARIO("Compiled config behaves as Remapper") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse(ReadConfigLines(KEYSHIFT_TEST_CONFIG)));
+  remapper.UpdatePassthroughKeys();
+  CompiledConfigRemapper compiled_remapper;
+
+  const auto events = RandomEvents(20000);
+
+  THEN("Same outcomes") {
+    CHECK(GetOutcomes(compiled_remapper, true, events) ==
+          GetOutcomes(remapper, true, events));
+  }
+
+  THEN("Same outcomes with the fast path") {
+    CHECK(GetOutcomes(compiled_remapper, true, events, /*fast_path=*/true) ==
+          GetOutcomes(remapper, true, events, /*fast_path=*/true));
+  }
+
+  THEN("Same corrections when releases are lost") {
+    GetOutcomes(compiled_remapper, false, events);
+    GetOutcomes(remapper, false, events);
+    std::vector<std::pair<int, int>> compiled_emitted;
+    std::vector<std::pair<int, int>> emitted;
+    compiled_remapper.SetCallback([&compiled_emitted](int key, int value) {
+      compiled_emitted.push_back({key, value});
+    });
+    remapper.SetCallback(
+        [&emitted](int key, int value) { emitted.push_back({key, value}); });
+    CHECK(compiled_remapper.Reconcile({}) == remapper.Reconcile({}));
+    CHECK(!emitted.empty());
+    CHECK(compiled_emitted == emitted);
+    CHECK(compiled_remapper.HeldKeys().none());
+    CHECK(remapper.HeldKeys().none());
+  }
+
+  THEN("Repeat of a mapped key") {
+    CHECK(GetOutcomes(compiled_remapper, false,
+                      {{KEY_1, 1}, {KEY_1, 2}, {KEY_1, 0}}) ==
+          vector<string>{"Out: P KEY_2", "Out: T KEY_2", "Out: R KEY_2"});
+  }
+
+  THEN("Layer with null event") {
+    CHECK(GetOutcomes(compiled_remapper, false,
+                      {{KEY_CAPSLOCK, 1}, {KEY_CAPSLOCK, 0}}) ==
+          vector<string>{"Out: P KEY_ESC", "Out: R KEY_ESC"});
+  }
+}
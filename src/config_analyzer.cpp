@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "config_analyzer.h"
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "remap_operator.h"
+
+struct ActionsCost {
+  int wait_ms = 0;
+  int events = 0;
+};
+
+// Texts are not counted, as they are typed over time without waiting, see
+// ConfigAnalysis::longest_text_events.
+ActionsCost CostOf(const std::vector<Action>& actions) {
+  ActionsCost cost;
+  for (const auto& action : actions) {
+    if (std::holds_alternative<KeyEvent>(action)) {
+      ++cost.events;
+    } else if (std::holds_alternative<ActionWait>(action)) {
+      cost.wait_ms += std::get<ActionWait>(action).milli_seconds;
+    }
+  }
+  return cost;
+}
+
+void UpdateWorstCase(ConfigAnalysis::WorstCase& worst_case, int value,
+                     KeyEvent input, int state) {
+  if (value <= worst_case.value) return;
+  worst_case.value = value;
+  worst_case.input = input;
+  worst_case.state = state;
+}
+
+// Explores layer stacks reachable from the default state, by following the
+// layer changes in the mappings which can decide an input.
+class LayerStackExplorer {
+ public:
+  LayerStackExplorer(const std::vector<KeyboardState>& states,
+                     ConfigAnalysis& analysis)
+      : states_(states), analysis_(analysis), reachable_(states.size()) {
+    // Upper bound of keys a layer may leave held, to release when it is
+    // deactivated.
+    for (const auto& state : states_) {
+      std::set<int> pressed;
+      const auto add_pressed = [&pressed](const std::vector<Action>& actions) {
+        for (const auto& action : actions) {
+          if (std::holds_alternative<KeyEvent>(action) &&
+              std::get<KeyEvent>(action).value == KeyEventType::kKeyPress) {
+            pressed.insert(std::get<KeyEvent>(action).key_code);
+          }
+        }
+      };
+      for (const auto& [_, actions] : state.action_map) add_pressed(actions);
+      add_pressed(state.null_event_actions);
+      max_held_keys_.push_back(pressed.size());
+    }
+  }
+
+  void Explore() {
+    Visit({}, std::nullopt);
+    for (std::size_t state = 1; state < states_.size(); ++state) {
+      if (!reachable_[state]) analysis_.unreachable_states.push_back(state);
+    }
+    for (std::size_t state = 0; state < states_.size(); ++state) {
+      if (state > 0 && !reachable_[state]) continue;
+      std::vector<KeyEvent> unused;
+      for (const auto& [trigger, _] : states_[state].action_map) {
+        if (!used_.contains({state, Trigger(trigger)})) {
+          unused.push_back(trigger);
+        }
+      }
+      std::sort(unused.begin(), unused.end(),
+                [](const KeyEvent& lhs, const KeyEvent& rhs) {
+                  return Trigger(lhs) < Trigger(rhs);
+                });
+      for (const auto& trigger : unused) {
+        analysis_.unused_mappings.push_back({int(state), trigger});
+      }
+    }
+  }
+
+ private:
+  struct Layer {
+    int state;
+    // Key which activated it.
+    int key_code;
+
+    bool operator<(const Layer& other) const {
+      return std::pair(state, key_code) <
+             std::pair(other.state, other.key_code);
+    }
+  };
+
+  static std::pair<int, int> Trigger(const KeyEvent& key_event) {
+    return {key_event.key_code, int(key_event.value)};
+  }
+
+  // Calls fn(state, trigger, actions) for each mapping which decides its input
+  // with the stack active, i.e. the topmost one which maps or blocks it.
+  template <typename Fn>
+  void ForEachDecidingMapping(const std::vector<Layer>& stack, Fn fn) const {
+    std::set<std::pair<int, int>> decided_above;
+    for (int index = int(stack.size()) - 1; index >= -1; --index) {
+      const int state = index >= 0 ? stack[index].state : 0;
+      for (const auto& [trigger, actions] : states_[state].action_map) {
+        if (!decided_above.contains(Trigger(trigger))) {
+          fn(state, trigger, actions);
+        }
+      }
+      for (const auto& [trigger, _] : states_[state].action_map) {
+        decided_above.insert(Trigger(trigger));
+      }
+      if (!states_[state].allow_other_keys) break;
+    }
+  }
+
+  // Returns the stack after the layer changes in the actions.
+  std::vector<Layer> ApplyLayerChanges(const std::vector<Layer>& stack,
+                                       const std::vector<Action>& actions,
+                                       int key_code) const {
+    auto next_stack = stack;
+    for (const auto& action : actions) {
+      if (!std::holds_alternative<ActionLayerChange>(action)) continue;
+      const int state = std::get<ActionLayerChange>(action).layer_index;
+      if (state >= int(states_.size())) continue;
+      // Activating an active layer is denied.
+      if (std::any_of(
+              next_stack.begin(), next_stack.end(),
+              [state](const Layer& layer) { return layer.state == state; })) {
+        continue;
+      }
+      next_stack.push_back({state, key_code});
+    }
+    return next_stack;
+  }
+
+  // always_activating are keys which activated a layer whenever pressed, in
+  // this stack and all stacks below it. They cannot be released without
+  // deactivating that layer.
+  void Visit(const std::vector<Layer>& stack,
+             const std::optional<std::set<int>>& always_activating_below) {
+    if (visited_.contains(stack)) return;
+    if (int(visited_.size()) >= kMaxAnalyzedLayerStacks) {
+      analysis_.complete = false;
+      return;
+    }
+    visited_.insert(stack);
+    analysis_.max_layer_depth =
+        std::max(analysis_.max_layer_depth, int(stack.size()));
+    std::set<int> activation_keys;
+    for (const auto& layer : stack) {
+      reachable_[layer.state] = true;
+      activation_keys.insert(layer.key_code);
+    }
+
+    // Releasing an activation key deactivates its layer, and all above it.
+    ActionsCost deactivation;
+    for (int index = int(stack.size()) - 1; index >= 0; --index) {
+      const auto& layer = stack[index];
+      const auto null_event_cost =
+          CostOf(states_[layer.state].null_event_actions);
+      deactivation.wait_ms += null_event_cost.wait_ms;
+      deactivation.events +=
+          null_event_cost.events + max_held_keys_[layer.state];
+      const KeyEvent input = KeyReleaseEvent(layer.key_code);
+      UpdateWorstCase(analysis_.wait_ms, deactivation.wait_ms, input,
+                      layer.state);
+      // Including the release of the activation key itself.
+      UpdateWorstCase(analysis_.events, deactivation.events + 1, input,
+                      layer.state);
+    }
+
+    std::set<int> always_activating;
+    ForEachDecidingMapping(stack, [&](int, const KeyEvent& trigger,
+                                      const std::vector<Action>& actions) {
+      if (trigger.value != KeyEventType::kKeyPress) return;
+      if (always_activating_below.has_value() &&
+          !always_activating_below->contains(trigger.key_code)) {
+        return;
+      }
+      if (ApplyLayerChanges(stack, actions, trigger.key_code).size() !=
+          stack.size()) {
+        always_activating.insert(trigger.key_code);
+      }
+    });
+
+    // Any other input is decided by the topmost state which maps it.
+    ForEachDecidingMapping(stack, [&](int state, const KeyEvent& trigger,
+                                      const std::vector<Action>& actions) {
+      // Held keys cannot be pressed again, and their release deactivates.
+      if (activation_keys.contains(trigger.key_code) &&
+          trigger.value != KeyEventType::kKeyRepeat) {
+        return;
+      }
+      if (trigger.value == KeyEventType::kKeyRelease &&
+          always_activating.contains(trigger.key_code)) {
+        return;
+      }
+      used_.insert({state, Trigger(trigger)});
+
+      const auto cost = CostOf(actions);
+      UpdateWorstCase(analysis_.wait_ms, cost.wait_ms, trigger, state);
+      // A release also releases the key itself, if it was held.
+      const bool is_release = trigger.value == KeyEventType::kKeyRelease;
+      UpdateWorstCase(analysis_.events, cost.events + (is_release ? 1 : 0),
+                      trigger, state);
+
+      const auto next_stack =
+          ApplyLayerChanges(stack, actions, trigger.key_code);
+      if (next_stack.size() != stack.size()) {
+        Visit(next_stack, always_activating);
+      }
+    });
+  }
+
+  const std::vector<KeyboardState>& states_;
+  ConfigAnalysis& analysis_;
+  std::vector<bool> reachable_;
+  std::vector<int> max_held_keys_;
+  std::set<std::vector<Layer>> visited_;
+  // Mappings which decide some input, as state and trigger.
+  std::set<std::pair<int, std::pair<int, int>>> used_;
+};
+
+ConfigAnalysis AnalyzeConfig(const Remapper& remapper) {
+  ConfigAnalysis analysis;
+  // Any key which is not mapped passes through as one event.
+  analysis.events.value = 1;
+  LayerStackExplorer(remapper.states(), analysis).Explore();
+  const auto& config = *remapper.config();
+  if (!config.chords.empty()) analysis.chord_hold_ms = config.chord_window_ms;
+  for (const auto& text : config.texts) {
+    analysis.longest_text_events =
+        std::max(analysis.longest_text_events, int(text.size()));
+  }
+  // Chords, sequences and modifier conditions are done in the default state.
+  const auto update_worst_cases =
+      [&analysis](const std::vector<Action>& actions, KeyEvent input) {
+        const auto cost = CostOf(actions);
+        UpdateWorstCase(analysis.wait_ms, cost.wait_ms, input, 0);
+        UpdateWorstCase(analysis.events, cost.events, input, 0);
+      };
+  for (const auto& chord : config.chords) {
+    update_worst_cases(chord.press_actions, KeyPressEvent(chord.keys.back()));
+    update_worst_cases(chord.release_actions,
+                       KeyReleaseEvent(chord.keys.front()));
+  }
+  for (std::size_t index = 1; index < config.sequences.size(); ++index) {
+    const auto& sequence = config.sequences[index];
+    update_worst_cases(sequence.actions, KeyPressEvent(sequence.keys.back()));
+  }
+  // Modifier conditions are looked up as if in the default state.
+  for (const auto& [trigger, actions] : config.modified_action_map) {
+    update_worst_cases(actions, WithoutModifiers(trigger));
+  }
+  return analysis;
+}
+
+std::ostream& operator<<(std::ostream& os, const ConfigAnalysis& analysis) {
+  const auto show_worst_case = [&os](const ConfigAnalysis::WorstCase& worst) {
+    if (worst.input.has_value()) {
+      os << ", on " << worst.input.value() << " in state #" << worst.state;
+    }
+    os << std::endl;
+  };
+  os << "Worst case wait for one input: " << analysis.wait_ms.value << "ms";
+  show_worst_case(analysis.wait_ms);
+  os << "Worst case events for one input: " << analysis.events.value;
+  show_worst_case(analysis.events);
+  if (analysis.chord_hold_ms > 0) {
+    os << "Chord keys held back for up to: " << analysis.chord_hold_ms << "ms"
+       << std::endl;
+  }
+  if (analysis.longest_text_events > 0) {
+    os << "Longest text: " << analysis.longest_text_events
+       << " key events, typed in bursts" << std::endl;
+  }
+  os << "Deepest layer stack: " << analysis.max_layer_depth << std::endl;
+  for (const int state : analysis.unreachable_states) {
+    os << "Unreachable state: #" << state << std::endl;
+  }
+  for (const auto& unused : analysis.unused_mappings) {
+    os << "Unused mapping: " << unused.trigger << " in state #" << unused.state
+       << std::endl;
+  }
+  if (!analysis.complete) {
+    os << "WARNING: More than " << kMaxAnalyzedLayerStacks
+       << " layer stacks, analysis is incomplete." << std::endl;
+  }
+  return os;
+}
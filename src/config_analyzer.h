@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __CONFIG_ANALYZER_H
+#define __CONFIG_ANALYZER_H
+
+// Static analysis of a parsed config, for `keyshift --analyze`.
+//
+// Walks all layer stacks reachable from the default state, and finds for a
+// single input event the worst case of -
+// - Total ActionWait, i.e. the latency added by the config.
+// - Events emitted, i.e. the amplification.
+// Deactivating layers is included, with their null events.
+//
+// Also finds states that can never be activated, and mappings that can never
+// be used, e.g. because a layer above always decides the same key.
+
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "remap_operator.h"
+
+// Layer stacks explored, after which the analysis stops.
+const int kMaxAnalyzedLayerStacks = 100000;
+
+struct ConfigAnalysis {
+  // The worst case, and an input which causes it.
+  struct WorstCase {
+    int value = 0;
+    std::optional<KeyEvent> input;
+    // Where the input was resolved. For layers deactivated by the input, the
+    // lowest one.
+    int state = 0;
+  };
+  WorstCase wait_ms;
+  WorstCase events;
+
+  // Longest time a key can be held back for a chord, before the wait above.
+  // Zero without chords.
+  int chord_hold_ms = 0;
+
+  // Texts are typed in bursts while input goes on, so they are not in the
+  // worst cases above. Zero without texts.
+  int longest_text_events = 0;
+
+  // Maximum number of layers active at once.
+  int max_layer_depth = 0;
+
+  std::vector<int> unreachable_states;
+
+  struct UnusedMapping {
+    int state;
+    KeyEvent trigger;
+  };
+  std::vector<UnusedMapping> unused_mappings;
+
+  // False if there were more than kMaxAnalyzedLayerStacks to explore.
+  bool complete = true;
+
+  friend std::ostream& operator<<(std::ostream& os,
+                                  const ConfigAnalysis& analysis);
+};
+
+ConfigAnalysis AnalyzeConfig(const Remapper& remapper);
+
+#endif  // __CONFIG_ANALYZER_H
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "config_analyzer.h"
+
+#include <linux/input-event-codes.h>
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "config_parser.h"
+#include "remap_operator.h"
+
+ConfigAnalysis Analyze(const std::vector<std::string>& config) {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  if (!config_parser.Parse(config)) {
+    throw std::runtime_error("Could not parse the config!");
+  }
+  return AnalyzeConfig(remapper);
+}
+
+SCENARIO("Worst case wait and events") {
+  GIVEN("No waits") {
+    const auto analysis = Analyze({"A = B", "CAPSLOCK + 1 = F1"});
+    CHECK(analysis.wait_ms.value == 0);
+    CHECK(analysis.max_layer_depth == 1);
+    CHECK(analysis.unreachable_states.empty());
+  }
+
+  GIVEN("Waits in a mapping") {
+    const auto analysis = Analyze({"A = ^H 50ms ~H 50ms I"});
+    CHECK(analysis.wait_ms.value == 100);
+    CHECK(analysis.wait_ms.input == KeyPressEvent(KEY_A));
+    CHECK(analysis.wait_ms.state == 0);
+    // ^H ~H ^I, since I is released when A is.
+    CHECK(analysis.events.value == 3);
+  }
+
+  GIVEN("Waits in null events of stacked layers") {
+    const auto analysis =
+        Analyze({"^RIGHTCTRL = ^RIGHTCTRL", "RIGHTCTRL + * = *",
+                 "RIGHTCTRL + nothing = 20ms", "CAPSLOCK + 1 = F1",
+                 "CAPSLOCK + nothing = 30ms ESC"});
+    CHECK(analysis.max_layer_depth == 2);
+    // Releasing RIGHTCTRL after CAPSLOCK deactivates both.
+    CHECK(analysis.wait_ms.value == 50);
+    CHECK(analysis.wait_ms.input == KeyReleaseEvent(KEY_RIGHTCTRL));
+  }
+}
+
+SCENARIO("Unused parts of the config") {
+  GIVEN("Layer key release") {
+    const auto analysis = Analyze({"~CAPSLOCK = ESC", "CAPSLOCK + 1 = F1"});
+    REQUIRE(analysis.unused_mappings.size() == 1);
+    CHECK(analysis.unused_mappings[0].state == 0);
+    CHECK(analysis.unused_mappings[0].trigger ==
+          KeyReleaseEvent(KEY_CAPSLOCK));
+  }
+
+  GIVEN("Layer which blocks other layers") {
+    const auto analysis =
+        Analyze({"CAPSLOCK + 1 = F1", "DELETE + END = VOLUMEUP"});
+    // DELETE cannot be pressed while CAPSLOCK blocks it, and vice versa.
+    CHECK(analysis.max_layer_depth == 1);
+    CHECK(analysis.unused_mappings.empty());
+  }
+
+  GIVEN("Layer which is never activated") {
+    Remapper remapper;
+    remapper.AddMapping("", KeyPressEvent(KEY_CAPSLOCK),
+                        {remapper.ActionActivateState("caps")});
+    remapper.AddMapping("caps", KeyPressEvent(KEY_1),
+                        {remapper.ActionActivateState("caps1")});
+    remapper.AddMapping("caps1", KeyPressEvent(KEY_2), {KeyPressEvent(KEY_3)});
+    remapper.AddMapping("orphan", KeyPressEvent(KEY_2), {KeyPressEvent(KEY_4)});
+    const auto analysis = AnalyzeConfig(remapper);
+    CHECK(analysis.max_layer_depth == 2);
+    REQUIRE(analysis.unreachable_states.size() == 1);
+    CHECK(analysis.unreachable_states[0] == 3);
+  }
+}
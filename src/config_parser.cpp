@@ -16,13 +16,20 @@
 
 #include "config_parser.h"
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
 #include <expected>
 #include <format>
 #include <iostream>
 #include <map>
+#include <optional>
 #include <set>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "keycode_lookup.h"
@@ -31,8 +38,6 @@
 
 using std::string;
 
-const string kDefaultLayerName = "";
-
 // Any wait larger than this will not be allowed.
 const int kMaxWaitMs = 1000;
 
@@ -42,17 +47,51 @@ const string kNothingToken = "nothing";
 
 // Utility functions.
 
+// Finds the first of chars in line from pos, skipping quoted texts like
+// "a = b". pos must not be within a text.
+std::size_t FindUnquoted(const string& line, const string& chars,
+                         std::size_t pos = 0) {
+  bool quoted = false;
+  for (; pos < line.size(); ++pos) {
+    const char c = line[pos];
+    if (quoted && c == '\\') {
+      ++pos;
+    } else if (c == '"') {
+      quoted = !quoted;
+    } else if (!quoted && chars.find(c) != string::npos) {
+      return pos;
+    }
+  }
+  return string::npos;
+}
+
 string RemoveComment(string line) {
-  // Support both // or # as comment begin.
-  for (const string comment_marker : {"//", "#"}) {
-    auto pos = line.find(comment_marker);
-    if (pos != string::npos) {
-      line = line.substr(0, pos);
+  // Support both // or # as comment begin, except in texts.
+  for (auto pos = FindUnquoted(line, "/#"); pos != string::npos;
+       pos = FindUnquoted(line, "/#", pos + 1)) {
+    if (line[pos] == '#' || line.compare(pos, 2, "//") == 0) {
+      return line.substr(0, pos);
     }
   }
   return line;
 }
 
+// Same as StringSplit(assignment, ' '), but keeps texts with spaces whole.
+std::vector<string> SplitTokens(const string& assignment) {
+  std::vector<string> tokens;
+  std::size_t start = 0;
+  while (start < assignment.size()) {
+    const auto end = FindUnquoted(assignment, " ", start);
+    if (end == string::npos) {
+      tokens.push_back(assignment.substr(start));
+      break;
+    }
+    tokens.push_back(assignment.substr(start, end - start));
+    start = end + 1;
+  }
+  return tokens;
+}
+
 string StringTrim(const string& line) {
   static auto trim_chars = " \t\n\r\f\v";
   auto start = line.find_first_not_of(trim_chars);
@@ -79,22 +118,150 @@ ErrorStrOr<PrefixedKey> SplitKeyPrefix(string name) {
     prefix = name[0];
     name = name.substr(1);
   }
-  const auto& keycode = StartsWith(name, "KEY_") ? NameToKeyCode(name)
-                                                 : NameToKeyCode("KEY_" + name);
+  // Mouse buttons are only known as BTN_*.
+  const auto& keycode =
+      StartsWith(name, "KEY_") || StartsWith(name, "BTN_")
+          ? NameToKeyCode(name)
+          : NameToKeyCode("KEY_" + name);
   if (!keycode.has_value()) {
     return std::unexpected(std::format("Unknown key code '{}'.", name));
   }
   return PrefixedKey{prefix, keycode.value()};
 }
 
-std::string LayerNameFromKey(int keycode) {
-  return KeyCodeToName(keycode) + "_layer";
+struct TypedKey {
+  int key_code;
+  bool shift;
+};
+
+// How to type a character, on a US layout.
+std::optional<TypedKey> CharToKey(char c) {
+  static const std::map<char, TypedKey> kKeys = [] {
+    std::map<char, TypedKey> keys = {
+        {' ', {KEY_SPACE, false}},     {'\n', {KEY_ENTER, false}},
+        {'\t', {KEY_TAB, false}},      {'-', {KEY_MINUS, false}},
+        {'_', {KEY_MINUS, true}},      {'=', {KEY_EQUAL, false}},
+        {'+', {KEY_EQUAL, true}},      {'[', {KEY_LEFTBRACE, false}},
+        {'{', {KEY_LEFTBRACE, true}},  {']', {KEY_RIGHTBRACE, false}},
+        {'}', {KEY_RIGHTBRACE, true}}, {'\\', {KEY_BACKSLASH, false}},
+        {'|', {KEY_BACKSLASH, true}},  {';', {KEY_SEMICOLON, false}},
+        {':', {KEY_SEMICOLON, true}},  {'\'', {KEY_APOSTROPHE, false}},
+        {'"', {KEY_APOSTROPHE, true}}, {'`', {KEY_GRAVE, false}},
+        {'~', {KEY_GRAVE, true}},      {',', {KEY_COMMA, false}},
+        {'<', {KEY_COMMA, true}},      {'.', {KEY_DOT, false}},
+        {'>', {KEY_DOT, true}},        {'/', {KEY_SLASH, false}},
+        {'?', {KEY_SLASH, true}},
+    };
+    const string shifted_digits = ")!@#$%^&*(";
+    for (char digit = '0'; digit <= '9'; ++digit) {
+      const int key_code = NameToKeyCode(string("KEY_") + digit).value();
+      keys[digit] = {key_code, false};
+      keys[shifted_digits[digit - '0']] = {key_code, true};
+    }
+    for (char letter = 'A'; letter <= 'Z'; ++letter) {
+      const int key_code = NameToKeyCode(string("KEY_") + letter).value();
+      keys[letter] = {key_code, true};
+      keys[letter - 'A' + 'a'] = {key_code, false};
+    }
+    return keys;
+  }();
+  const auto it = kKeys.find(c);
+  if (it == kKeys.end()) return std::nullopt;
+  return it->second;
+}
+
+// Converts a quoted text like "Hi!" to the key events which type it. Each
+// character is typed on its own, with Shift around it if needed.
+ErrorStrOr<std::vector<KeyEvent>> TextToKeyEvents(const string& token) {
+  std::vector<KeyEvent> key_events;
+  for (std::size_t pos = 1; pos < token.size(); ++pos) {
+    char c = token[pos];
+    if (c == '"') {
+      if (pos + 1 != token.size()) {
+        return std::unexpected(
+            std::format("Unexpected characters after text {}.", token));
+      }
+      if (key_events.empty()) return std::unexpected("Text is empty.");
+      return key_events;
+    }
+    if (c == '\\' && pos + 1 < token.size()) {
+      c = token[++pos];
+      if (c == 'n') {
+        c = '\n';
+      } else if (c == 't') {
+        c = '\t';
+      } else if (c != '"' && c != '\\') {
+        return std::unexpected(
+            std::format("Unknown escape \\{} in text {}.", c, token));
+      }
+    }
+    const auto key = CharToKey(c);
+    if (!key.has_value()) {
+      return std::unexpected(
+          std::format("Cannot type '{}' in text {}.", c, token));
+    }
+    if (key->shift) key_events.push_back(KeyPressEvent(KEY_LEFTSHIFT));
+    key_events.push_back(KeyPressEvent(key->key_code));
+    key_events.push_back(KeyReleaseEvent(key->key_code));
+    if (key->shift) key_events.push_back(KeyReleaseEvent(KEY_LEFTSHIFT));
+  }
+  return std::unexpected(std::format("Text {} has no closing quote.", token));
+}
+
+bool IsAutofire(const string& token) {
+  return !token.starts_with('"') && token.find('@') != string::npos;
+}
+
+// Parses an autofire like "SPACE@20Hz".
+ErrorStrOr<ActionAutofire> ParseAutofire(const string& token) {
+  const auto at = token.find('@');
+  ASSIGN_OR_RETURN(const auto key, SplitKeyPrefix(token.substr(0, at)));
+  if (key.prefix.has_value()) {
+    return std::unexpected("Prefix (^ or ~) for autofire keys is not allowed.");
+  }
+  const string rate = token.substr(at + 1);
+  int hz = 0;
+  const char* end = rate.data() + rate.size() - 2;
+  if (!rate.ends_with("Hz") && !rate.ends_with("hz")) end = nullptr;
+  if (end == nullptr || std::from_chars(rate.data(), end, hz).ptr != end ||
+      hz < 1 || hz > kMaxAutofireHz) {
+    return std::unexpected(std::format(
+        "Autofire rate must be 1Hz to {}Hz, not {}.", kMaxAutofireHz, rate));
+  }
+  return ActionAutofire{key.key, 1000000 / hz};
+}
+
+// Parses a mouse key like "MOUSE_LEFT", see kMouseKeyNames.
+std::optional<MouseKeyDirection> ParseMouseKey(const string& token) {
+  for (int index = 0; index < kNumMouseKeyDirections; ++index) {
+    if (token == kMouseKeyNames[index]) return MouseKeyDirection(index);
+  }
+  return std::nullopt;
+}
+
+// Autofire and mouse keys go on for as long as the key is held.
+bool IsWhileHeld(const string& token) {
+  return IsAutofire(token) || ParseMouseKey(token).has_value();
+}
+
+// Switches profile, e.g. "profile:game".
+const string kProfilePrefix = "profile:";
+
+// Texts, autofire, mouse keys and profile switches are done in full on press,
+// and leave nothing to release.
+bool IsDoneOnPress(const string& token) {
+  return token.starts_with('"') || IsWhileHeld(token) ||
+         token.starts_with(kProfilePrefix);
 }
 
 // Class methods.
 
 ConfigParser::ConfigParser(Remapper* remapper) { remapper_ = remapper; }
 
+void ConfigParser::SetProfileNames(const std::vector<string>& profile_names) {
+  profile_names_ = profile_names;
+}
+
 [[nodiscard]] bool ConfigParser::Parse(const std::vector<string>& lines) {
   bool success = true;
   int line_num = 0;
@@ -108,6 +275,8 @@ ConfigParser::ConfigParser(Remapper* remapper) { remapper_ = remapper; }
     }
     success &= result.has_value();
   }
+  remapper_->CompileLayers();
+  remapper_->CompileSequences();
   return success;
 }
 
@@ -116,8 +285,7 @@ ConfigParser::ConfigParser(Remapper* remapper) { remapper_ = remapper; }
 // Converts a string like "~D ^A" to actions.
 ErrorStrOr<std::vector<Action>> ConfigParser::AssignmentToActions(
     const string& assignment) {
-  const auto tokens = StringSplit(assignment, ' ');
-  return AssignmentToActions(tokens);
+  return AssignmentToActions(SplitTokens(assignment));
 }
 
 // Converts a vector<string> like ["B", "^C"] into vector<Action>.
@@ -130,6 +298,41 @@ ErrorStrOr<std::vector<Action>> ConfigParser::AssignmentToActions(
         token == "~" + kNothingToken) {
       continue;
     }
+    if (token.starts_with('"')) {
+      // Else what follows would be done before the text is typed.
+      if (&token != &tokens.back()) {
+        return std::unexpected("A text must be the last action.");
+      }
+      ASSIGN_OR_RETURN(auto key_events, TextToKeyEvents(token));
+      actions.push_back(remapper_->AddText(std::move(key_events)));
+      continue;
+    }
+    if (IsAutofire(token)) {
+      if (&token != &tokens.back()) {
+        return std::unexpected("Autofire must be the last action.");
+      }
+      ASSIGN_OR_RETURN(const auto autofire, ParseAutofire(token));
+      actions.push_back(autofire);
+      continue;
+    }
+    if (const auto direction = ParseMouseKey(token)) {
+      if (&token != &tokens.back()) {
+        return std::unexpected("A mouse key must be the last action.");
+      }
+      actions.push_back(ActionMouseKey{*direction});
+      continue;
+    }
+    if (token.starts_with(kProfilePrefix)) {
+      const string name = token.substr(kProfilePrefix.size());
+      const auto it =
+          std::find(profile_names_.begin(), profile_names_.end(), name);
+      if (it == profile_names_.end()) {
+        return std::unexpected(std::format("Unknown profile '{}'.", name));
+      }
+      actions.push_back(
+          ActionSwitchProfile{int(it - profile_names_.begin())});
+      continue;
+    }
     if (token.ends_with("ms")) {
       int ms;
       // This raises std::invalid_argument if number is invalid.
@@ -158,17 +361,29 @@ ErrorStrOr<std::vector<Action>> ConfigParser::AssignmentToActions(
 
 // Given a key and string representing what it should do, adds relevant mappings
 // to remapper_.
-ErrorStrOr<void> ConfigParser::ParseAssignment(const string& layer_name,
-                                               const string& key_str,
-                                               const string& assignment) {
+ErrorStrOr<void> ConfigParser::ParseAssignment(
+    const std::vector<int>& layer_keys, const string& key_str,
+    const string& assignment, const std::vector<uint8_t>& modifier_masks) {
   ASSIGN_OR_RETURN(const auto left_key, SplitKeyPrefix(key_str));
-  if (layer_name == kDefaultLayerName && layer_keys_.contains(left_key.key)) {
+  const int state_index = remapper_->LayerStateIndex(layer_keys);
+  const auto add_mapping = [&](KeyEvent key_event,
+                               const std::vector<Action>& actions) {
+    if (modifier_masks.empty()) {
+      remapper_->AddMapping(state_index, key_event, actions);
+    }
+    for (const uint8_t modifiers : modifier_masks) {
+      remapper_->AddModifiedMapping(modifiers, key_event, actions);
+    }
+  };
+  std::vector<int> nested_layer_keys = layer_keys;
+  nested_layer_keys.push_back(left_key.key);
+  if (layers_.contains(nested_layer_keys)) {
     return std::unexpected(
         "Key assignments like KEY = ... must precede layer assignments "
         "KEY + OTHER_KEY = ...");
   }
 
-  std::vector<string> tokens = StringSplit(assignment, ' ');
+  std::vector<string> tokens = SplitTokens(assignment);
   if (tokens.size() == 1 && tokens[0] == "*") {
     tokens[0] = key_str;
   }
@@ -182,45 +397,64 @@ ErrorStrOr<void> ConfigParser::ParseAssignment(const string& layer_name,
           "If left does not have a prefix (^ or ~), the last token of "
           "assignment must not have either.");
     }
-    tokens[n_tokens - 1] = "^" + last_token;
+    std::vector<string> release_tokens;
+    if (!IsDoneOnPress(last_token)) {
+      tokens[n_tokens - 1] = "^" + last_token;
+      release_tokens = {"~" + last_token};
+    }
     // On activation, do everything, but only activate the final key.
     {
       ASSIGN_OR_RETURN(const auto actions, AssignmentToActions(tokens));
-      remapper_->AddMapping(layer_name, KeyPressEvent(left_key.key), actions);
+      add_mapping(KeyPressEvent(left_key.key), actions);
     }
     // On release, do nothing, and only release the final key.
     {
-      ASSIGN_OR_RETURN(const auto actions,
-                       AssignmentToActions({"~" + last_token}));
-      remapper_->AddMapping(layer_name, KeyReleaseEvent(left_key.key), actions);
+      ASSIGN_OR_RETURN(const auto actions, AssignmentToActions(release_tokens));
+      add_mapping(KeyReleaseEvent(left_key.key), actions);
     }
   } else {
+    // It is stopped when the key is released.
+    if (left_key.prefix == '~' && IsWhileHeld(tokens.back())) {
+      return std::unexpected(
+          "Autofire and mouse keys must be started by a key press.");
+    }
     ASSIGN_OR_RETURN(const auto actions, AssignmentToActions(tokens));
-    remapper_->AddMapping(layer_name,
-                          left_key.prefix == '~' ? KeyReleaseEvent(left_key.key)
-                                                 : KeyPressEvent(left_key.key),
-                          actions);
+    add_mapping(left_key.prefix == '~' ? KeyReleaseEvent(left_key.key)
+                                       : KeyPressEvent(left_key.key),
+                actions);
   }
   return {};
 }
 
-ErrorStrOr<void> ConfigParser::ParseLayerAssignment(const string& layer_key_str,
-                                                    const string& key_str,
-                                                    const string& assignment) {
-  const auto layer_key = SplitKeyPrefix(layer_key_str).value();
-  if (layer_key.prefix.has_value()) {
-    return std::unexpected(
-        "Prefix (^ or ~) for layer keys is not supported yet.");
-  }
-  string layer_name = LayerNameFromKey(layer_key.key);
-
-  // Add default to layer mapping.
-  if (layer_keys_.find(layer_key.key) == layer_keys_.end()) {
-    remapper_->AddMapping(kDefaultLayerName, KeyPressEvent(layer_key.key),
-                          {remapper_->ActionActivateState(layer_name)});
-    remapper_->SetAllowOtherKeys(layer_name, false);
-    layer_keys_.insert(layer_key.key);
+ErrorStrOr<void> ConfigParser::ParseLayerAssignment(
+    const std::vector<string>& layer_key_strs, const string& key_str,
+    const string& assignment) {
+  // Keys held so far, e.g. {CAPSLOCK} and then {CAPSLOCK, LEFTALT}.
+  std::vector<int> layer_keys;
+  for (const auto& layer_key_str : layer_key_strs) {
+    ASSIGN_OR_RETURN(const auto layer_key, SplitKeyPrefix(layer_key_str));
+    if (layer_key.prefix.has_value()) {
+      return std::unexpected(
+          "Prefix (^ or ~) for layer keys is not supported yet.");
+    }
+    if (std::find(layer_keys.begin(), layer_keys.end(), layer_key.key) !=
+        layer_keys.end()) {
+      return std::unexpected("A layer key cannot be held more than once.");
+    }
+    const int parent_index = remapper_->LayerStateIndex(layer_keys);
+    layer_keys.push_back(layer_key.key);
+
+    // Add parent to layer mapping. Each layer has its own state, so a key is
+    // looked up once however deep the layers are nested.
+    if (!layers_.contains(layer_keys)) {
+      const int layer_index = remapper_->LayerStateIndex(layer_keys);
+      remapper_->AddMapping(parent_index, KeyPressEvent(layer_key.key),
+                            {remapper_->ActionActivateState(layer_index)});
+      remapper_->SetAllowOtherKeys(layer_index, false);
+      layers_.insert(layer_keys);
+    }
   }
+  const int layer_index = remapper_->LayerStateIndex(layer_keys);
 
   // Handle SHIFT + * = *.
   if (key_str == "*") {
@@ -228,18 +462,147 @@ ErrorStrOr<void> ConfigParser::ParseLayerAssignment(const string& layer_key_str,
       return std::unexpected(
           "Must be a * on the right side of for KEY + * = *");
     }
-    remapper_->SetAllowOtherKeys(layer_name, true);
+    remapper_->SetAllowOtherKeys(layer_index, true);
     return {};
   }
 
   // Handle DELETE + nothing = DELETE.
   if (key_str == kNothingToken) {
+    // Done as the layer key is released, and would never stop.
+    if (IsWhileHeld(SplitTokens(assignment).back())) {
+      return std::unexpected(
+          "Autofire and mouse keys cannot be done on nothing.");
+    }
     ASSIGN_OR_RETURN(const auto actions, AssignmentToActions(assignment));
-    remapper_->SetNullEventActions(layer_name, actions);
+    remapper_->SetNullEventActions(layer_index, actions);
     return {};
   }
 
-  return ParseAssignment(layer_name, key_str, assignment);
+  return ParseAssignment(layer_keys, key_str, assignment);
+}
+
+ErrorStrOr<void> ConfigParser::ParseModified(const string& modifiers_str,
+                                             const string& key_str,
+                                             const string& assignment) {
+  // Sides of each modifier, as bits of the left and the right key. A modifier
+  // like "ctrl" may be either or both.
+  if (StringTrim(modifiers_str).empty()) {
+    return std::unexpected("Modifier conditions are empty.");
+  }
+  std::array<std::vector<uint8_t>, 4> sides;
+  for (const auto& name_str : StringSplit(modifiers_str, ',')) {
+    string name = StringTrim(name_str);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    bool found = false;
+    for (int group = 0; group < 4; ++group) {
+      const uint8_t left = 1 << group;
+      const uint8_t right = 1 << (group + 4);
+      const string side_name = string(kModifierNames[group]).substr(4);
+      std::vector<uint8_t> masks;
+      if (name == side_name) {
+        masks = {left, right, uint8_t(left | right)};
+      } else if (name == kModifierNames[group]) {
+        masks = {left};
+      } else if (name == kModifierNames[group + 4]) {
+        masks = {right};
+      } else {
+        continue;
+      }
+      found = true;
+      if (sides[group].empty()) {
+        sides[group] = masks;
+      } else if (sides[group].size() == 1 && masks.size() == 1 &&
+                 sides[group][0] != masks[0]) {
+        // Both sides, e.g. [leftctrl, rightctrl].
+        sides[group] = {uint8_t(left | right)};
+      } else {
+        return std::unexpected(
+            std::format("Modifier '{}' is given more than once.", name));
+      }
+    }
+    if (!found) {
+      return std::unexpected(std::format(
+          "Unknown modifier '{}', expected e.g. ctrl, shift, alt, meta or "
+          "leftctrl.",
+          name));
+    }
+  }
+  // All combinations of the sides, one mask each.
+  std::vector<uint8_t> modifier_masks = {0};
+  for (const auto& group_sides : sides) {
+    if (group_sides.empty()) continue;
+    std::vector<uint8_t> combined;
+    for (const uint8_t mask : modifier_masks) {
+      for (const uint8_t side : group_sides) combined.push_back(mask | side);
+    }
+    modifier_masks = std::move(combined);
+  }
+
+  ASSIGN_OR_RETURN(const auto key, SplitKeyPrefix(key_str));
+  // It would be part of the modifiers it is checked against.
+  if (ModifierBit(key.key) != 0) {
+    return std::unexpected("Modifier keys cannot have modifier conditions.");
+  }
+  return ParseAssignment({}, key_str, assignment, modifier_masks);
+}
+
+ErrorStrOr<void> ConfigParser::ParseChord(const string& key_combo,
+                                          const string& assignment) {
+  Chord chord;
+  for (const auto& key_str : StringSplit(key_combo, '&')) {
+    ASSIGN_OR_RETURN(const auto key, SplitKeyPrefix(StringTrim(key_str)));
+    if (key.prefix.has_value()) {
+      return std::unexpected("Prefix (^ or ~) for chord keys is not allowed.");
+    }
+    chord.keys.push_back(key.key);
+  }
+
+  // As for A = B C, converts A & B = C D to ^C ~C ^D on press, ~D on release.
+  std::vector<string> tokens = SplitTokens(assignment);
+  if (tokens.empty()) return std::unexpected("Chord has no assignment.");
+  string last_token = tokens.back();
+  if (last_token[0] == '^' || last_token[0] == '~' || last_token == "*") {
+    return std::unexpected(
+        "The last token of a chord's assignment must be a key without a "
+        "prefix (^ or ~), or nothing.");
+  }
+  // Chord keys are released in any order, so there is no single key to stop
+  // autofire or mouse keys.
+  if (IsWhileHeld(last_token)) {
+    return std::unexpected(
+        "Autofire and mouse keys are not supported in chords.");
+  }
+  std::vector<string> release_tokens;
+  if (!IsDoneOnPress(last_token)) {
+    tokens.back() = "^" + last_token;
+    release_tokens = {"~" + last_token};
+  }
+  {
+    ASSIGN_OR_RETURN(chord.press_actions, AssignmentToActions(tokens));
+  }
+  {
+    ASSIGN_OR_RETURN(chord.release_actions,
+                     AssignmentToActions(release_tokens));
+  }
+  return remapper_->AddChord(chord);
+}
+
+ErrorStrOr<void> ConfigParser::ParseSequence(const string& key_combo,
+                                             const string& assignment) {
+  Sequence sequence;
+  for (const auto& key_str : StringSplit(key_combo, " \t")) {
+    if (key_str.empty()) continue;
+    ASSIGN_OR_RETURN(const auto key, SplitKeyPrefix(key_str));
+    if (key.prefix.has_value()) {
+      return std::unexpected(
+          "Prefix (^ or ~) for sequence keys is not allowed.");
+    }
+    sequence.keys.push_back(key.key);
+  }
+  {
+    ASSIGN_OR_RETURN(sequence.actions, AssignmentToActions(assignment));
+  }
+  return remapper_->AddSequence(sequence);
 }
 
 ErrorStrOr<void> ConfigParser::ParseLine(const string& original_line) {
@@ -249,27 +612,55 @@ ErrorStrOr<void> ConfigParser::ParseLine(const string& original_line) {
     return {};
   }
 
-  // Split the config line into the key combination and the action.
-  auto parts = StringSplit(line, '=');
-  if (parts.size() != 2) {
+  // Split the config line into the key combination and the action. Texts in
+  // the action may have '='.
+  const auto equals = FindUnquoted(line, "=");
+  if (equals == string::npos ||
+      FindUnquoted(line, "=", equals + 1) != string::npos) {
     return std::unexpected("Not of the form A = B");
   }
 
-  string key_combo = StringTrim(parts[0]);
-  string action = StringTrim(parts[1]);
+  string key_combo = StringTrim(line.substr(0, equals));
+  string action = StringTrim(line.substr(equals + 1));
+  if (action.empty()) return std::unexpected("Not of the form A = B");
 
-  // Split key combination by '+', e.g., "DEL + END"
+  // Modifier conditions, e.g. "[ctrl, shift] C".
+  if (key_combo.starts_with('[')) {
+    const auto close = key_combo.find(']');
+    if (close == string::npos) {
+      return std::unexpected("Modifier conditions have no closing ']'.");
+    }
+    const string key_str = StringTrim(key_combo.substr(close + 1));
+    if (key_str.empty() || key_str.find_first_of("+& \t") != string::npos) {
+      return std::unexpected(
+          "Modifier conditions must be followed by a single key.");
+    }
+    return ParseModified(key_combo.substr(1, close - 1), key_str, action);
+  }
+
+  // Chords, e.g. "J & K".
+  if (key_combo.find('&') != string::npos) {
+    if (key_combo.find('+') != string::npos) {
+      return std::unexpected("Chords cannot be used in layers.");
+    }
+    return ParseChord(key_combo, action);
+  }
+
+  // Sequences, e.g. "RIGHTALT M".
+  if (key_combo.find_first_of(" \t") != string::npos &&
+      key_combo.find('+') == string::npos) {
+    return ParseSequence(key_combo, action);
+  }
+
+  // Split key combination by '+', e.g., "DEL + END", or "CAPS + ALT + 4" for
+  // nested layers.
   auto keys = StringSplit(key_combo, '+');
+  for (auto& key : keys) key = StringTrim(key);
 
   if (keys.size() == 1) {
-    return ParseAssignment(kDefaultLayerName, StringTrim(keys[0]), action);
-  } else if (keys.size() == 2) {
-    return ParseLayerAssignment(StringTrim(keys[0]), StringTrim(keys[1]),
-                                action);
-  } else {
-    return std::unexpected(
-        // In theorey we could have A + B + C = D, but it is not yet supported.
-        std::format("Cannot have more than 1 '+' before '='", original_line));
+    return ParseAssignment({}, keys[0], action);
   }
-  return {};
+  const string key_str = keys.back();
+  keys.pop_back();
+  return ParseLayerAssignment(keys, key_str, action);
 }
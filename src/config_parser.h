@@ -32,6 +32,10 @@ class ConfigParser {
   ConfigParser(Remapper* remapper);
   [[nodiscard]] bool Parse(const std::vector<std::string>& lines);
 
+  // Profiles which `profile:NAME` may switch to, in the order given to
+  // Remapper::SetProfiles().
+  void SetProfileNames(const std::vector<std::string>& profile_names);
+
   // Movable but not copyable.
   ConfigParser(ConfigParser&& other) = default;
   ConfigParser& operator=(ConfigParser&& other) = default;
@@ -44,19 +48,41 @@ class ConfigParser {
   ErrorStrOr<std::vector<Action>> AssignmentToActions(
       const std::vector<std::string>& tokens);
 
-  ErrorStrOr<void> ParseAssignment(const std::string& layer_name,
-                                   const std::string& key_str,
-                                   const std::string& assignment);
+  // Adds to the layer activated by holding layer_keys, see
+  // Remapper::LayerStateIndex(). If modifier_masks is given, the mappings are
+  // done only while one of them is held, see Remapper::AddModifiedMapping().
+  ErrorStrOr<void> ParseAssignment(
+      const std::vector<int>& layer_keys, const std::string& key_str,
+      const std::string& assignment,
+      const std::vector<uint8_t>& modifier_masks = {});
+
+  // Parses an assignment in a layer, e.g. "CAPSLOCK + LEFTALT + 4 = F4" given
+  // {"CAPSLOCK", "LEFTALT"} and "4".
+  ErrorStrOr<void> ParseLayerAssignment(
+      const std::vector<std::string>& layer_key_strs,
+      const std::string& key_str, const std::string& assignment);
+
+  // Parses a mapping with modifier conditions like "[ctrl, shift] C", given
+  // "ctrl, shift" and "C".
+  ErrorStrOr<void> ParseModified(const std::string& modifiers_str,
+                                 const std::string& key_str,
+                                 const std::string& assignment);
+
+  // Parses a chord like "A & B", and what it should do.
+  ErrorStrOr<void> ParseChord(const std::string& key_combo,
+                              const std::string& assignment);
 
-  ErrorStrOr<void> ParseLayerAssignment(const std::string& layer_key_str,
-                                        const std::string& key_str,
-                                        const std::string& assignment);
+  // Parses a sequence like "RIGHTALT M", and what it should do.
+  ErrorStrOr<void> ParseSequence(const std::string& key_combo,
+                                 const std::string& assignment);
 
   [[nodiscard]] ErrorStrOr<void> ParseLine(const std::string& original_line);
 
   Remapper* remapper_;
-  // To keep track of keys used to define layers.
-  std::set<int> layer_keys_;
+  // To keep track of keys used to define layers, as the keys held to get to
+  // each layer, in order.
+  std::set<std::vector<int>> layers_;
+  std::vector<std::string> profile_names_;
 };
 
 #endif  //  __CONFIG_PARSER_H
\ No newline at end of file
@@ -418,4 +418,552 @@ SCENARIO("Rpeating key should be releasable after layer activation") {
                               "Out: T KEY_B",
                               "Out: R KEY_B",
                           });
-}
\ No newline at end of file
+}
+SCENARIO("Chords") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({
+      "CAPSLOCK + 1 = F1",
+      "J & K = ESC",
+      "J & K & L = TAB",
+      "CAPSLOCK & A = X",
+  }));
+  remapper.UpdatePassthroughKeys();
+
+  THEN("Keys pressed together act as the chord") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_K, 1}, {KEY_J, 1}, {KEY_L, 1}, {KEY_L, 2}}) ==
+          vector<string>{"Out: P KEY_TAB", "Out: T KEY_TAB"});
+    // The first key released ends it.
+    CHECK(GetOutcomes(remapper, false, {{KEY_J, 0}}) ==
+          vector<string>{"Out: R KEY_TAB"});
+    CHECK(GetOutcomes(remapper, false, {{KEY_K, 0}, {KEY_L, 0}}).empty());
+    CHECK(remapper.chord_counters().matched == 1);
+  }
+
+  THEN("A smaller chord is done once a key is released") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_J, 1}, {KEY_K, 1}, {KEY_K, 0}, {KEY_J, 0}}) ==
+          vector<string>{"Out: P KEY_ESC", "Out: R KEY_ESC"});
+  }
+
+  THEN("Other keys are processed on their own, in order") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_J, 1}, {KEY_Z, 1}, {KEY_J, 0}, {KEY_Z, 0}}) ==
+          vector<string>{"Out: P KEY_J", "Out: P KEY_Z", "Out: R KEY_J",
+                         "Out: R KEY_Z"});
+    CHECK(GetOutcomes(remapper, false, {{KEY_J, 1}, {KEY_J, 0}}) ==
+          vector<string>{"Out: P KEY_J", "Out: R KEY_J"});
+    CHECK(remapper.chord_counters().flushed == 2);
+  }
+
+  THEN("Pass-through keys wait for keys held back") {
+    CHECK(GetOutcomes(remapper, false, {{KEY_J, 1}, {KEY_Z, 1}},
+                      /*fast_path=*/true) ==
+          vector<string>{"Out: P KEY_J", "Out: P KEY_Z"});
+  }
+
+  THEN("Keys held back are processed once the window is over") {
+    CHECK(GetOutcomes(remapper, false, {{KEY_J, 1}}).empty());
+    CHECK(remapper.has_timers());
+    const int64_t now_us = SteadyClockNowUs();
+    CHECK(remapper.NextTimerUs() > now_us);
+    CHECK(remapper.NextTimerUs() <= now_us + kDefaultChordWindowMs * 1000);
+    remapper.RunTimers(now_us + kDefaultChordWindowMs * 1000);
+    CHECK(remapper.emitted() == vector<KeyEvent>{KeyPressEvent(KEY_J)});
+    CHECK_FALSE(remapper.has_timers());
+    CHECK(remapper.NextTimerUs() == -1);
+    CHECK(remapper.chord_counters().max_hold_us >=
+          kDefaultChordWindowMs * 1000);
+  }
+
+  THEN("A layer key can be part of a chord") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1}, {KEY_A, 1}, {KEY_A, 0}}) ==
+          vector<string>{"Out: P KEY_X", "Out: R KEY_X"});
+    CHECK(GetOutcomes(remapper, false, {{KEY_CAPSLOCK, 0}}).empty());
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1}, {KEY_1, 1}, {KEY_1, 0}}) ==
+          vector<string>{"Out: P KEY_F1", "Out: R KEY_F1"});
+  }
+
+  THEN("Chords are not matched while a layer is active") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1}, {KEY_Z, 1}, {KEY_J, 1}, {KEY_K, 1}})
+              .empty());
+  }
+}
+
+SCENARIO("Chord errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({"J & ^K = ESC"}));
+  CHECK_FALSE(config_parser.Parse({"J & J = ESC"}));
+  CHECK_FALSE(config_parser.Parse({"J & K = ~ESC"}));
+  CHECK_FALSE(config_parser.Parse({"CAPSLOCK + J & K = ESC"}));
+  CHECK(config_parser.Parse({"J & K = ESC"}));
+  CHECK_FALSE(config_parser.Parse({"K & J = TAB"}));
+}
+
+SCENARIO("Sequences") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({
+      "RIGHTALT = nothing",
+      "RIGHTALT M = F1",
+      "B T W = BACKSPACE X",
+  }));
+  remapper.UpdatePassthroughKeys();
+  CHECK(remapper.passthrough_keys().test(KEY_T));
+  CHECK_FALSE(remapper.passthrough_keys().test(KEY_W));
+
+  THEN("The last key is replaced") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_RIGHTALT, 1},
+                       {KEY_RIGHTALT, 0},
+                       {KEY_M, 1},
+                       {KEY_M, 2},
+                       {KEY_M, 0},
+                       {KEY_M, 1},
+                       {KEY_M, 0}}) ==
+          vector<string>{"Out: P KEY_F1", "Out: R KEY_F1", "Out: P KEY_M",
+                         "Out: R KEY_M"});
+  }
+
+  THEN("Other keys are typed as usual") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_B, 1},
+                       {KEY_B, 0},
+                       {KEY_T, 1},
+                       {KEY_T, 0},
+                       {KEY_W, 1},
+                       {KEY_W, 0}},
+                      /*fast_path=*/true) ==
+          vector<string>{"Out: P KEY_B", "Out: R KEY_B", "Out: P KEY_T",
+                         "Out: R KEY_T", "Out: P KEY_BACKSPACE",
+                         "Out: R KEY_BACKSPACE", "Out: P KEY_X",
+                         "Out: R KEY_X"});
+  }
+
+  THEN("The kill combo still works") {
+    vector<std::pair<int, int>> keys;
+    for (const int key_code : KillComboKeyCodes()) {
+      keys.push_back({key_code, 1});
+      keys.push_back({key_code, 0});
+    }
+    CHECK_THROWS(GetOutcomes(remapper, false, keys, /*fast_path=*/true));
+  }
+}
+
+SCENARIO("Sequence errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({"B ^T = X"}));
+  CHECK(config_parser.Parse({"B T = X"}));
+  CHECK_FALSE(config_parser.Parse({"B  T = Y"}));
+}
+
+SCENARIO("Texts") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({
+      R"(F1 = LEFTCTRL "Hi!")",
+      R"(F2 = "a = \"b\" # c" // Comment.)",
+      R"(F3 = "abcdefghij")",
+  }));
+  remapper.UpdatePassthroughKeys();
+  CHECK_FALSE(remapper.passthrough_keys().test(KEY_H));
+  CHECK_FALSE(remapper.passthrough_keys().test(KEY_LEFTSHIFT));
+
+  THEN("Shift is pressed around each character that needs it") {
+    CHECK(GetOutcomes(remapper, false, {{KEY_F1, 1}, {KEY_F1, 0}}) ==
+          vector<string>{"Out: P KEY_LEFTCTRL", "Out: R KEY_LEFTCTRL",
+                         "Out: P KEY_LEFTSHIFT", "Out: P KEY_H",
+                         "Out: R KEY_H", "Out: R KEY_LEFTSHIFT",
+                         "Out: P KEY_I", "Out: R KEY_I",
+                         "Out: P KEY_LEFTSHIFT", "Out: P KEY_1",
+                         "Out: R KEY_1", "Out: R KEY_LEFTSHIFT"});
+    CHECK_FALSE(remapper.has_timers());
+  }
+
+  THEN("A Shift held stays held") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_LEFTSHIFT, 1}, {KEY_F1, 1}, {KEY_F1, 0}}) ==
+          vector<string>{"Out: P KEY_LEFTSHIFT", "Out: P KEY_LEFTCTRL",
+                         "Out: R KEY_LEFTCTRL", "Out: P KEY_H", "Out: R KEY_H",
+                         "Out: P KEY_I", "Out: R KEY_I", "Out: P KEY_1",
+                         "Out: R KEY_1"});
+    CHECK(remapper.HeldKeys().test(KEY_LEFTSHIFT));
+    CHECK(GetOutcomes(remapper, false, {{KEY_LEFTSHIFT, 0}}) ==
+          vector<string>{"Out: R KEY_LEFTSHIFT"});
+  }
+
+  THEN("Quotes and comment markers can be in a text") {
+    // a, space, =, space, ", b, ", space, #, space, c.
+    CHECK(remapper.config()->texts[1].size() == 2 * 11 + 2 * 3);
+  }
+
+  THEN("Long texts are typed in bursts") {
+    const auto outcomes = GetOutcomes(remapper, false, {{KEY_F3, 1}});
+    CHECK(outcomes.size() == 2 * kTextBurstChars);
+    CHECK(outcomes.back() == "Out: R KEY_H");
+    REQUIRE(remapper.has_timers());
+    const int64_t now_us = SteadyClockNowUs();
+    CHECK(remapper.NextTimerUs() <= now_us + kTextBurstGapMs * 1000);
+
+    // Other keys are not held up.
+    CHECK(GetOutcomes(remapper, false, {{KEY_F3, 0}, {KEY_Z, 1}}) ==
+          vector<string>{"Out: P KEY_Z"});
+    remapper.RunTimers(now_us + kTextBurstGapMs * 1000);
+    CHECK(remapper.emitted() ==
+          vector<KeyEvent>{KeyPressEvent(KEY_I), KeyReleaseEvent(KEY_I),
+                           KeyPressEvent(KEY_J), KeyReleaseEvent(KEY_J)});
+    CHECK_FALSE(remapper.has_timers());
+  }
+
+  THEN("Texts are typed one after another") {
+    GetOutcomes(remapper, false, {{KEY_F3, 1}, {KEY_F3, 0}, {KEY_F1, 1}});
+    remapper.RunTimers(SteadyClockNowUs() + kTextBurstGapMs * 1000);
+    // The rest of F3's text, then F1's.
+    CHECK(remapper.emitted().size() == 4 + 4 + 2 + 4);
+    CHECK(remapper.emitted()[4] == KeyPressEvent(KEY_LEFTSHIFT));
+    CHECK(remapper.emitted()[5] == KeyPressEvent(KEY_H));
+  }
+
+  THEN("Releasing all keys stops typing") {
+    GetOutcomes(remapper, false, {{KEY_F3, 1}});
+    remapper.ReleaseAll();
+    CHECK_FALSE(remapper.has_timers());
+  }
+}
+
+SCENARIO("Text errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({R"(A = "abc)"}));
+  CHECK_FALSE(config_parser.Parse({R"(A = "")"}));
+  CHECK_FALSE(config_parser.Parse({R"(A = "a\x")"}));
+  CHECK_FALSE(config_parser.Parse({"A = \"\u00e9\""}));
+  CHECK_FALSE(config_parser.Parse({R"(A = "abc" ENTER)"}));
+  CHECK_FALSE(config_parser.Parse({R"(A = "abc"d)"}));
+  CHECK(config_parser.Parse({R"(A = "abc\n")"}));
+}
+
+SCENARIO("Autofire") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({
+      "F = SPACE@20Hz",
+      "CAPSLOCK + G = X@10hz",
+  }));
+
+  THEN("The key is pressed right away, and every period after") {
+    CHECK(GetOutcomes(remapper, false, {{KEY_F, 1}}) ==
+          vector<string>{"Out: P KEY_SPACE"});
+    REQUIRE(remapper.has_timers());
+    // Released half a period later.
+    const int64_t start_us = remapper.NextTimerUs() - 25000;
+    remapper.RunTimers(start_us + 25000);
+    remapper.RunTimers(start_us + 50000);
+    CHECK(remapper.emitted() == vector<KeyEvent>{KeyReleaseEvent(KEY_SPACE),
+                                                 KeyPressEvent(KEY_SPACE)});
+    CHECK(remapper.HeldKeys().test(KEY_SPACE));
+
+    // Late ticks do not shift the deadlines after them.
+    remapper.RunTimers(start_us + 75300);
+    CHECK(remapper.NextTimerUs() == start_us + 100000);
+    CHECK(remapper.autofire_counters().ticks == 4);
+    CHECK(remapper.autofire_counters().max_late_us == 300);
+
+    // Periods missed entirely are skipped.
+    remapper.RunTimers(start_us + 1000000);
+    CHECK(remapper.NextTimerUs() == start_us + 1025000);
+    CHECK(remapper.autofire_counters().skipped == 36);
+    remapper.ClearEmitted();
+
+    // Repeats do nothing, and releasing the key stops at once.
+    CHECK(GetOutcomes(remapper, false, {{KEY_F, 2}, {KEY_F, 0}}) ==
+          vector<string>{"Out: R KEY_SPACE"});
+    CHECK_FALSE(remapper.has_timers());
+  }
+
+  THEN("Deactivating the layer stops it") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1}, {KEY_G, 1}, {KEY_CAPSLOCK, 0}}) ==
+          vector<string>{"Out: P KEY_X", "Out: R KEY_X"});
+    CHECK_FALSE(remapper.has_timers());
+    CHECK(GetOutcomes(remapper, false, {{KEY_G, 0}}).empty());
+  }
+}
+
+SCENARIO("Autofire errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({"F = SPACE@0Hz"}));
+  CHECK_FALSE(config_parser.Parse({"F = SPACE@1000Hz"}));
+  CHECK_FALSE(config_parser.Parse({"F = SPACE@20"}));
+  CHECK_FALSE(config_parser.Parse({"F = ^SPACE@20Hz"}));
+  CHECK_FALSE(config_parser.Parse({"F = SPACE@20Hz X"}));
+  CHECK_FALSE(config_parser.Parse({"~F = SPACE@20Hz"}));
+  CHECK_FALSE(config_parser.Parse({"A & B = SPACE@20Hz"}));
+  CHECK_FALSE(config_parser.Parse({"CAPSLOCK + nothing = SPACE@20Hz"}));
+  CHECK(config_parser.Parse({"^F = SPACE@20Hz"}));
+}
+
+SCENARIO("Mouse keys") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({
+      "CAPSLOCK + L = MOUSE_RIGHT",
+      "CAPSLOCK + D = WHEEL_DOWN",
+      "CAPSLOCK + SPACE = BTN_LEFT",
+  }));
+  CHECK(remapper.UsesMouseKeys());
+
+  THEN("The pointer moves while the key is held") {
+    CHECK(GetOutcomes(remapper, false, {{KEY_CAPSLOCK, 1}, {KEY_L, 1}})
+              .empty());
+    REQUIRE(remapper.has_timers());
+    remapper.RunTimers(remapper.NextTimerUs() + 100000);
+    const auto motion = remapper.TakePointerMotion();
+    CHECK(motion.x > 0);
+    CHECK(motion.y == 0);
+    CHECK(remapper.TakePointerMotion().empty());
+    CHECK(remapper.mouse_keys_counters().steps > 0);
+
+    CHECK(GetOutcomes(remapper, false, {{KEY_L, 0}}).empty());
+    CHECK_FALSE(remapper.has_timers());
+  }
+
+  THEN("Deactivating the layer stops it") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1}, {KEY_D, 1}, {KEY_CAPSLOCK, 0}})
+              .empty());
+    CHECK_FALSE(remapper.has_timers());
+  }
+
+  THEN("Mouse buttons are keys") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1}, {KEY_SPACE, 1}, {KEY_SPACE, 0}}) ==
+          vector<string>{"Out: P BTN_LEFT", "Out: R BTN_LEFT"});
+  }
+}
+
+SCENARIO("Mouse key errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({"F = MOUSE_LEFT X"}));
+  CHECK_FALSE(config_parser.Parse({"~F = MOUSE_LEFT"}));
+  CHECK_FALSE(config_parser.Parse({"A & B = MOUSE_LEFT"}));
+  CHECK_FALSE(config_parser.Parse({"CAPSLOCK + nothing = WHEEL_UP"}));
+  CHECK_FALSE(config_parser.Parse({"F = MOUSE_FORWARD"}));
+  CHECK(config_parser.Parse({"F = G"}));
+  CHECK_FALSE(remapper.UsesMouseKeys());
+}
+
+SCENARIO("Modifier conditions") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({
+      "[shift] ESC = GRAVE",
+      "[ctrl, shift] C = F5",
+      "[leftalt] X = Y",
+      "CAPSLOCK + ESC = DELETE",
+  }));
+  remapper.UpdatePassthroughKeys();
+  CHECK(remapper.passthrough_keys().test(KEY_LEFTSHIFT));
+  CHECK_FALSE(remapper.passthrough_keys().test(KEY_ESC));
+
+  THEN("Keys are mapped only with exactly those modifiers") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_RIGHTSHIFT, 1}, {KEY_ESC, 1}, {KEY_ESC, 0}},
+                      /*fast_path=*/true) ==
+          vector<string>{"Out: P KEY_RIGHTSHIFT", "Out: P KEY_GRAVE",
+                         "Out: R KEY_GRAVE"});
+    // Shift and Ctrl.
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_LEFTCTRL, 1}, {KEY_ESC, 1}, {KEY_ESC, 0}},
+                      true) == vector<string>{"Out: P KEY_LEFTCTRL",
+                                              "Out: P KEY_ESC",
+                                              "Out: R KEY_ESC"});
+    CHECK(GetOutcomes(remapper, false, {{KEY_C, 1}, {KEY_C, 0}}, true) ==
+          vector<string>{"Out: P KEY_F5", "Out: R KEY_F5"});
+  }
+
+  THEN("Releasing the modifier first releases the mapped key") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_LEFTSHIFT, 1},
+                       {KEY_ESC, 1},
+                       {KEY_ESC, 2},
+                       {KEY_LEFTSHIFT, 0},
+                       {KEY_ESC, 0}},
+                      true) == vector<string>{"Out: P KEY_LEFTSHIFT",
+                                              "Out: P KEY_GRAVE",
+                                              "Out: T KEY_GRAVE",
+                                              "Out: R KEY_LEFTSHIFT",
+                                              "Out: R KEY_GRAVE"});
+  }
+
+  THEN("Sides must match if given") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_RIGHTALT, 1}, {KEY_X, 1}, {KEY_X, 0}}) ==
+          vector<string>{"Out: P KEY_RIGHTALT", "Out: P KEY_X",
+                         "Out: R KEY_X"});
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_RIGHTALT, 0}, {KEY_LEFTALT, 1}, {KEY_X, 1}}) ==
+          vector<string>{"Out: R KEY_RIGHTALT", "Out: P KEY_LEFTALT",
+                         "Out: P KEY_Y"});
+  }
+
+  THEN("Active layers come first") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_LEFTSHIFT, 1}, {KEY_CAPSLOCK, 1}, {KEY_ESC, 1}}) ==
+          vector<string>{"Out: P KEY_LEFTSHIFT", "Out: P KEY_DELETE"});
+  }
+}
+
+SCENARIO("Modifier condition errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({"[] C = X"}));
+  CHECK_FALSE(config_parser.Parse({"[hyper] C = X"}));
+  CHECK_FALSE(config_parser.Parse({"[ctrl, leftctrl] C = X"}));
+  CHECK_FALSE(config_parser.Parse({"[ctrl C = X"}));
+  CHECK_FALSE(config_parser.Parse({"[ctrl] A + C = X"}));
+  CHECK_FALSE(config_parser.Parse({"[ctrl] LEFTSHIFT = X"}));
+  CHECK(config_parser.Parse({"[Ctrl, leftshift, rightshift] C = X"}));
+}
+
+SCENARIO("Nested layers") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({
+      "CAPSLOCK + 1 = F1",
+      "CAPSLOCK + LEFTALT + 4 = F4",
+      "CAPSLOCK + LEFTALT + * = *",
+      "CAPSLOCK + LEFTALT + LEFTSHIFT + 4 = F12",
+  }));
+  // Default, and one for each layer.
+  CHECK(remapper.states().size() == 4);
+
+  THEN("Keys are mapped in the innermost layer") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1},
+                       {KEY_LEFTALT, 1},
+                       {KEY_4, 1},
+                       {KEY_4, 0},
+                       {KEY_LEFTALT, 0},
+                       {KEY_CAPSLOCK, 0}}) ==
+          vector<string>{"Out: P KEY_F4", "Out: R KEY_F4"});
+  }
+
+  THEN("Three keys deep") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1},
+                       {KEY_LEFTALT, 1},
+                       {KEY_LEFTSHIFT, 1},
+                       {KEY_4, 1},
+                       {KEY_4, 0}}) ==
+          vector<string>{"Out: P KEY_F12", "Out: R KEY_F12"});
+  }
+
+  THEN("* = * lets keys through to the outer layer") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1},
+                       {KEY_LEFTALT, 1},
+                       {KEY_1, 1},
+                       {KEY_1, 0},
+                       {KEY_2, 1},
+                       {KEY_2, 0}}) ==
+          vector<string>{"Out: P KEY_F1", "Out: R KEY_F1"});
+  }
+
+  THEN("Releasing the inner key goes back to the outer layer") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_CAPSLOCK, 1},
+                       {KEY_LEFTALT, 1},
+                       {KEY_LEFTALT, 0},
+                       {KEY_4, 1},
+                       {KEY_4, 0},
+                       {KEY_1, 1},
+                       {KEY_1, 0}}) ==
+          vector<string>{"Out: P KEY_F1", "Out: R KEY_F1"});
+  }
+
+  THEN("Order of the layer keys matters") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_LEFTALT, 1},
+                       {KEY_CAPSLOCK, 1},
+                       {KEY_4, 1},
+                       {KEY_4, 0},
+                       {KEY_CAPSLOCK, 0},
+                       {KEY_LEFTALT, 0}}) ==
+          vector<string>{"Out: P KEY_LEFTALT", "Out: R KEY_LEFTALT"});
+  }
+}
+
+SCENARIO("Nested layer errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({"A + B + A + C = D"}));
+  CHECK_FALSE(config_parser.Parse({"A + ^B + C = D"}));
+  CHECK_FALSE(config_parser.Parse({"A + + C = D"}));
+  CHECK_FALSE(config_parser.Parse({"A + B + C = D", "A + B = X"}));
+  CHECK(config_parser.Parse({"X + Y = Z", "X + Y + C = D"}));
+}
+
+SCENARIO("Profiles") {
+  const vector<string> profile_names = {"default", "game"};
+  Remapper game;
+  ConfigParser game_parser(&game);
+  game_parser.SetProfileNames(profile_names);
+  REQUIRE(game_parser.Parse({"W = UP", "F12 = profile:default"}));
+
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  config_parser.SetProfileNames(profile_names);
+  REQUIRE(config_parser.Parse({"CAPSLOCK + G = profile:game", "1 = F1"}));
+  remapper.SetProfiles(
+      {{"default", remapper.config()}, {"game", game.config()}});
+
+  THEN("Keys held as themselves are carried across") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_LEFTSHIFT, 1},
+                       {KEY_1, 1},
+                       {KEY_CAPSLOCK, 1},
+                       {KEY_G, 1}}) ==
+          vector<string>{"Out: P KEY_LEFTSHIFT", "Out: P KEY_F1",
+                         "Out: R KEY_F1"});
+    CHECK(remapper.profile() == 1);
+    CHECK(remapper.profile_name() == "game");
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_W, 1},
+                       {KEY_1, 0},
+                       {KEY_G, 0},
+                       {KEY_CAPSLOCK, 0},
+                       {KEY_LEFTSHIFT, 0}}) ==
+          vector<string>{"Out: P KEY_UP", "Out: R KEY_LEFTSHIFT"});
+
+    CHECK(GetOutcomes(remapper, false, {{KEY_F12, 1}, {KEY_F12, 0}}) ==
+          vector<string>{"Out: R KEY_UP"});
+    CHECK(remapper.profile() == 0);
+  }
+
+  THEN("Switching directly") {
+    remapper.SwitchProfile(1);
+    CHECK(GetOutcomes(remapper, false, {{KEY_W, 1}, {KEY_W, 0}}) ==
+          vector<string>{"Out: P KEY_UP", "Out: R KEY_UP"});
+    // Ignored.
+    remapper.SwitchProfile(2);
+    CHECK(remapper.profile() == 1);
+  }
+}
+
+SCENARIO("Profile errors") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  CHECK_FALSE(config_parser.Parse({"A = profile:game"}));
+  config_parser.SetProfileNames({"default", "game"});
+  CHECK_FALSE(config_parser.Parse({"A = profile:other"}));
+  CHECK(config_parser.Parse({"A = profile:game"}));
+}
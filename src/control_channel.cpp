@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "control_channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+
+namespace {
+
+// Closes the file descriptor when going out of scope, unless released.
+class ScopedFd {
+ public:
+  explicit ScopedFd(int fd) : fd_(fd) {}
+  ~ScopedFd() {
+    if (fd_ >= 0) close(fd_);
+  }
+  ScopedFd(const ScopedFd&) = delete;
+  ScopedFd& operator=(const ScopedFd&) = delete;
+
+  int get() const { return fd_; }
+  int release() { return std::exchange(fd_, -1); }
+
+ private:
+  int fd_;
+};
+
+// Fills the address for path, '@' standing for the abstract namespace.
+// Returns its length.
+ErrorStrOr<socklen_t> MakeAddress(const std::string& path,
+                                  struct sockaddr_un& address) {
+  address = {};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path == "@") {
+    return std::unexpected("Invalid control socket '" + path + "'");
+  }
+  if (path.size() >= sizeof(address.sun_path)) {
+    return std::unexpected("Control socket path is too long: " + path);
+  }
+  memcpy(address.sun_path, path.data(), path.size());
+  // Abstract names are not null terminated, and may not be shorter.
+  if (path[0] == '@') {
+    address.sun_path[0] = '\0';
+    return offsetof(struct sockaddr_un, sun_path) + path.size();
+  }
+  return offsetof(struct sockaddr_un, sun_path) + path.size() + 1;
+}
+
+// Whether path is a socket nobody listens on, e.g. left by a crash.
+bool IsStaleSocket(const std::string& path, const struct sockaddr_un& address,
+                   socklen_t length) {
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0 || !S_ISSOCK(status.st_mode)) {
+    return false;
+  }
+  ScopedFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (fd.get() < 0) return false;
+  return connect(fd.get(), reinterpret_cast<const struct sockaddr*>(&address),
+                 length) != 0 &&
+         errno == ECONNREFUSED;
+}
+
+bool HasCompleteRequest(std::span<const uint8_t> buffer) {
+  return buffer.size() >= kControlRequestHeaderSize &&
+         buffer.size() >= std::size_t(kControlRequestHeaderSize + buffer[1]);
+}
+
+void AppendKeyCode(int key_code, std::vector<uint8_t>& out) {
+  out.push_back(key_code & 0xff);
+  out.push_back(key_code >> 8);
+}
+
+}  // namespace
+
+void EncodeControlState(const ControlState& state, std::vector<uint8_t>& out) {
+  out.push_back(state.profile);
+  const std::size_t name_size =
+      std::min<std::size_t>(state.profile_name.size(), 255);
+  out.push_back(name_size);
+  out.insert(out.end(), state.profile_name.begin(),
+             state.profile_name.begin() + name_size);
+  // There can be no more layers than keys, but only 255 fit.
+  const std::size_t num_layers =
+      std::min<std::size_t>(state.layer_keys.size(), 255);
+  out.push_back(num_layers);
+  for (std::size_t index = 0; index < num_layers; ++index) {
+    AppendKeyCode(state.layer_keys[index], out);
+  }
+  AppendKeyCode(state.held_keys.size(), out);
+  for (const int key_code : state.held_keys) AppendKeyCode(key_code, out);
+}
+
+ErrorStrOr<ControlState> DecodeControlState(std::span<const uint8_t> data) {
+  std::size_t offset = 0;
+  // Each returns false if the data is too short.
+  const auto read_byte = [&](int& value) {
+    if (offset + 1 > data.size()) return false;
+    value = data[offset++];
+    return true;
+  };
+  const auto read_word = [&](int& value) {
+    if (offset + 2 > data.size()) return false;
+    value = data[offset] | (data[offset + 1] << 8);
+    offset += 2;
+    return true;
+  };
+  const auto read_keys = [&](int count, std::vector<int>& keys) {
+    keys.resize(count);
+    for (int& key_code : keys) {
+      if (!read_word(key_code)) return false;
+    }
+    return true;
+  };
+
+  ControlState state;
+  int name_size = 0;
+  int num_layers = 0;
+  int num_held = 0;
+  if (!read_byte(state.profile) || !read_byte(name_size) ||
+      offset + name_size > data.size()) {
+    return std::unexpected("Truncated state");
+  }
+  state.profile_name.assign(data.begin() + offset,
+                            data.begin() + offset + name_size);
+  offset += name_size;
+  if (!read_byte(num_layers) || !read_keys(num_layers, state.layer_keys) ||
+      !read_word(num_held) || !read_keys(num_held, state.held_keys)) {
+    return std::unexpected("Truncated state");
+  }
+  return state;
+}
+
+ControlServer::ControlServer(int listen_fd, int epoll_fd, std::string path)
+    : listen_fd_(listen_fd), epoll_fd_(epoll_fd), path_(std::move(path)) {}
+
+ErrorStrOr<ControlServer> ControlServer::Listen(const std::string& path) {
+  struct sockaddr_un address;
+  ASSIGN_OR_RETURN(const socklen_t length, MakeAddress(path, address));
+  const bool abstract = path[0] == '@';
+
+  ScopedFd listen_fd(
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+  if (listen_fd.get() < 0) {
+    return std::unexpected(std::string("Could not create a socket: ") +
+                           strerror(errno));
+  }
+  const auto bind_address = [&]() {
+    return bind(listen_fd.get(),
+                reinterpret_cast<const struct sockaddr*>(&address), length);
+  };
+  int result = bind_address();
+  if (result != 0 && errno == EADDRINUSE && !abstract &&
+      IsStaleSocket(path, address, length)) {
+    unlink(path.c_str());
+    result = bind_address();
+  }
+  if (result != 0 || listen(listen_fd.get(), kMaxControlClients) != 0) {
+    return std::unexpected("Could not listen on " + path + ": " +
+                           strerror(errno));
+  }
+
+  ScopedFd epoll_fd(epoll_create1(EPOLL_CLOEXEC));
+  struct epoll_event event {};
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd.get();
+  if (epoll_fd.get() < 0 ||
+      epoll_ctl(epoll_fd.get(), EPOLL_CTL_ADD, listen_fd.get(), &event) != 0) {
+    const std::string error = strerror(errno);
+    if (!abstract) unlink(path.c_str());
+    return std::unexpected("Could not poll " + path + ": " + error);
+  }
+  return ControlServer(listen_fd.release(), epoll_fd.release(),
+                       abstract ? "" : path);
+}
+
+ControlServer::ControlServer(ControlServer&& other)
+    : listen_fd_(std::exchange(other.listen_fd_, -1)),
+      epoll_fd_(std::exchange(other.epoll_fd_, -1)),
+      path_(std::exchange(other.path_, "")),
+      has_pending_(other.has_pending_),
+      signum_(other.signum_) {
+  for (int index = 0; index < kMaxControlClients; ++index) {
+    clients_[index] = std::move(other.clients_[index]);
+    other.clients_[index].fd = -1;
+  }
+}
+
+ControlServer::~ControlServer() {
+  for (auto& client : clients_) {
+    if (client.fd >= 0) close(client.fd);
+  }
+  if (epoll_fd_ >= 0) close(epoll_fd_);
+  if (listen_fd_ >= 0) close(listen_fd_);
+  if (!path_.empty()) unlink(path_.c_str());
+}
+
+void ControlServer::Serve(const Handler& handler) {
+  int budget = kMaxControlRequestsPerServe;
+  const auto serve = [&](Client& client, bool readable) {
+    if ((readable && !ReadFrom(client)) ||
+        !AnswerRequests(client, handler, budget) ||
+        (client.closed && !HasCompleteRequest(client.buffer))) {
+      Drop(client);
+    }
+  };
+
+  // Requests left over from the last call go first.
+  for (auto& client : clients_) {
+    if (client.fd >= 0 && HasCompleteRequest(client.buffer)) {
+      serve(client, /*readable=*/false);
+    }
+  }
+
+  struct epoll_event ready[kMaxControlClients + 1];
+  const int num_ready =
+      epoll_wait(epoll_fd_, ready, kMaxControlClients + 1, /*timeout=*/0);
+  for (int index = 0; index < num_ready; ++index) {
+    const int fd = ready[index].data.fd;
+    if (fd == listen_fd_) {
+      // The first request is likely sent already.
+      Client* client = Accept();
+      if (client != nullptr) serve(*client, /*readable=*/true);
+      continue;
+    }
+    for (auto& client : clients_) {
+      if (client.fd == fd) {
+        serve(client, /*readable=*/true);
+        break;
+      }
+    }
+  }
+
+  has_pending_ = false;
+  for (const auto& client : clients_) {
+    has_pending_ |= client.fd >= 0 && HasCompleteRequest(client.buffer);
+  }
+}
+
+void ControlServer::SignalOnInput(int signum) {
+  signum_ = signum;
+  SetAsync(listen_fd_);
+  for (const auto& client : clients_) {
+    if (client.fd >= 0) SetAsync(client.fd);
+  }
+}
+
+ControlServer::Client* ControlServer::Accept() {
+  ScopedFd fd(accept4(listen_fd_, nullptr, nullptr,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC));
+  if (fd.get() < 0) return nullptr;
+  // Abstract sockets have no permissions, so check who it is.
+  struct ucred peer {};
+  socklen_t size = sizeof(peer);
+  if (getsockopt(fd.get(), SOL_SOCKET, SO_PEERCRED, &peer, &size) != 0 ||
+      (peer.uid != 0 && peer.uid != geteuid())) {
+    return nullptr;
+  }
+  for (auto& client : clients_) {
+    if (client.fd >= 0) continue;
+    struct epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = fd.get();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd.get(), &event) != 0) {
+      return nullptr;
+    }
+    if (signum_ != 0) SetAsync(fd.get());
+    client.buffer.clear();
+    client.closed = false;
+    client.fd = fd.release();
+    return &client;
+  }
+  // Too many clients, closed.
+  return nullptr;
+}
+
+bool ControlServer::ReadFrom(Client& client) {
+  if (client.closed) return true;
+  // Never more than a request, so a client cannot make us buffer much.
+  const std::size_t size = client.buffer.size();
+  if (size >= kMaxControlRequestSize) return true;
+  client.buffer.resize(kMaxControlRequestSize);
+  const ssize_t bytes_read =
+      recv(client.fd, client.buffer.data() + size,
+           kMaxControlRequestSize - size, MSG_DONTWAIT);
+  client.buffer.resize(size + std::max<ssize_t>(bytes_read, 0));
+  if (bytes_read > 0) return true;
+  if (bytes_read == 0) {
+    // Closed for writing, requests sent before are still answered.
+    client.closed = true;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, client.fd, nullptr);
+    return true;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+bool ControlServer::AnswerRequests(Client& client, const Handler& handler,
+                                   int& budget) {
+  std::size_t offset = 0;
+  bool sent = true;
+  while (sent && budget > 0) {
+    const auto request = std::span(client.buffer).subspan(offset);
+    if (!HasCompleteRequest(request)) break;
+    const auto payload = request.subspan(kControlRequestHeaderSize, request[1]);
+    offset += kControlRequestHeaderSize + payload.size();
+    --budget;
+
+    std::vector<uint8_t> reply(kControlReplyHeaderSize);
+    const ControlStatus status =
+        handler(ControlCommand(request[0]), payload, reply);
+    const std::size_t size = std::min<std::size_t>(
+        reply.size() - kControlReplyHeaderSize, kMaxControlReplyPayload);
+    reply.resize(kControlReplyHeaderSize + size);
+    reply[0] = uint8_t(status);
+    reply[1] = size & 0xff;
+    reply[2] = size >> 8;
+    // Replies are small, so this only fails if the client does not read them.
+    sent = send(client.fd, reply.data(), reply.size(),
+                MSG_DONTWAIT | MSG_NOSIGNAL) == ssize_t(reply.size());
+  }
+  client.buffer.erase(client.buffer.begin(), client.buffer.begin() + offset);
+  return sent;
+}
+
+void ControlServer::Drop(Client& client) {
+  close(client.fd);
+  client.fd = -1;
+  client.buffer.clear();
+  client.closed = false;
+}
+
+void ControlServer::SetAsync(int fd) const {
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETOWN, getpid()) == -1 ||
+      fcntl(fd, F_SETSIG, signum_) == -1 ||
+      fcntl(fd, F_SETFL, flags | O_ASYNC) == -1) {
+    perror("WARNING: Control socket will not wake the loop");
+  }
+}
+
+ErrorStrOr<ControlReply> SendControlRequest(const std::string& path,
+                                            ControlCommand command,
+                                            std::span<const uint8_t> payload) {
+  if (payload.size() > 255) return std::unexpected("Request is too long");
+  struct sockaddr_un address;
+  ASSIGN_OR_RETURN(const socklen_t length, MakeAddress(path, address));
+  ScopedFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (fd.get() < 0) {
+    return std::unexpected(std::string("Could not create a socket: ") +
+                           strerror(errno));
+  }
+  // Do not hang if keyshift is stuck.
+  struct timeval timeout {};
+  timeout.tv_sec = 2;
+  setsockopt(fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (connect(fd.get(), reinterpret_cast<const struct sockaddr*>(&address),
+              length) != 0) {
+    return std::unexpected("Could not connect to " + path + ": " +
+                           strerror(errno));
+  }
+
+  std::vector<uint8_t> request = {uint8_t(command), uint8_t(payload.size())};
+  request.insert(request.end(), payload.begin(), payload.end());
+  if (send(fd.get(), request.data(), request.size(), MSG_NOSIGNAL) !=
+      ssize_t(request.size())) {
+    return std::unexpected(std::string("Could not send: ") + strerror(errno));
+  }
+
+  // Reads exactly size bytes.
+  const auto receive = [&fd](uint8_t* data, std::size_t size) {
+    while (size > 0) {
+      const ssize_t bytes_read = recv(fd.get(), data, size, 0);
+      if (bytes_read <= 0) return false;
+      data += bytes_read;
+      size -= bytes_read;
+    }
+    return true;
+  };
+  uint8_t header[kControlReplyHeaderSize];
+  ControlReply reply;
+  if (receive(header, sizeof(header))) {
+    reply.status = ControlStatus(header[0]);
+    reply.payload.resize(header[1] | (header[2] << 8));
+    if (receive(reply.payload.data(), reply.payload.size())) return reply;
+  }
+  return std::unexpected("No reply from " + path);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CONTROL_CHANNEL_H
+#define __CONTROL_CHANNEL_H
+
+// A Unix socket to query and control a running keyshift, served from the main
+// loop. See docs/control_socket.md.
+//
+// Requests are a command byte, a payload length byte, and the payload.
+// Replies are a status byte, the payload length as 2 bytes little endian, and
+// the payload. Requests on a connection are answered in order.
+//
+// Sockets are non-blocking, and each Serve() does a bounded amount of work, so
+// that clients cannot hold up key processing. A client which does not read
+// its replies is disconnected.
+
+#include <linux/input.h>
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "utility/essentials.h"
+
+enum class ControlCommand : uint8_t {
+  // Reply: see EncodeControlState().
+  kQueryState = 1,
+  // Payload: the name of the profile.
+  kSwitchProfile = 2,
+  // Reads the config files again.
+  kReload = 3,
+  // Reply: the counters, as text.
+  kStats = 4,
+  // Payload: 1 byte, 1 to show the key events read as with --dry-run, 0 to
+  // stop.
+  kSetTracing = 5,
+};
+
+enum class ControlStatus : uint8_t {
+  kOk = 0,
+  // The reply is the error message.
+  kError = 1,
+  kUnknownCommand = 2,
+};
+
+// Sizes on the wire.
+const int kControlRequestHeaderSize = 2;
+const int kControlReplyHeaderSize = 3;
+const int kMaxControlRequestSize = kControlRequestHeaderSize + 255;
+const int kMaxControlReplyPayload = 65535;
+
+// Connections served at once. More are closed right after being accepted.
+const int kMaxControlClients = 4;
+// Requests answered per Serve(), across all clients.
+const int kMaxControlRequestsPerServe = 4;
+
+// Reply to kQueryState.
+struct ControlState {
+  int profile = 0;
+  // Empty if there are no profiles.
+  std::string profile_name;
+  // Keys holding the active layers, innermost last.
+  std::vector<int> layer_keys;
+  // Keys held on the output.
+  std::vector<int> held_keys;
+};
+
+// The profile and its name's length are a byte each, followed by the name.
+// Then the number of layers is a byte, followed by their keys. Then the
+// number of held keys and the keys. Key codes and the number of held keys are
+// 2 bytes little endian.
+void EncodeControlState(const ControlState& state, std::vector<uint8_t>& out);
+ErrorStrOr<ControlState> DecodeControlState(std::span<const uint8_t> data);
+
+// Keys set in a bitset, e.g. HeldKeys(), as key codes.
+inline std::vector<int> KeyCodesIn(const std::bitset<KEY_CNT>& keys) {
+  std::vector<int> key_codes;
+  for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+    if (keys.test(key_code)) key_codes.push_back(key_code);
+  }
+  return key_codes;
+}
+
+class ControlServer {
+ public:
+  // Answers a request by appending to reply.
+  using Handler = std::function<ControlStatus(ControlCommand command,
+                                              std::span<const uint8_t> payload,
+                                              std::vector<uint8_t>& reply)>;
+
+  // Listens at path, or in the abstract namespace if it starts with '@'.
+  // Only processes of the same user, or root, may connect.
+  static ErrorStrOr<ControlServer> Listen(const std::string& path);
+
+  ~ControlServer();
+
+  // Movable but not copyable.
+  ControlServer(ControlServer&& other);
+  ControlServer& operator=(ControlServer&&) = delete;
+
+  // An epoll instance to poll, readable when there is something to serve.
+  int fd() const { return epoll_fd_; }
+
+  // Requests buffered but not yet answered, so Serve() should be called again
+  // without waiting.
+  bool has_pending() const { return has_pending_; }
+
+  // Accepts connections, and reads and answers requests, within the limits
+  // above. Never blocks.
+  void Serve(const Handler& handler);
+
+  // Sends signum when there is something to serve, for a loop which does not
+  // poll, e.g. with --busy-poll. Its handler must already be installed.
+  void SignalOnInput(int signum);
+
+ private:
+  struct Client {
+    int fd = -1;
+    // A partial request, or requests left for the next Serve().
+    std::vector<uint8_t> buffer;
+    // Closed for writing by the client, dropped once its requests are
+    // answered.
+    bool closed = false;
+  };
+
+  ControlServer(int listen_fd, int epoll_fd, std::string path);
+
+  // Returns null if the connection was closed instead.
+  Client* Accept();
+  // Reads what fits in the client's buffer. Returns false if it is gone.
+  bool ReadFrom(Client& client);
+  // Answers buffered requests until the budget is spent. Returns false if the
+  // client is to be dropped.
+  bool AnswerRequests(Client& client, const Handler& handler, int& budget);
+  void Drop(Client& client);
+  void SetAsync(int fd) const;
+
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  // Unlinked on exit, empty for abstract sockets.
+  std::string path_;
+  std::array<Client, kMaxControlClients> clients_;
+  bool has_pending_ = false;
+  // Set by SignalOnInput(), for new clients.
+  int signum_ = 0;
+};
+
+// Sends a request to the socket at path, and waits for the reply. For the
+// command line, and for tests.
+struct ControlReply {
+  ControlStatus status;
+  std::vector<uint8_t> payload;
+};
+ErrorStrOr<ControlReply> SendControlRequest(const std::string& path,
+                                            ControlCommand command,
+                                            std::span<const uint8_t> payload);
+
+#endif  // __CONTROL_CHANNEL_H
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "control_channel.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Unique per process, so that tests can run in parallel.
+std::string TestSocket(const std::string& name) {
+  return "@keyshift_test_" + name + "_" + std::to_string(getpid());
+}
+
+// A blocking client of an abstract socket.
+int Connect(const std::string& path) {
+  struct sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path + 1, path.data() + 1, path.size() - 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  REQUIRE(connect(fd, reinterpret_cast<const struct sockaddr*>(&address),
+                  offsetof(struct sockaddr_un, sun_path) + path.size()) == 0);
+  return fd;
+}
+
+void Send(int fd, const std::vector<uint8_t>& data) {
+  REQUIRE(send(fd, data.data(), data.size(), 0) == ssize_t(data.size()));
+}
+
+// Whatever was answered so far.
+std::vector<uint8_t> Received(int fd) {
+  std::vector<uint8_t> data(1024);
+  const ssize_t size = recv(fd, data.data(), data.size(), MSG_DONTWAIT);
+  data.resize(size > 0 ? size : 0);
+  return data;
+}
+
+// Replies with the command and the payload, and records the commands.
+struct EchoHandler {
+  std::vector<int> commands;
+
+  ControlServer::Handler handler() {
+    return [this](ControlCommand command, std::span<const uint8_t> payload,
+                  std::vector<uint8_t>& reply) {
+      commands.push_back(int(command));
+      reply.push_back(uint8_t(command));
+      reply.insert(reply.end(), payload.begin(), payload.end());
+      return ControlStatus::kOk;
+    };
+  }
+};
+
+TEST_CASE("State round trip", "[control_channel]") {
+  const ControlState state{2, "game", {KEY_CAPSLOCK, KEY_LEFTALT},
+                           {KEY_A, KEY_LEFTSHIFT}};
+  std::vector<uint8_t> data;
+  EncodeControlState(state, data);
+  const auto decoded = DecodeControlState(data);
+  REQUIRE(decoded.has_value());
+  CHECK(decoded->profile == 2);
+  CHECK(decoded->profile_name == "game");
+  CHECK(decoded->layer_keys == state.layer_keys);
+  CHECK(decoded->held_keys == state.held_keys);
+
+  data.pop_back();
+  CHECK_FALSE(DecodeControlState(data).has_value());
+}
+
+TEST_CASE("Serves requests", "[control_channel]") {
+  const std::string path = TestSocket("serve");
+  auto server = ControlServer::Listen(path);
+  REQUIRE(server.has_value());
+  EchoHandler echo;
+  const int client = Connect(path);
+
+  SECTION("In order, with replies framed") {
+    Send(client, {1, 0, 2, 3, 'a', 'b', 'c'});
+    server->Serve(echo.handler());
+    CHECK(echo.commands == std::vector<int>{1, 2});
+    CHECK(Received(client) ==
+          std::vector<uint8_t>{0, 1, 0, 1, 0, 4, 0, 2, 'a', 'b', 'c'});
+  }
+
+  SECTION("Split across reads") {
+    Send(client, {2, 2, 'a'});
+    server->Serve(echo.handler());
+    CHECK(echo.commands.empty());
+    Send(client, {'b'});
+    server->Serve(echo.handler());
+    CHECK(Received(client) == std::vector<uint8_t>{0, 3, 0, 2, 'a', 'b'});
+  }
+
+  SECTION("Bounded per call") {
+    std::vector<uint8_t> requests;
+    for (int i = 0; i < kMaxControlRequestsPerServe + 2; ++i) {
+      requests.push_back(4);
+      requests.push_back(0);
+    }
+    Send(client, requests);
+    server->Serve(echo.handler());
+    CHECK(echo.commands.size() == kMaxControlRequestsPerServe);
+    CHECK(server->has_pending());
+    server->Serve(echo.handler());
+    CHECK(echo.commands.size() == kMaxControlRequestsPerServe + 2);
+    CHECK_FALSE(server->has_pending());
+  }
+
+  SECTION("Answered after the client stops writing") {
+    Send(client, {3, 0});
+    shutdown(client, SHUT_WR);
+    server->Serve(echo.handler());
+    CHECK(Received(client) == std::vector<uint8_t>{0, 1, 0, 3});
+    // Then closed.
+    server->Serve(echo.handler());
+    char byte;
+    CHECK(recv(client, &byte, 1, MSG_DONTWAIT) == 0);
+  }
+  close(client);
+}
+
+TEST_CASE("Limits clients", "[control_channel]") {
+  const std::string path = TestSocket("limit");
+  auto server = ControlServer::Listen(path);
+  REQUIRE(server.has_value());
+  EchoHandler echo;
+  std::vector<int> clients;
+  for (int i = 0; i <= kMaxControlClients; ++i) {
+    clients.push_back(Connect(path));
+    server->Serve(echo.handler());
+  }
+  char byte;
+  CHECK(recv(clients.front(), &byte, 1, MSG_DONTWAIT) == -1);
+  CHECK(recv(clients.back(), &byte, 1, MSG_DONTWAIT) == 0);
+  for (const int client : clients) close(client);
+}
+
+TEST_CASE("Sends requests", "[control_channel]") {
+  const std::string path = TestSocket("send");
+  auto server = ControlServer::Listen(path);
+  REQUIRE(server.has_value());
+  EchoHandler echo;
+  std::atomic<bool> done = false;
+  std::thread serve([&]() {
+    while (!done) server->Serve(echo.handler());
+  });
+  const std::vector<uint8_t> payload = {'x'};
+  const auto reply =
+      SendControlRequest(path, ControlCommand::kSwitchProfile, payload);
+  done = true;
+  serve.join();
+  REQUIRE(reply.has_value());
+  CHECK(reply->status == ControlStatus::kOk);
+  CHECK(reply->payload == std::vector<uint8_t>{2, 'x'});
+
+  CHECK_FALSE(SendControlRequest(TestSocket("none"), ControlCommand::kStats, {})
+                  .has_value());
+}
+
+TEST_CASE("Socket files", "[control_channel]") {
+  const std::string path =
+      "/tmp/keyshift_test_" + std::to_string(getpid()) + ".sock";
+  unlink(path.c_str());
+  {
+    auto server = ControlServer::Listen(path);
+    REQUIRE(server.has_value());
+    // Taken, while it is served.
+    CHECK_FALSE(ControlServer::Listen(path).has_value());
+  }
+  // Removed on exit.
+  struct stat status;
+  CHECK(stat(path.c_str(), &status) != 0);
+
+  SECTION("Left over by a crash, replaced") {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+    REQUIRE(bind(fd, reinterpret_cast<const struct sockaddr*>(&address),
+                 sizeof(address)) == 0);
+    close(fd);
+    CHECK(ControlServer::Listen(path).has_value());
+  }
+
+  SECTION("Other files are not replaced") {
+    close(creat(path.c_str(), 0600));
+    CHECK_FALSE(ControlServer::Listen(path).has_value());
+    unlink(path.c_str());
+  }
+}
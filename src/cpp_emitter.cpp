@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpp_emitter.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "keycode_lookup.h"
+#include "remap_operator.h"
+#include "utility/essentials.h"
+
+const char* KeyEventTypeName(KeyEventType value) {
+  switch (value) {
+    case KeyEventType::kKeyPress:
+      return "KeyEventType::kKeyPress";
+    case KeyEventType::kKeyRelease:
+      return "KeyEventType::kKeyRelease";
+    case KeyEventType::kKeyRepeat:
+      return "KeyEventType::kKeyRepeat";
+  }
+  return "KeyEventType::kKeyPress";
+}
+
+// Collects action lists, and emits them as a flat array with ranges into it.
+class ActionTable {
+ public:
+  // Returns the index of the range.
+  int Add(const std::vector<Action>& actions) {
+    const int begin = num_actions_;
+    for (const auto& action : actions) {
+      if (std::holds_alternative<KeyEvent>(action)) {
+        const auto& key_event = std::get<KeyEvent>(action);
+        AddAction("kKey", key_event.key_code, key_event.value,
+                  KeyCodeToName(key_event.key_code));
+      } else if (std::holds_alternative<ActionWait>(action)) {
+        const int milli_seconds = std::get<ActionWait>(action).milli_seconds;
+        AddAction("kWait", milli_seconds, KeyEventType::kKeyPress,
+                  std::to_string(milli_seconds) + "ms");
+      } else if (std::holds_alternative<ActionLayerChange>(action)) {
+        const int layer_index = std::get<ActionLayerChange>(action).layer_index;
+        AddAction("kLayerChange", layer_index, KeyEventType::kKeyPress,
+                  "State #" + std::to_string(layer_index));
+      }
+    }
+    ranges_ << "      {" << begin << ", " << num_actions_ << "},\n";
+    return num_ranges_++;
+  }
+
+  void Emit(std::ostream& os) const {
+    os << "  static constexpr std::array<CompiledAction, " << num_actions_
+       << "> kActions = {{\n"
+       << actions_.str() << "  }};\n\n";
+    os << "  static constexpr std::array<CompiledActionRange, " << num_ranges_
+       << "> kRanges = {{\n"
+       << ranges_.str() << "  }};\n\n";
+  }
+
+ private:
+  void AddAction(const char* type, int code, KeyEventType value,
+                 const std::string& comment) {
+    actions_ << "      {CompiledAction::Type::" << type << ", " << code << ", "
+             << KeyEventTypeName(value) << "},  // " << comment << "\n";
+    ++num_actions_;
+  }
+
+  std::ostringstream actions_;
+  std::ostringstream ranges_;
+  int num_actions_ = 0;
+  int num_ranges_ = 0;
+};
+
+// Same as Remapper::ExpandToActions() does for a repeat which is not mapped,
+// but its release is: repeat the first key released, if any.
+std::vector<Action> RepeatFromRelease(const std::vector<Action>& actions) {
+  for (const auto& action : actions) {
+    if (!std::holds_alternative<KeyEvent>(action)) continue;
+    KeyEvent key_event = std::get<KeyEvent>(action);
+    if (key_event.value != KeyEventType::kKeyRelease) continue;
+    key_event.value = KeyEventType::kKeyRepeat;
+    return {key_event};
+  }
+  return {};
+}
+
+ErrorStrOr<void> EmitCpp(const Remapper& remapper, std::ostream& os) {
+  if (!remapper.config()->chords.empty()) {
+    return std::unexpected("Chords are not supported in compiled configs.");
+  }
+  // Sequence 0 is the kill combo, which CompiledRemapper has.
+  if (remapper.config()->sequences.size() > 1) {
+    return std::unexpected(
+        "Sequences are not supported in compiled configs.");
+  }
+  if (!remapper.config()->texts.empty()) {
+    return std::unexpected("Texts are not supported in compiled configs.");
+  }
+  if (!remapper.config()->modified_action_map.empty()) {
+    return std::unexpected(
+        "Modifier conditions are not supported in compiled configs.");
+  }
+  // Includes mouse buttons, which the compiled keyshift's device lacks.
+  if (remapper.UsesMouseKeys()) {
+    return std::unexpected("Mouse keys are not supported in compiled configs.");
+  }
+  const auto& states = remapper.states();
+  for (const auto& state : states) {
+    for (const auto& [_, state_actions] : state.action_map) {
+      for (const auto& action : state_actions) {
+        if (std::holds_alternative<ActionAutofire>(action)) {
+          return std::unexpected(
+              "Autofire is not supported in compiled configs.");
+        }
+        if (std::holds_alternative<ActionSwitchProfile>(action)) {
+          return std::unexpected(
+              "Profiles are not supported in compiled configs.");
+        }
+      }
+    }
+    for (const auto& action : state.null_event_actions) {
+      if (std::holds_alternative<ActionSwitchProfile>(action)) {
+        return std::unexpected(
+            "Profiles are not supported in compiled configs.");
+      }
+    }
+  }
+  ActionTable actions;
+  std::ostringstream mappings;
+  int num_mappings = 0;
+  std::ostringstream lookup;
+  std::vector<int> null_event_ranges;
+
+  for (std::size_t state_index = 0; state_index < states.size();
+       ++state_index) {
+    const auto& state = states[state_index];
+    // Sorted, so that the output is stable.
+    std::map<std::pair<int, int>, const std::vector<Action>*> sorted;
+    for (const auto& [trigger, state_actions] : state.action_map) {
+      sorted[{trigger.key_code, int(trigger.value)}] = &state_actions;
+    }
+    // Key code * 4 + value, to the range.
+    std::map<int, int> cases;
+    for (const auto& [trigger, state_actions] : sorted) {
+      const auto& [key_code, value] = trigger;
+      const int range = actions.Add(*state_actions);
+      cases[key_code * 4 + value] = range;
+      mappings << "      {" << state_index << ", {" << key_code << ", "
+               << KeyEventTypeName(KeyEventType(value)) << "}, " << range
+               << "},\n";
+      ++num_mappings;
+    }
+    for (const auto& [trigger, state_actions] : sorted) {
+      const auto& [key_code, value] = trigger;
+      if (KeyEventType(value) != KeyEventType::kKeyRelease) continue;
+      const int repeat_case = key_code * 4 + int(KeyEventType::kKeyRepeat);
+      if (cases.contains(repeat_case)) continue;
+      cases[repeat_case] = actions.Add(RepeatFromRelease(*state_actions));
+    }
+    null_event_ranges.push_back(actions.Add(state.null_event_actions));
+
+    if (cases.empty()) continue;
+    lookup << "      case " << state_index << ":\n"
+           << "        switch (key_code * 4 + value) {\n";
+    for (const auto& [key_case, range] : cases) {
+      lookup << "          case " << key_case << ":  // "
+             << KeyEvent{key_case / 4, KeyEventType(key_case % 4)} << "\n"
+             << "            return " << range << ";\n";
+    }
+    lookup << "        }\n"
+           << "        break;\n";
+  }
+
+  os << "// Generated by `keyshift --emit-cpp`, do not edit.\n"
+     << "\n"
+     << "#ifndef __KEYSHIFT_COMPILED_CONFIG_H\n"
+     << "#define __KEYSHIFT_COMPILED_CONFIG_H\n"
+     << "\n"
+     << "#include <array>\n"
+     << "#include <cstdint>\n"
+     << "\n"
+     << "#include \"compiled_remapper.h\"\n"
+     << "\n"
+     << "struct CompiledConfigTables {\n"
+     << "  static constexpr int kNumStates = " << states.size() << ";\n\n";
+  actions.Emit(os);
+
+  os << "  static constexpr std::array<bool, kNumStates> kAllowOtherKeys = "
+        "{{\n";
+  for (const auto& state : states) {
+    os << "      " << (state.allow_other_keys ? "true" : "false") << ",\n";
+  }
+  os << "  }};\n\n";
+
+  os << "  static constexpr std::array<int, kNumStates> kNullEventActions = "
+        "{{\n";
+  for (const int range : null_event_ranges) {
+    os << "      " << range << ",\n";
+  }
+  os << "  }};\n\n";
+
+  os << "  static constexpr std::array<CompiledMapping, " << num_mappings
+     << "> kMappings = {{\n"
+     << mappings.str() << "  }};\n\n";
+
+  const auto& passthrough_keys = remapper.passthrough_keys();
+  os << "  static constexpr std::array<uint64_t, (KEY_CNT + 63) / 64>\n"
+     << "      kPassthroughKeys = {{\n";
+  for (int word = 0; word < (KEY_CNT + 63) / 64; ++word) {
+    uint64_t bits = 0;
+    for (int bit = 0; bit < 64 && word * 64 + bit < KEY_CNT; ++bit) {
+      if (passthrough_keys.test(word * 64 + bit)) bits |= uint64_t(1) << bit;
+    }
+    os << "          0x" << std::hex << std::setw(16) << std::setfill('0')
+       << bits << std::dec << "ULL,\n";
+  }
+  os << "      }};\n\n";
+
+  os << "  static constexpr int Lookup(int state, int key_code, int value) {\n"
+     << "    if (key_code < 0 || value < 0 || value > 2) return -1;\n"
+     << "    switch (state) {\n"
+     << lookup.str() << "    }\n"
+     << "    return -1;\n"
+     << "  }\n"
+     << "};\n"
+     << "\n"
+     << "using CompiledConfigRemapper =\n"
+     << "    CompiledRemapper<CompiledConfigTables::kNumStates,\n"
+     << "                     CompiledConfigTables>;\n"
+     << "\n"
+     << "#endif  // __KEYSHIFT_COMPILED_CONFIG_H\n";
+  return {};
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CPP_EMITTER_H
+#define __CPP_EMITTER_H
+
+// Compiles a parsed config to C++, for `keyshift --emit-cpp`.
+//
+// The output is a header that defines CompiledConfigRemapper, a
+// CompiledRemapper specialized for the config. See compiled_remapper.h.
+
+#include <iostream>
+
+#include "remap_operator.h"
+#include "utility/essentials.h"
+
+// Call UpdatePassthroughKeys() on the remapper first. Fails, writing nothing,
+// if the config uses features CompiledRemapper does not have.
+ErrorStrOr<void> EmitCpp(const Remapper& remapper, std::ostream& os);
+
+#endif  // __CPP_EMITTER_H
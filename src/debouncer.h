@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __DEBOUNCER_H
+#define __DEBOUNCER_H
+
+// Filters out chatter from worn switches, where one press is read as e.g.
+// press, release, press within a few milliseconds.
+//
+// Debouncing is eager: the first edge of a key passes right away, so no
+// latency is added. It opens a window for the key, and edges within the window
+// are dropped. Times are from the events themselves, see input_event.time.
+//
+// If the key ends up in a different state than what passed, e.g. a genuine tap
+// shorter than the window, the last state is sent once the window is over, by
+// Expire(). Nothing needs to be timed unless that happens.
+
+#include <linux/input.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+class Debouncer {
+ public:
+  struct Counters {
+    // Edges dropped within a window.
+    long suppressed = 0;
+    // States sent after a window, see Expire().
+    long corrected = 0;
+  };
+
+  explicit Debouncer(int window_ms) : window_us_(int64_t(window_ms) * 1000) {}
+
+  // Returns false if the key event must be dropped.
+  inline bool Accept(const struct input_event& ie) {
+    if (ie.code >= KEY_CNT) [[unlikely]] {
+      return true;
+    }
+    auto& key = keys_[ie.code];
+    if (ie.value == 2) {
+      // Repeats are only meaningful if the press went through.
+      return key.passed == 1;
+    }
+    key.last = ie.value;
+    const int64_t time_us = TimeUs(ie.time);
+    if (time_us - key.edge_us < window_us_) [[unlikely]] {
+      ++counters_.suppressed;
+      if (!key.pending) {
+        key.pending = true;
+        pending_.push_back(ie.code);
+      }
+      return false;
+    }
+    key.passed = ie.value;
+    key.edge_us = time_us;
+    return true;
+  }
+
+  bool has_pending() const { return !pending_.empty(); }
+
+  // Milliseconds until Expire() has work to do, or -1 if never.
+  int TimeoutMs(int64_t now_us) const {
+    if (pending_.empty()) return -1;
+    int64_t earliest = INT64_MAX;
+    for (const int code : pending_) {
+      earliest = std::min(earliest, keys_[code].edge_us + window_us_);
+    }
+    if (earliest <= now_us) return 0;
+    // Rounded up, so that the window is over by then.
+    return int((earliest - now_us + 999) / 1000);
+  }
+
+  // For keys whose window is over, calls emit(ie) with the last state read if
+  // it differs from what passed.
+  template <typename Emit>
+  void Expire(int64_t now_us, Emit&& emit) {
+    for (std::size_t i = 0; i < pending_.size();) {
+      const int code = pending_[i];
+      auto& key = keys_[code];
+      if (key.edge_us + window_us_ > now_us) {
+        ++i;
+        continue;
+      }
+      key.pending = false;
+      pending_[i] = pending_.back();
+      pending_.pop_back();
+      if (key.last == key.passed) continue;
+      key.passed = key.last;
+      key.edge_us = now_us;
+      ++counters_.corrected;
+      struct input_event ie {};
+      ie.time.tv_sec = now_us / 1000000;
+      ie.time.tv_usec = now_us % 1000000;
+      ie.type = EV_KEY;
+      ie.code = code;
+      ie.value = key.last;
+      emit(ie);
+    }
+  }
+
+  const Counters& counters() const { return counters_; }
+
+  static int64_t TimeUs(const struct timeval& time) {
+    return int64_t(time.tv_sec) * 1000000 + time.tv_usec;
+  }
+
+ private:
+  struct KeyState {
+    // Time of the last edge that passed.
+    int64_t edge_us = INT64_MIN / 2;
+    // Last value that passed, and last value read.
+    int8_t passed = 0;
+    int8_t last = 0;
+    bool pending = false;
+  };
+
+  const int64_t window_us_;
+  std::array<KeyState, KEY_CNT> keys_{};
+  // Keys with edges dropped in a window that is not over yet.
+  std::vector<int> pending_;
+  Counters counters_;
+};
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const Debouncer::Counters& counters) {
+  return os << counters.suppressed << " suppressed, " << counters.corrected
+            << " corrected";
+}
+
+#endif  // __DEBOUNCER_H
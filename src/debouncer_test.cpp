@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "debouncer.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <utility>
+#include <vector>
+
+// Key event at the given time in milliseconds.
+struct input_event KeyAt(int code, int value, int64_t time_ms) {
+  struct input_event ie {};
+  ie.time.tv_sec = time_ms / 1000;
+  ie.time.tv_usec = (time_ms % 1000) * 1000;
+  ie.type = EV_KEY;
+  ie.code = code;
+  ie.value = value;
+  return ie;
+}
+
+// Key events passed by Expire().
+struct Expired {
+  std::vector<std::pair<int, int>> keys;
+
+  void operator()(const struct input_event& ie) {
+    keys.push_back({ie.code, ie.value});
+  }
+};
+
+TEST_CASE("Passes the first edge right away", "[debouncer]") {
+  Debouncer debouncer(10);
+  CHECK(debouncer.Accept(KeyAt(KEY_A, 1, 1000)));
+  CHECK(debouncer.Accept(KeyAt(KEY_A, 2, 1002)));
+  CHECK(debouncer.Accept(KeyAt(KEY_A, 0, 1100)));
+  // Other keys have windows of their own.
+  CHECK(debouncer.Accept(KeyAt(KEY_B, 1, 1101)));
+  CHECK_FALSE(debouncer.has_pending());
+  CHECK(debouncer.counters().suppressed == 0);
+}
+
+TEST_CASE("Drops chatter within the window", "[debouncer]") {
+  Debouncer debouncer(10);
+  CHECK(debouncer.Accept(KeyAt(KEY_A, 1, 1000)));
+  CHECK_FALSE(debouncer.Accept(KeyAt(KEY_A, 0, 1003)));
+  CHECK_FALSE(debouncer.Accept(KeyAt(KEY_A, 1, 1005)));
+  CHECK(debouncer.counters().suppressed == 2);
+  CHECK(debouncer.TimeoutMs(1005'000) == 5);
+
+  // Ended up pressed, as what passed. Nothing to send.
+  Expired expired;
+  debouncer.Expire(1010'000, expired);
+  CHECK(expired.keys.empty());
+  CHECK_FALSE(debouncer.has_pending());
+  CHECK(debouncer.TimeoutMs(1010'000) == -1);
+
+  // The release is after the window.
+  CHECK(debouncer.Accept(KeyAt(KEY_A, 0, 1200)));
+  CHECK(debouncer.counters().corrected == 0);
+}
+
+TEST_CASE("Sends the state a short tap ended in", "[debouncer]") {
+  Debouncer debouncer(10);
+  CHECK(debouncer.Accept(KeyAt(KEY_A, 1, 1000)));
+  CHECK_FALSE(debouncer.Accept(KeyAt(KEY_A, 0, 1004)));
+
+  Expired expired;
+  // Not over yet.
+  debouncer.Expire(1009'000, expired);
+  CHECK(expired.keys.empty());
+  CHECK(debouncer.TimeoutMs(1009'000) == 1);
+
+  debouncer.Expire(1010'000, expired);
+  CHECK(expired.keys == std::vector<std::pair<int, int>>{{KEY_A, 0}});
+  CHECK(debouncer.counters().corrected == 1);
+  CHECK_FALSE(debouncer.has_pending());
+
+  // Repeats of a key not pressed are dropped.
+  CHECK_FALSE(debouncer.Accept(KeyAt(KEY_A, 2, 1011)));
+}
+
+TEST_CASE("Expires keys independently", "[debouncer]") {
+  Debouncer debouncer(10);
+  CHECK(debouncer.Accept(KeyAt(KEY_A, 1, 1000)));
+  CHECK_FALSE(debouncer.Accept(KeyAt(KEY_A, 0, 1001)));
+  CHECK(debouncer.Accept(KeyAt(KEY_B, 1, 1005)));
+  CHECK_FALSE(debouncer.Accept(KeyAt(KEY_B, 0, 1006)));
+  CHECK(debouncer.TimeoutMs(1006'000) == 4);
+
+  Expired expired;
+  debouncer.Expire(1012'000, expired);
+  CHECK(expired.keys == std::vector<std::pair<int, int>>{{KEY_A, 0}});
+  CHECK(debouncer.has_pending());
+  CHECK(debouncer.TimeoutMs(1012'000) == 3);
+
+  debouncer.Expire(1015'000, expired);
+  CHECK(expired.keys ==
+        std::vector<std::pair<int, int>>{{KEY_A, 0}, {KEY_B, 0}});
+  CHECK_FALSE(debouncer.has_pending());
+}
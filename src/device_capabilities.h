@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __DEVICE_CAPABILITIES_H
+#define __DEVICE_CAPABILITIES_H
+
+// Event types and codes an evdev device can report.
+// Read from the keyboard with InputDevice::GetCapabilities(), and mirrored on
+// the VirtualDevice so that nothing the keyboard can send is lost.
+
+#include <linux/input.h>
+#include <sys/ioctl.h>
+
+#include <array>
+#include <bitset>
+#include <cstring>
+
+struct DeviceCapabilities {
+  std::bitset<EV_CNT> ev;
+  std::bitset<KEY_CNT> key;
+  std::bitset<REL_CNT> rel;
+  std::bitset<MSC_CNT> msc;
+  std::bitset<ABS_CNT> abs;
+  // Only valid for axes set in abs.
+  std::array<input_absinfo, ABS_CNT> absinfo{};
+
+  // Reads the capabilities of an open evdev device. Returns false on error.
+  bool Read(int fd) {
+    if (!ReadBits(fd, 0, ev)) return false;
+    if (ev.test(EV_KEY) && !ReadBits(fd, EV_KEY, key)) return false;
+    if (ev.test(EV_REL) && !ReadBits(fd, EV_REL, rel)) return false;
+    if (ev.test(EV_MSC) && !ReadBits(fd, EV_MSC, msc)) return false;
+    if (ev.test(EV_ABS)) {
+      if (!ReadBits(fd, EV_ABS, abs)) return false;
+      for (int axis = 0; axis < ABS_CNT; ++axis) {
+        if (abs.test(axis) &&
+            ioctl(fd, EVIOCGABS(axis), &absinfo[axis]) < 0) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  // EVIOCGBIT returns a little endian bit array, one bit per code.
+  template <std::size_t N>
+  static bool ReadBits(int fd, int type, std::bitset<N>& bits) {
+    unsigned char raw[(N + 7) / 8];
+    memset(raw, 0, sizeof(raw));
+    if (ioctl(fd, EVIOCGBIT(type, sizeof(raw)), raw) < 0) return false;
+    bits.reset();
+    for (std::size_t code = 0; code < N; ++code) {
+      if (raw[code / 8] & (1 << (code % 8))) bits.set(code);
+    }
+    return true;
+  }
+};
+
+#endif  // __DEVICE_CAPABILITIES_H
@@ -19,29 +19,37 @@
 
 #include <fcntl.h>
 #include <linux/input.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <chrono>
+#include <bitset>
 #include <cstring>  // Needed for memset()
-#include <thread>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "device_capabilities.h"
+#include "keymap_overrides.h"
+#include "utility/file_watch.h"
 
 const int kOpenRetryDurationMs = 2500;
 
 class InputDevice {
  public:
-  InputDevice(const char* device) {
-    const auto start_time = std::chrono::steady_clock::now();
-    while (true) {
-      fd_ = open(device, O_RDONLY);
-      // Return if succeeded.
-      if (fd_ >= 0) return;
-      // Not succeeded. Retry if within retry-duration.
-      const auto elapsed = std::chrono::steady_clock::now() - start_time;
-      if (elapsed >= std::chrono::milliseconds(kOpenRetryDurationMs)) {
-        throw std::runtime_error("Error opening device");
-      }
-      // std::cerr << "Open failed. Retrying..." << std::endl;
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  // If the device does not exist yet (e.g. just plugged in), waits up to
+  // kOpenRetryDurationMs for udev to create it.
+  InputDevice(const char* device) : path_(device) {
+    fd_ = OpenWhenAvailable(path_, O_RDONLY, kOpenRetryDurationMs);
+    if (fd_ < 0) {
+      throw std::runtime_error("Error opening device");
     }
+    UseMonotonicClock();
   }
 
   // Movable but not copyable.
@@ -50,15 +58,15 @@ class InputDevice {
 
   // Hides the device will from the operating system, so no other applications
   // process the events.
-  void Grab() {
+  //
+  // If wait_for_release is false, grabs right away even if keys are held. The
+  // caller must then take care of releasing them, see GetPressedKeys().
+  void Grab(bool wait_for_release = true) {
     if (grabbed_) return;
 
     // Wait until all keys are released. Otherwise the release event for any
     // already held key will get blocked once this device is grabbed.
-    while (IsAnyKeyPressed()) {
-      std::cerr << "Waiting for all keys to be released..." << std::endl;
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
-    }
+    if (wait_for_release) WaitForAllKeysReleased();
 
     // Grab the device
     if (ioctl(fd_, EVIOCGRAB, 1) < 0) {
@@ -66,10 +74,12 @@ class InputDevice {
       throw std::runtime_error("Error grabbing device");
     }
     grabbed_ = true;
+    DropPendingEvents();
   }
 
   ~InputDevice() {
     if (fd_ >= 0) {
+      keymap_.Restore(DeviceKeymap{fd_});
       if (grabbed_) {
         // Release the device
         ioctl(fd_, EVIOCGRAB, 0);
@@ -80,17 +90,126 @@ class InputDevice {
 
   int get_fd() const { return fd_; }
 
+  // Opens the same path again, e.g. after the keyboard was unplugged and
+  // plugged back. Waits up to timeout_ms for it to appear. The device needs to
+  // be grabbed again.
+  [[nodiscard]] bool Reopen(int timeout_ms) {
+    if (fd_ >= 0) {
+      // The device may still be there, e.g. reopened after read errors. Its
+      // keymap is restored, or the overrides would be applied twice.
+      keymap_.Restore(DeviceKeymap{fd_});
+      // No need to ungrab, a grab does not outlive the file descriptor.
+      close(fd_);
+    }
+    grabbed_ = false;
+    fd_ = OpenWhenAvailable(path_, O_RDONLY, timeout_ms);
+    if (fd_ < 0) return false;
+    UseMonotonicClock();
+    // A newly plugged device starts with its default keymap.
+    if (!keymap_.empty()) keymap_.Apply(DeviceKeymap{fd_});
+    return true;
+  }
+
+  // Key codes which at least one scancode of the device is mapped to.
+  std::set<int> GetKeymapKeyCodes() {
+    std::set<int> result;
+    for (const auto& entry : ReadKeymap(DeviceKeymap{fd_})) {
+      result.insert(entry.keycode);
+    }
+    return result;
+  }
+
+  // Makes the kernel report keys as other keys, by rewriting the device's
+  // scancode to keycode table. The table is restored when this is destroyed,
+  // and the overrides are applied again on Reopen().
+  // Returns false if any key could not be changed.
+  //
+  // Note that the table belongs to the device, if this process is killed
+  // without cleanup, it stays until the keyboard is replugged.
+  bool SetKeymapOverrides(const std::map<int, int>& overrides) {
+    return keymap_.Set(DeviceKeymap{fd_}, overrides);
+  }
+
+  // Everything the device can report. Nullopt on error.
+  std::optional<DeviceCapabilities> GetCapabilities() const {
+    DeviceCapabilities capabilities;
+    if (!capabilities.Read(fd_)) {
+      perror("EVIOCGBIT");
+      return std::nullopt;
+    }
+    return capabilities;
+  }
+
+  // Keys currently held down on the device.
+  std::vector<int> GetPressedKeys() {
+    std::vector<int> result;
+    KeyState key_state;
+    if (!ReadKeyState(key_state)) return result;
+    for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+      if (key_state[key_code / 8] & (1 << (key_code % 8))) {
+        result.push_back(key_code);
+      }
+    }
+    return result;
+  }
+
+  // Same as GetPressedKeys(), but cheap enough to call often. Returns false on
+  // error.
+  // Note that the kernel discards key events queued for us but not read yet,
+  // since the state already reflects them.
+  bool GetKeyState(std::bitset<KEY_CNT>& pressed) {
+    // The kernel's own bitmap, which is in native longs.
+    constexpr int kBitsPerLong = 8 * sizeof(unsigned long);
+    unsigned long words[(KEY_CNT + kBitsPerLong - 1) / kBitsPerLong];
+    if (ioctl(fd_, EVIOCGKEY(sizeof(words)), words) < 0) return false;
+    pressed.reset();
+    for (std::size_t index = 0; index < std::size(words); ++index) {
+      for (unsigned long word = words[index]; word != 0; word &= word - 1) {
+        pressed.set(index * kBitsPerLong + __builtin_ctzl(word));
+      }
+    }
+    return true;
+  }
+
  private:
-  bool IsAnyKeyPressed() {
-    // KEY_CNT / 8 + 1 since one bit will be used per key.
-    unsigned char key_state[KEY_CNT / 8 + 1];
-    memset(key_state, 0, sizeof(key_state));
+  // The scancode to keycode table, for KeymapOverrides.
+  struct DeviceKeymap {
+    int fd;
+
+    bool Get(int index, input_keymap_entry& entry) const {
+      memset(&entry, 0, sizeof(entry));
+      entry.flags = INPUT_KEYMAP_BY_INDEX;
+      entry.index = index;
+      return ioctl(fd, EVIOCGKEYCODE_V2, &entry) == 0;
+    }
+
+    bool Set(input_keymap_entry entry) const {
+      entry.flags = 0;
+      return ioctl(fd, EVIOCSKEYCODE_V2, &entry) == 0;
+    }
+  };
+
+  // Event times are then from the same clock as std::chrono::steady_clock,
+  // instead of the wall clock which may jump.
+  void UseMonotonicClock() {
+    int clock_id = CLOCK_MONOTONIC;
+    if (ioctl(fd_, EVIOCSCLOCKID, &clock_id) < 0) perror("EVIOCSCLOCKID");
+  }
 
+  // KEY_CNT / 8 + 1 since one bit will be used per key.
+  using KeyState = unsigned char[KEY_CNT / 8 + 1];
+
+  // Returns false on error.
+  bool ReadKeyState(KeyState& key_state) {
+    memset(key_state, 0, sizeof(key_state));
     if (ioctl(fd_, EVIOCGKEY(sizeof(key_state)), key_state) < 0) {
       perror("EVIOCGKEY");
-      return -1;
+      return false;
     }
+    return true;
+  }
 
+  static bool IsAnyKeyPressed(const KeyState& key_state) {
     for (std::size_t i = 0; i < sizeof(key_state); ++i) {
       if (key_state[i] != 0) {
         // Some key for this particular bit-field is pressed.
@@ -100,8 +219,62 @@ class InputDevice {
     return false;
   }
 
+  // Events queued before the grab were already seen by other applications,
+  // they must not be replayed.
+  void DropPendingEvents() {
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    struct input_event events[64];
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+      if (read(fd_, events, sizeof(events)) <= 0) return;
+    }
+  }
+
+  // Follows the device's own events (it is not grabbed yet, so reading them
+  // does not take them away from anyone), and returns as soon as the last held
+  // key is released.
+  void WaitForAllKeysReleased() {
+    KeyState key_state;
+    if (!ReadKeyState(key_state) || !IsAnyKeyPressed(key_state)) return;
+    std::cerr << "Waiting for all keys to be released..." << std::endl;
+
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    struct input_event events[64];
+    while (true) {
+      if (poll(&pfd, 1, -1) < 0) {
+        if (errno == EINTR) continue;
+        perror("poll");
+        return;
+      }
+      const ssize_t n = read(fd_, events, sizeof(events));
+      if (n <= 0) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        perror("read");
+        return;
+      }
+      bool resync = false;
+      for (ssize_t i = 0; i < n / (ssize_t)sizeof(input_event); ++i) {
+        const auto& ev = events[i];
+        if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+          resync = true;
+        } else if (ev.type == EV_KEY && ev.code < KEY_CNT) {
+          // Repeats (value 2) leave the key pressed.
+          if (ev.value == 1) {
+            key_state[ev.code / 8] |= (1 << (ev.code % 8));
+          } else if (ev.value == 0) {
+            key_state[ev.code / 8] &= ~(1 << (ev.code % 8));
+          }
+        }
+      }
+      // The kernel dropped events, so our view may be stale.
+      if (resync && !ReadKeyState(key_state)) return;
+      if (!IsAnyKeyPressed(key_state)) return;
+    }
+  }
+
+  std::string path_;
   int fd_ = -1;
   bool grabbed_ = false;
+  KeymapOverrides keymap_;
 };
 
 #endif  // __INPUT_DEVICE_H
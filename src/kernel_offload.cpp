@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kernel_offload.h"
+
+#include <bitset>
+#include <functional>
+#include <map>
+#include <optional>
+#include <variant>
+#include <vector>
+
+#include "remap_operator.h"
+
+// If actions is a single key event of the given type, returns its key code.
+std::optional<int> SingleKeyAction(const std::vector<Action>& actions,
+                                   KeyEventType value) {
+  if (actions.size() != 1 || !std::holds_alternative<KeyEvent>(actions[0])) {
+    return std::nullopt;
+  }
+  const auto& key_event = std::get<KeyEvent>(actions[0]);
+  if (key_event.value != value) return std::nullopt;
+  return key_event.key_code;
+}
+
+// Whether any event of the key is mapped in the state.
+bool IsTrigger(const KeyboardState& state, int key_code) {
+  for (const auto value : {KeyEventType::kKeyPress, KeyEventType::kKeyRelease,
+                           KeyEventType::kKeyRepeat}) {
+    if (state.action_map.contains(KeyEvent{key_code, value})) return true;
+  }
+  return false;
+}
+
+std::map<int, int> FindKernelOffloadableRemaps(
+    const Remapper& remapper, const std::function<bool(int)>& has_scancode) {
+  const auto& states = remapper.states();
+  const auto& default_state = states[0];
+  const auto& config = *remapper.config();
+  // Chords and sequences act on keys as read, which offloading would change.
+  std::bitset<KEY_CNT> keys_as_read;
+  for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+    if (config.chords_by_key[key_code] != 0) keys_as_read.set(key_code);
+  }
+  // Except for the kill combo, sequence 0, see the docs.
+  for (std::size_t index = 1; index < config.sequences.size(); ++index) {
+    for (const int key_code : config.sequences[index].keys) {
+      keys_as_read.set(key_code);
+    }
+  }
+  // So are modifier conditions, and the modifiers they check.
+  keys_as_read |= config.modified_keys;
+  if (config.modified_keys.any()) {
+    for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+      if (ModifierBit(key_code) != 0) keys_as_read.set(key_code);
+    }
+  }
+  std::map<int, int> offloadable;
+  // Keys will pass through the default state once offloaded.
+  if (!default_state.allow_other_keys) return offloadable;
+
+  for (const auto& [trigger, actions] : default_state.action_map) {
+    if (trigger.value != KeyEventType::kKeyPress) continue;
+    const int key_code = trigger.key_code;
+    const auto target = SingleKeyAction(actions, KeyEventType::kKeyPress);
+    if (!target.has_value() || *target == key_code) continue;
+
+    const auto release_it =
+        default_state.action_map.find(KeyReleaseEvent(key_code));
+    if (release_it == default_state.action_map.end() ||
+        SingleKeyAction(release_it->second, KeyEventType::kKeyRelease) !=
+            target) {
+      continue;
+    }
+    if (default_state.action_map.contains(
+            KeyEvent{key_code, KeyEventType::kKeyRepeat})) {
+      continue;
+    }
+
+    bool used_in_layers = false;
+    for (std::size_t index = 1; index < states.size(); ++index) {
+      used_in_layers |= IsTrigger(states[index], key_code);
+    }
+    if (used_in_layers || keys_as_read.test(key_code) ||
+        !has_scancode(key_code)) {
+      continue;
+    }
+
+    offloadable[key_code] = *target;
+  }
+
+  // The targets must not be used anywhere, apart from in the mappings being
+  // offloaded. Dropping one key may make another key's target used again, so
+  // repeat until nothing changes.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto it = offloadable.begin(); it != offloadable.end();) {
+      const int target = it->second;
+      bool target_used = keys_as_read.test(target);
+      for (std::size_t index = 0; index < states.size(); ++index) {
+        // Mappings of offloaded keys in the default state will be removed.
+        if (index == 0 && offloadable.contains(target)) continue;
+        target_used |= IsTrigger(states[index], target);
+      }
+      if (target_used) {
+        it = offloadable.erase(it);
+        changed = true;
+      } else {
+        ++it;
+      }
+    }
+  }
+  return offloadable;
+}
+
+void RemoveOffloadedRemaps(Remapper& remapper,
+                           const std::map<int, int>& offloaded) {
+  for (const auto& [key_code, _] : offloaded) {
+    remapper.RemoveMapping("", KeyPressEvent(key_code));
+    remapper.RemoveMapping("", KeyReleaseEvent(key_code));
+  }
+}
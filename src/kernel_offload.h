@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KERNEL_OFFLOAD_H
+#define __KERNEL_OFFLOAD_H
+
+// Finds remaps simple enough to be done by the kernel, by rewriting the
+// keyboard's scancode to keycode table. Those keys then skip userspace
+// processing entirely.
+//
+// A key K can be offloaded as K -> X if -
+// - In the default layer, ^K = ^X and ~K = ~X exactly, e.g. from `K = X`.
+// - K is not used in any other layer, or in a chord, sequence or modifier
+//   condition.
+// - X, as it will now arrive from the keyboard, is not used anywhere once the
+//   offloaded mappings are removed, and is not in a chord, sequence or
+//   modifier condition.
+// Modifier keys are not offloaded if there are modifier conditions.
+//
+// The remapper then sees X instead of K, and lets it pass through. Since no
+// layer looks at either, the outcome is the same in every layer.
+
+#include <functional>
+#include <map>
+
+#include "remap_operator.h"
+
+// Returns map of key code to the key code the kernel should report instead.
+// has_scancode(K) tells if the keyboard has any scancode for K.
+std::map<int, int> FindKernelOffloadableRemaps(
+    const Remapper& remapper, const std::function<bool(int)>& has_scancode);
+
+// Removes the offloaded mappings, which are now done by the kernel.
+void RemoveOffloadedRemaps(Remapper& remapper,
+                           const std::map<int, int>& offloaded);
+
+#endif  // __KERNEL_OFFLOAD_H
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kernel_offload.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "config_parser.h"
+#include "remap_operator.h"
+#include "test_utils.h"
+
+using Remaps = std::map<int, int>;
+
+const auto kAllScancodes = [](int) { return true; };
+
+SCENARIO("Finds offloadable remaps") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+
+  GIVEN("Swap") {
+    REQUIRE(config_parser.Parse({"1 = 2", "2 = 1"}));
+    CHECK(FindKernelOffloadableRemaps(remapper, kAllScancodes) ==
+          Remaps{{KEY_1, KEY_2}, {KEY_2, KEY_1}});
+  }
+
+  GIVEN("Chain, since the kernel maps physical keys") {
+    REQUIRE(config_parser.Parse({"A = B", "B = C"}));
+    CHECK(FindKernelOffloadableRemaps(remapper, kAllScancodes) ==
+          Remaps{{KEY_A, KEY_B}, {KEY_B, KEY_C}});
+  }
+
+  GIVEN("Not 1:1") {
+    REQUIRE(config_parser.Parse(
+        {"A = B C", "^D = ~S ^D", "E = nothing", "F = F", "G = 50ms H"}));
+    CHECK(FindKernelOffloadableRemaps(remapper, kAllScancodes).empty());
+  }
+
+  GIVEN("Key used in a layer") {
+    REQUIRE(config_parser.Parse({"1 = 2", "CAPSLOCK + 1 = F1"}));
+    CHECK(FindKernelOffloadableRemaps(remapper, kAllScancodes).empty());
+  }
+
+  GIVEN("Target used in a layer") {
+    REQUIRE(config_parser.Parse({"A = B", "CAPSLOCK + B = F2"}));
+    CHECK(FindKernelOffloadableRemaps(remapper, kAllScancodes).empty());
+  }
+
+  GIVEN("Target is a layer key") {
+    REQUIRE(config_parser.Parse({"A = CAPSLOCK", "CAPSLOCK + 1 = F1"}));
+    CHECK(FindKernelOffloadableRemaps(remapper, kAllScancodes).empty());
+  }
+
+  GIVEN("Target stays mapped since it has no scancode") {
+    REQUIRE(config_parser.Parse({"A = B", "B = C"}));
+    CHECK(FindKernelOffloadableRemaps(remapper, [](int key_code) {
+            return key_code != KEY_B;
+          }) == Remaps{});
+  }
+}
+
+SCENARIO("Outcome is unchanged after offloading") {
+  Remapper remapper;
+  ConfigParser config_parser(&remapper);
+  REQUIRE(config_parser.Parse({"1 = 2", "2 = 1", "CAPSLOCK + 3 = F3",
+                               "CAPSLOCK + LEFTSHIFT = LEFTSHIFT"}));
+  const auto offloaded = FindKernelOffloadableRemaps(remapper, kAllScancodes);
+  REQUIRE(offloaded == Remaps{{KEY_1, KEY_2}, {KEY_2, KEY_1}});
+  RemoveOffloadedRemaps(remapper, offloaded);
+
+  // As the kernel would now report them.
+  CHECK(GetOutcomes(remapper, false,
+                    {{offloaded.at(KEY_1), 1},
+                     {offloaded.at(KEY_1), 0},
+                     {KEY_CAPSLOCK, 1},
+                     {offloaded.at(KEY_2), 1},
+                     {offloaded.at(KEY_2), 0},
+                     {KEY_3, 1},
+                     {KEY_3, 0},
+                     {KEY_CAPSLOCK, 0}}) ==
+        vector<string>{"Out: P KEY_2", "Out: R KEY_2", "Out: P KEY_F3",
+                       "Out: R KEY_F3"});
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __KEY_STATE_NORMALIZER_H
+#define __KEY_STATE_NORMALIZER_H
+
+// Sits between the remapper and the VirtualDevice, and keeps track of which
+// keys the virtual device has pressed. Events which would not change that are
+// dropped -
+// - A press of a key which is already pressed, e.g. from `^A = ~D ^A` while A
+//   is held for other reasons.
+// - A release or repeat of a key which is not pressed.
+//
+// Events are batched until Flush(), and sent in a single write. Each is in its
+// own frame, so consumers see the same sequence as before.
+//
+// Within a batch, a modifier which is released and immediately pressed again,
+// e.g. by a macro re-pressing a held Shift, is dropped as a pair. Nothing is
+// pressed in between, so the modifier was effectively held all along. This is
+// not done for other keys, since pressing them again starts a new keystroke.
+
+#include <linux/input.h>
+#include <string.h>
+
+#include <bitset>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <vector>
+
+#include "utility/trace_points.h"
+
+class KeyStateNormalizer {
+ public:
+  struct Counters {
+    // Events which would not have changed the state.
+    long redundant = 0;
+    // Events dropped as a release and press of a modifier.
+    long collapsed = 0;
+  };
+
+  // send_events writes the events to the device, see
+  // VirtualDevice::SendEvents().
+  explicit KeyStateNormalizer(
+      std::function<void(const struct input_event*, std::size_t)> send_events)
+      : send_events_(send_events) {
+    batch_.reserve(kInitialBatchCapacity);
+  }
+
+  void KeyEvent(int key_code, int value) {
+    if (key_code < 0 || key_code >= KEY_CNT) [[unlikely]] {
+      return;
+    }
+    const bool pressed = pressed_.test(key_code);
+    switch (value) {
+      case 1:
+        if (pressed) {
+          Drop(counters_.redundant, key_code, value);
+          return;
+        }
+        if (IsModifier(key_code) && batch_.size() >= 2 &&
+            IsKey(batch_[batch_.size() - 2], key_code, 0)) {
+          // Drop the release, which is followed by its SYN_REPORT.
+          batch_.resize(batch_.size() - 2);
+          pressed_.set(key_code);
+          Drop(counters_.collapsed, key_code, 0);
+          Drop(counters_.collapsed, key_code, value);
+          return;
+        }
+        pressed_.set(key_code);
+        break;
+      case 0:
+        if (!pressed) {
+          Drop(counters_.redundant, key_code, value);
+          return;
+        }
+        pressed_.reset(key_code);
+        break;
+      default:
+        if (!pressed) {
+          Drop(counters_.redundant, key_code, value);
+          return;
+        }
+        break;
+    }
+    Append(EV_KEY, key_code, value);
+    Append(EV_SYN, SYN_REPORT, 0);
+  }
+
+  // Tracks a key event sent to the device by other means, e.g. forwarded as
+  // it is.
+  inline void Sent(int key_code, int value) {
+    if (key_code < 0 || key_code >= KEY_CNT) [[unlikely]] {
+      return;
+    }
+    if (value == 1) {
+      pressed_.set(key_code);
+    } else if (value == 0) {
+      pressed_.reset(key_code);
+    }
+  }
+
+  // Sends all batched events.
+  void Flush() {
+    if (batch_.empty()) return;
+    send_events_(batch_.data(), batch_.size());
+    batch_.clear();
+  }
+
+  const std::bitset<KEY_CNT>& pressed() const { return pressed_; }
+  const Counters& counters() const { return counters_; }
+
+ private:
+  static constexpr std::size_t kInitialBatchCapacity = 64;
+
+  static bool IsModifier(int key_code) {
+    switch (key_code) {
+      case KEY_LEFTCTRL:
+      case KEY_RIGHTCTRL:
+      case KEY_LEFTSHIFT:
+      case KEY_RIGHTSHIFT:
+      case KEY_LEFTALT:
+      case KEY_RIGHTALT:
+      case KEY_LEFTMETA:
+      case KEY_RIGHTMETA:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  static bool IsKey(const struct input_event& ie, int key_code, int value) {
+    return ie.type == EV_KEY && ie.code == key_code && ie.value == value;
+  }
+
+  void Append(int type, int code, int value) {
+    struct input_event& ie = batch_.emplace_back();
+    memset(&ie, 0, sizeof(ie));
+    ie.type = type;
+    ie.code = code;
+    ie.value = value;
+  }
+
+  static void Drop(long& counter, [[maybe_unused]] int key_code,
+                   [[maybe_unused]] int value) {
+    TRACE_POINT(drop_event, key_code, value);
+    ++counter;
+  }
+
+  std::function<void(const struct input_event*, std::size_t)> send_events_;
+  std::vector<struct input_event> batch_;
+  std::bitset<KEY_CNT> pressed_;
+  Counters counters_;
+};
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const KeyStateNormalizer::Counters& counters) {
+  return os << counters.redundant << " redundant, " << counters.collapsed
+            << " collapsed";
+}
+
+#endif  // __KEY_STATE_NORMALIZER_H
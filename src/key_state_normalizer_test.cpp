@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "key_state_normalizer.h"
+
+#include <catch2/catch_test_macros.hpp>
+#include <utility>
+#include <vector>
+
+// Collects key events sent, and the number of writes.
+struct Sink {
+  std::vector<std::pair<int, int>> keys;
+  int writes = 0;
+  int frames = 0;
+
+  KeyStateNormalizer Normalizer() {
+    return KeyStateNormalizer(
+        [this](const struct input_event* events, std::size_t count) {
+          ++writes;
+          for (std::size_t i = 0; i < count; ++i) {
+            if (events[i].type == EV_KEY) {
+              keys.push_back({events[i].code, events[i].value});
+            } else if (events[i].type == EV_SYN) {
+              ++frames;
+            }
+          }
+        });
+  }
+};
+
+TEST_CASE("Passes events which change the state", "[key_state_normalizer]") {
+  Sink sink;
+  auto normalizer = sink.Normalizer();
+  normalizer.KeyEvent(KEY_A, 1);
+  normalizer.KeyEvent(KEY_A, 2);
+  normalizer.KeyEvent(KEY_A, 0);
+  CHECK(sink.writes == 0);
+  normalizer.Flush();
+  CHECK(sink.keys == std::vector<std::pair<int, int>>{
+                         {KEY_A, 1}, {KEY_A, 2}, {KEY_A, 0}});
+  // Each in its own frame, in one write.
+  CHECK(sink.frames == 3);
+  CHECK(sink.writes == 1);
+  CHECK(normalizer.counters().redundant == 0);
+
+  // Nothing more to send.
+  normalizer.Flush();
+  CHECK(sink.writes == 1);
+}
+
+TEST_CASE("Drops redundant events", "[key_state_normalizer]") {
+  Sink sink;
+  auto normalizer = sink.Normalizer();
+  normalizer.KeyEvent(KEY_A, 0);
+  normalizer.KeyEvent(KEY_A, 2);
+  normalizer.KeyEvent(KEY_A, 1);
+  normalizer.KeyEvent(KEY_A, 1);
+  normalizer.Flush();
+  CHECK(sink.keys == std::vector<std::pair<int, int>>{{KEY_A, 1}});
+  CHECK(normalizer.counters().redundant == 3);
+  CHECK(normalizer.pressed().test(KEY_A));
+}
+
+TEST_CASE("Collapses release and press of a modifier",
+          "[key_state_normalizer]") {
+  Sink sink;
+  auto normalizer = sink.Normalizer();
+  normalizer.KeyEvent(KEY_LEFTSHIFT, 1);
+  normalizer.Flush();
+
+  SECTION("Adjacent in a batch") {
+    normalizer.KeyEvent(KEY_LEFTSHIFT, 0);
+    normalizer.KeyEvent(KEY_LEFTSHIFT, 1);
+    normalizer.KeyEvent(KEY_B, 1);
+    normalizer.Flush();
+    CHECK(sink.keys == std::vector<std::pair<int, int>>{{KEY_LEFTSHIFT, 1},
+                                                        {KEY_B, 1}});
+    CHECK(normalizer.counters().collapsed == 2);
+    CHECK(normalizer.pressed().test(KEY_LEFTSHIFT));
+  }
+
+  SECTION("Not across batches") {
+    normalizer.KeyEvent(KEY_LEFTSHIFT, 0);
+    normalizer.Flush();
+    normalizer.KeyEvent(KEY_LEFTSHIFT, 1);
+    normalizer.Flush();
+    CHECK(sink.keys.size() == 3);
+    CHECK(normalizer.counters().collapsed == 0);
+  }
+
+  SECTION("Not with another key in between") {
+    normalizer.KeyEvent(KEY_LEFTSHIFT, 0);
+    normalizer.KeyEvent(KEY_B, 1);
+    normalizer.KeyEvent(KEY_LEFTSHIFT, 1);
+    normalizer.Flush();
+    CHECK(sink.keys.size() == 4);
+    CHECK(normalizer.counters().collapsed == 0);
+  }
+}
+
+TEST_CASE("Does not collapse other keys", "[key_state_normalizer]") {
+  Sink sink;
+  auto normalizer = sink.Normalizer();
+  normalizer.KeyEvent(KEY_A, 1);
+  normalizer.KeyEvent(KEY_A, 0);
+  normalizer.KeyEvent(KEY_A, 1);
+  normalizer.Flush();
+  // Typed twice.
+  CHECK(sink.keys == std::vector<std::pair<int, int>>{
+                         {KEY_A, 1}, {KEY_A, 0}, {KEY_A, 1}});
+  CHECK(normalizer.counters().collapsed == 0);
+}
+
+TEST_CASE("Tracks events sent by other means", "[key_state_normalizer]") {
+  Sink sink;
+  auto normalizer = sink.Normalizer();
+  normalizer.Sent(KEY_A, 1);
+  normalizer.KeyEvent(KEY_A, 1);
+  normalizer.KeyEvent(KEY_A, 0);
+  normalizer.Flush();
+  CHECK(sink.keys == std::vector<std::pair<int, int>>{{KEY_A, 0}});
+  CHECK(normalizer.counters().redundant == 1);
+}
@@ -319,6 +319,11 @@ class KeyCodes {
       {KEY_RFKILL, "KEY_RFKILL"},
 
       {KEY_MICMUTE, "KEY_MICMUTE"},
+
+      // Mouse buttons, for mouse keys.
+      {BTN_LEFT, "BTN_LEFT"},
+      {BTN_RIGHT, "BTN_RIGHT"},
+      {BTN_MIDDLE, "BTN_MIDDLE"},
   };
 
   std::unordered_map<std::string, int> name_to_keycode_;
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KEYMAP_OVERRIDES_H
+#define __KEYMAP_OVERRIDES_H
+
+// Makes the kernel report keys as other keys, by rewriting a device's
+// scancode to keycode table, and restores it. See kernel_offload.h.
+//
+// The table is accessed through a Table, which is the device for InputDevice
+// and a fake in tests, with -
+//   bool Get(int index, input_keymap_entry& entry), by index, false past the
+//     last entry.
+//   bool Set(const input_keymap_entry& entry), by the entry's scancode.
+// Both set errno on failure.
+
+#include <errno.h>
+#include <linux/input.h>
+#include <stdio.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+// Guards against drivers which never fail EVIOCGKEYCODE_V2.
+const int kMaxKeymapEntries = 65536;
+
+// All entries of the table. Empty if the device does not support reading it
+// by index.
+template <typename Table>
+std::vector<input_keymap_entry> ReadKeymap(const Table& table) {
+  std::vector<input_keymap_entry> result;
+  for (int index = 0; index < kMaxKeymapEntries; ++index) {
+    struct input_keymap_entry entry {};
+    if (!table.Get(index, entry)) break;
+    result.push_back(entry);
+  }
+  return result;
+}
+
+class KeymapOverrides {
+ public:
+  bool empty() const { return overrides_.empty(); }
+
+  // Replaces the overrides applied so far, if any. Returns false if any key
+  // could not be changed.
+  template <typename Table>
+  bool Set(const Table& table, const std::map<int, int>& overrides) {
+    Restore(table);
+    overrides_ = overrides;
+    return Apply(table);
+  }
+
+  // Applies the overrides to the table as it is, e.g. of a device opened
+  // again. If they are applied already, restores the table first, since
+  // applying them on top would e.g. turn a swap of two keys back into the
+  // identity.
+  template <typename Table>
+  bool Apply(const Table& table) {
+    Restore(table);
+    bool success = true;
+    std::set<int> changed_keys;
+    for (auto entry : ReadKeymap(table)) {
+      const auto it = overrides_.find(entry.keycode);
+      if (it == overrides_.end()) continue;
+      const auto original = entry;
+      entry.keycode = it->second;
+      if (!table.Set(entry)) {
+        perror("EVIOCSKEYCODE_V2");
+        success = false;
+        continue;
+      }
+      original_.push_back(original);
+      changed_keys.insert(original.keycode);
+    }
+    return success && changed_keys.size() == overrides_.size();
+  }
+
+  // Puts back the entries as they were before Apply(). Must be done before
+  // the device is closed, as the table belongs to the device and outlives
+  // this process. Nothing is left to restore if the device is gone.
+  template <typename Table>
+  void Restore(const Table& table) {
+    for (const auto& entry : original_) {
+      if (!table.Set(entry)) {
+        // Expected if the device is already gone.
+        if (errno != ENODEV) perror("EVIOCSKEYCODE_V2 restore");
+        break;
+      }
+    }
+    original_.clear();
+  }
+
+ private:
+  // Key code to what the kernel should report instead.
+  std::map<int, int> overrides_;
+  // Entries as they were before the overrides.
+  std::vector<input_keymap_entry> original_;
+};
+
+#endif  // __KEYMAP_OVERRIDES_H
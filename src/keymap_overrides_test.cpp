@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "keymap_overrides.h"
+
+#include <errno.h>
+
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+// A device's table, where the scancode is the index.
+struct FakeKeymap {
+  std::vector<int>* key_codes;
+  // Unplugged if false.
+  bool present = true;
+
+  bool Get(int index, input_keymap_entry& entry) const {
+    if (!present || index >= int(key_codes->size())) {
+      errno = present ? EINVAL : ENODEV;
+      return false;
+    }
+    entry = {};
+    entry.index = index;
+    entry.len = sizeof(uint32_t);
+    memcpy(entry.scancode, &index, sizeof(uint32_t));
+    entry.keycode = (*key_codes)[index];
+    return true;
+  }
+
+  bool Set(const input_keymap_entry& entry) const {
+    if (!present) {
+      errno = ENODEV;
+      return false;
+    }
+    uint32_t scancode;
+    memcpy(&scancode, entry.scancode, sizeof(uint32_t));
+    (*key_codes)[scancode] = entry.keycode;
+    return true;
+  }
+};
+
+TEST_CASE("Overrides are applied and restored", "[keymap_overrides]") {
+  const std::vector<int> original = {KEY_1, KEY_2, KEY_A, KEY_B, KEY_C};
+  std::vector<int> key_codes = original;
+  const FakeKeymap table{&key_codes};
+  KeymapOverrides keymap;
+
+  SECTION("Swap") {
+    REQUIRE(keymap.Set(table, {{KEY_1, KEY_2}, {KEY_2, KEY_1}}));
+    CHECK(key_codes == std::vector<int>{KEY_2, KEY_1, KEY_A, KEY_B, KEY_C});
+
+    // As InputDevice::Reopen() does, for a device which is still there.
+    keymap.Restore(table);
+    CHECK(key_codes == original);
+    REQUIRE(keymap.Apply(table));
+    CHECK(key_codes == std::vector<int>{KEY_2, KEY_1, KEY_A, KEY_B, KEY_C});
+
+    keymap.Restore(table);
+    CHECK(key_codes == original);
+  }
+
+  SECTION("Applied again, not on top") {
+    REQUIRE(keymap.Set(table, {{KEY_A, KEY_B}, {KEY_B, KEY_C}}));
+    REQUIRE(keymap.Apply(table));
+    CHECK(key_codes == std::vector<int>{KEY_1, KEY_2, KEY_B, KEY_C, KEY_C});
+    keymap.Restore(table);
+    CHECK(key_codes == original);
+  }
+
+  SECTION("Replaced") {
+    REQUIRE(keymap.Set(table, {{KEY_1, KEY_2}, {KEY_2, KEY_1}}));
+    REQUIRE(keymap.Set(table, {{KEY_A, KEY_C}}));
+    CHECK(key_codes == std::vector<int>{KEY_1, KEY_2, KEY_C, KEY_B, KEY_C});
+  }
+
+  SECTION("Device unplugged and plugged back") {
+    REQUIRE(keymap.Set(table, {{KEY_1, KEY_2}, {KEY_2, KEY_1}}));
+    const FakeKeymap gone{&key_codes, /*present=*/false};
+    keymap.Restore(gone);
+    // A new device, with the default table.
+    key_codes = original;
+    REQUIRE(keymap.Apply(table));
+    CHECK(key_codes == std::vector<int>{KEY_2, KEY_1, KEY_A, KEY_B, KEY_C});
+  }
+
+  SECTION("Keys missing from the table") {
+    CHECK_FALSE(keymap.Set(table, {{KEY_1, KEY_3}, {KEY_D, KEY_E}}));
+    CHECK(key_codes[0] == KEY_3);
+  }
+}
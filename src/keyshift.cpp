@@ -18,33 +18,80 @@
 // impossible.
 // So, to test, run this with `sudo timeout 20s ./<binary>`.
 //
+#include <fcntl.h>
 #include <linux/input.h>
 #include <poll.h>
 #include <stdio.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <bitset>
+#include <charconv>
+#include <chrono>
+#include <climits>
 #include <csignal>
+#include <cstring>
 #include <expected>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <set>
+#include <sstream>
 
+#include "config_analyzer.h"
 #include "config_parser.h"
+#include "control_channel.h"
+#include "cpp_emitter.h"
+#include "debouncer.h"
 #include "input_device.h"
+#include "kernel_offload.h"
+#include "key_state_normalizer.h"
 #include "keycode_lookup.h"
+#include "pipeline.h"
+#include "read_error_breaker.h"
 #include "remap_operator.h"
+#include "stuck_key_reconciler.h"
 #include "utility/argparse.h"
-#include "utility/every_n_ms.h"
+#include "utility/busy_poll.h"
+#include "utility/cpu_dma_latency.h"
+#include "utility/essentials.h"
 #include "utility/os_level_mutex.h"
+#include "utility/timer_fd.h"
+#include "utility/trace_points.h"
 #include "version.h"
 #include "virtual_device.h"
 
+#ifdef KEYSHIFT_COMPILED_CONFIG
+// Header generated by `keyshift --emit-cpp`, see
+// keyshift_add_compiled_executable() in CMakeLists.txt.
+#include KEYSHIFT_COMPILED_CONFIG
+using KeyRemapper = CompiledConfigRemapper;
+#else
+using KeyRemapper = Remapper;
+#endif
+
 // How long to poll for reads before looking for interruptions.
 const int kReadTimeoutMS = 1500;
 
+// Max events read at once. Pointer devices can report at up to 8kHz, so this
+// allows many frames per syscall if the loop falls behind.
+const int kReadBatchSize = 64;
+
+// Returned by MainLoop() if the device was disconnected, or if it needs to be
+// reopened.
+const int kMainLoopDeviceLost = 3;
+
 // Set to true on interrupts.
 std::atomic<bool> kExitMainloopNow(false);
+// Set to true on SIGUSR1, to switch to the next profile.
+std::atomic<bool> kNextProfileNow(false);
+// Set to true on any signal handled, so that a busy polling read returns.
+std::atomic<bool> kWakeMainloop(false);
+
+// Name of the profile from --config or --config-file, if there are profiles.
+const std::string kDefaultProfileName = "default";
 
 // Disable echoing input when run in terminal.
 void DisableEcho() {
@@ -68,11 +115,67 @@ std::optional<ArgumentParser> ParseArgs(const int argc, const char** argv) {
   parser.AddString("config",
                    "Config as a semi-colon delimited strings, e.g. 'A=B;B=A'.");
   parser.AddString("config-file", "File with remapping configuration.");
+  parser.AddString("profiles",
+                   "More configs to switch to while running, as "
+                   "NAME:FILE,NAME:FILE. The config is the profile 'default'. "
+                   "Switched with profile:NAME in a config, or to the next "
+                   "one on SIGUSR1.");
   parser.AddBool(
       "dump", "Show internal representation of the parsed config, and exit.");
   parser.AddBool(
       "dry-run",
       "If passed, will not start a service but will only show previews.");
+  parser.AddBool("instant-grab",
+                 "Grab the keyboard right away, even if keys are held. Held "
+                 "keys are carried over to the virtual keyboard.");
+  parser.AddBool("kernel-offload",
+                 "Let the kernel do simple 1:1 remaps like A=B, by changing "
+                 "the keyboard's keymap. Restored on exit.");
+  parser.AddBool("busy-poll",
+                 "Spin on reads instead of sleeping, for lower latency at the "
+                 "cost of one busy core.");
+  parser.AddBool("pm-qos",
+                 "Keep the CPUs out of deep sleep states while running, via "
+                 "/dev/cpu_dma_latency. Best used with --busy-poll.");
+  parser.AddString("chord-ms",
+                   "Keys of a chord must all be pressed within this many "
+                   "milliseconds. Default 50.");
+  parser.AddString("text-pace-ms",
+                   "Type texts like \"Hello\" one character every this many "
+                   "milliseconds, for programs which miss fast input. By "
+                   "default they are typed in bursts.");
+  parser.AddString("mouse-hz",
+                   "Move the pointer this many times per second with mouse "
+                   "keys like MOUSE_LEFT, up to 1000. Default 250.");
+  parser.AddString("mouse-speed",
+                   "Top speed of mouse keys, in pixels per second. Default "
+                   "1200.");
+  parser.AddString("mouse-accel-ms",
+                   "Mouse keys reach their top speed after being held this "
+                   "many milliseconds. Default 1000.");
+  parser.AddString("debounce-ms",
+                   "Drop key chatter, i.e. a key changing again within this "
+                   "many milliseconds. The first change passes right away.");
+  parser.AddBool("reconcile-keys",
+                 "Release keys left stuck by lost events, by comparing with "
+                 "the keyboard when idle and after a layer is released.");
+  parser.AddString("control-socket",
+                   "Serve a Unix socket at this path, or at @NAME in the "
+                   "abstract namespace, to query and control keyshift while "
+                   "it runs. See docs/control_socket.md.");
+  parser.AddString("control",
+                   "Send a command to the keyshift at --control-socket and "
+                   "exit. One of state, stats, reload, trace-on, trace-off, "
+                   "or profile:NAME.");
+  parser.AddBool("analyze",
+                 "Show worst case latency and events per input, and unused "
+                 "parts of the config, and exit.");
+  parser.AddString("latency-budget-ms",
+                   "With --analyze, fail if the config may wait longer than "
+                   "this on any input.");
+  parser.AddBool("emit-cpp",
+                 "Print the parsed config as C++ to build a keyshift with the "
+                 "config compiled in, and exit.");
   parser.AddBool("version", "Display commit id and exit.");
 
   {
@@ -96,9 +199,11 @@ std::optional<ArgumentParser> ParseArgs(const int argc, const char** argv) {
   return parser;
 }
 
+// profile_names are those which the config may switch to.
 ErrorStrOr<Remapper> GetRemapper(
     const std::optional<std::string>& config,
-    const std::optional<std::string>& config_file) {
+    const std::optional<std::string>& config_file,
+    const std::vector<std::string>& profile_names) {
   std::vector<std::string> lines;
   if (config_file.has_value()) {
     std::ifstream file(config_file.value());
@@ -117,23 +222,302 @@ ErrorStrOr<Remapper> GetRemapper(
 
   Remapper remapper;
   ConfigParser config_parser(&remapper);
+  config_parser.SetProfileNames(profile_names);
   if (!config_parser.Parse(lines)) {
     return std::unexpected("Failed to parse file");
   }
+  remapper.UpdatePassthroughKeys();
   return remapper;
 }
 
+// Parses the number, e.g. of milliseconds, passed to --name, if any.
+ErrorStrOr<std::optional<int>> ParseIntArg(
+    const std::optional<std::string>& arg, const std::string& name,
+    int min_value, int max_value = INT_MAX) {
+  if (!arg.has_value()) return std::nullopt;
+  int value = 0;
+  const auto& str = arg.value();
+  const auto [end, error] =
+      std::from_chars(str.data(), str.data() + str.size(), value);
+  if (error != std::errc() || end != str.data() + str.size() ||
+      value < min_value || value > max_value) {
+    return std::unexpected("Invalid --" + name + " " + str);
+  }
+  return value;
+}
+
+// Parses --profiles, NAME:FILE,NAME:FILE, into names and files.
+ErrorStrOr<std::vector<std::pair<std::string, std::string>>> ParseProfilesArg(
+    const std::optional<std::string>& arg) {
+  std::vector<std::pair<std::string, std::string>> profiles;
+  if (!arg.has_value()) return profiles;
+  std::set<std::string> names = {kDefaultProfileName};
+  for (const auto& profile : StringSplit(arg.value(), ',')) {
+    const auto colon = profile.find(':');
+    if (colon == std::string::npos || colon == 0 ||
+        colon + 1 == profile.size()) {
+      return std::unexpected("Invalid --profiles " + arg.value() +
+                             ", expected NAME:FILE,NAME:FILE");
+    }
+    const std::string name = profile.substr(0, colon);
+    if (!names.insert(name).second) {
+      return std::unexpected("Profile '" + name + "' is given more than once");
+    }
+    profiles.push_back({name, profile.substr(colon + 1)});
+  }
+  return profiles;
+}
+
+// Prints the analysis of the config. Returns the exit code, which is a failure
+// if the latency budget is exceeded.
+int AnalyzeAndCheckBudget(const Remapper& remapper,
+                          std::optional<int> budget_ms) {
+  const auto analysis = AnalyzeConfig(remapper);
+  std::cout << analysis;
+  // A key held back for a chord may then also wait.
+  const int worst_ms = analysis.chord_hold_ms + analysis.wait_ms.value;
+  if (budget_ms.has_value() && worst_ms > budget_ms.value()) {
+    std::cerr << "ERROR: Worst case wait of " << worst_ms
+              << "ms exceeds the latency budget of " << budget_ms.value()
+              << "ms." << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
 void SignalHandler(const int signum) {
   std::cerr << "Interruption signal (" << signum << ") received, terminating."
             << std::endl;
   kExitMainloopNow.store(true);
+  kWakeMainloop.store(true);
 }
 
-int MainLoop(InputDevice& device, Remapper& remapper, bool echo_inputs) {
+void NextProfileSignalHandler(const int) {
+  kNextProfileNow.store(true);
+  kWakeMainloop.store(true);
+}
+
+// SIGIO from the control socket, with --busy-poll.
+void WakeSignalHandler(const int) { kWakeMainloop.store(true); }
+
+// Sends a --control command to a running keyshift, and shows the reply.
+int RunControlCommand(const std::optional<std::string>& socket,
+                      const std::string& command) {
+  if (!socket.has_value()) {
+    std::cerr << "ERROR: --control needs --control-socket." << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string kProfilePrefix = "profile:";
+  ControlCommand code;
+  std::vector<uint8_t> payload;
+  if (command == "state") {
+    code = ControlCommand::kQueryState;
+  } else if (command == "stats") {
+    code = ControlCommand::kStats;
+  } else if (command == "reload") {
+    code = ControlCommand::kReload;
+  } else if (command == "trace-on" || command == "trace-off") {
+    code = ControlCommand::kSetTracing;
+    payload.push_back(command == "trace-on");
+  } else if (command.starts_with(kProfilePrefix)) {
+    code = ControlCommand::kSwitchProfile;
+    payload.assign(command.begin() + kProfilePrefix.size(), command.end());
+  } else {
+    std::cerr << "ERROR: Unknown --control command " << command << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const auto reply = SendControlRequest(socket.value(), code, payload);
+  if (!reply) {
+    std::cerr << "ERROR: " << reply.error() << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string text(reply->payload.begin(), reply->payload.end());
+  if (reply->status != ControlStatus::kOk) {
+    std::cerr << "ERROR: "
+              << (reply->status == ControlStatus::kUnknownCommand
+                      ? "Command not supported by this keyshift."
+                      : text)
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (code != ControlCommand::kQueryState) {
+    std::cout << text;
+    return EXIT_SUCCESS;
+  }
+  const auto state = DecodeControlState(reply->payload);
+  if (!state) {
+    std::cerr << "ERROR: " << state.error() << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!state->profile_name.empty()) {
+    std::cout << "Profile: " << state->profile_name << std::endl;
+  }
+  const auto show_keys = [](const char* title, const std::vector<int>& keys) {
+    std::cout << title << ":";
+    for (const int key_code : keys) std::cout << " " << KeyCodeToName(key_code);
+    std::cout << std::endl;
+  };
+  show_keys("Layers", state->layer_keys);
+  show_keys("Held", state->held_keys);
+  return EXIT_SUCCESS;
+}
+
+// Events which are not remapped are collected here, as whole frames, i.e. up
+// to and including the SYN_REPORT. Frames are batched, and sent with a single
+// write on Flush().
+class FrameForwarder {
+ public:
+  struct Counters {
+    // Frames longer than kMaxFrameSize, sent in parts.
+    long split = 0;
+    // SYN_DROPPED from the kernel.
+    long dropped = 0;
+  };
+
+  FrameForwarder(const VirtualDevice* out_device) : out_device_(out_device) {}
+
+  inline void Add(const struct input_event& ie) {
+    if (dropping_) [[unlikely]] {
+      return;
+    }
+    if (frame_size_ == kMaxFrameSize) [[unlikely]] {
+      // E.g. multitouch with many contacts. The parts are applied in order,
+      // and the current ABS_MT_SLOT carries over to the next part.
+      ++counters_.split;
+      CloseFrame();
+    }
+    frame_[frame_size_++] = ie;
+  }
+
+  // After a SYN_DROPPED, all events up to and including the next SYN_REPORT
+  // must be ignored, including keys.
+  bool dropping() const { return dropping_; }
+
+  // Returns true at the SYN_REPORT which ends the events dropped by the
+  // kernel. The key state must then be read again, see
+  // InputDevice::GetKeyState().
+  inline bool OnSyn(const struct input_event& ie) {
+    if (ie.code == SYN_DROPPED) [[unlikely]] {
+      // The rest of the frame is lost. Keys in it were already processed by
+      // the remapper, and go out, the rest is incomplete and is discarded.
+      int keys = 0;
+      for (int i = 0; i < frame_size_; ++i) {
+        if (frame_[i].type == EV_KEY) frame_[keys++] = frame_[i];
+      }
+      frame_size_ = keys;
+      CloseFrame();
+      dropping_ = true;
+      ++counters_.dropped;
+      return false;
+    }
+    if (ie.code != SYN_REPORT) return false;
+    if (dropping_) [[unlikely]] {
+      dropping_ = false;
+      return true;
+    }
+    if (frame_size_ == 0) return false;
+    frame_[frame_size_++] = ie;
+    EndFrame();
+    return false;
+  }
+
+  // Ends the current frame early, so that events remapped next are sent after
+  // it.
+  inline void CloseFrame() {
+    if (frame_size_ == 0) return;
+    struct input_event& syn = frame_[frame_size_++];
+    memset(&syn, 0, sizeof(syn));
+    syn.type = EV_SYN;
+    syn.code = SYN_REPORT;
+    EndFrame();
+  }
+
+  // Sends all complete frames.
+  inline void Flush() {
+    if (batch_size_ == 0) return;
+    if (out_device_ != nullptr) out_device_->SendEvents(batch_, batch_size_);
+    batch_size_ = 0;
+  }
+
+  const Counters& counters() const { return counters_; }
+
+ private:
+  inline void EndFrame() {
+    if (batch_size_ + frame_size_ > kMaxBatchSize) Flush();
+    memcpy(batch_ + batch_size_, frame_, frame_size_ * sizeof(frame_[0]));
+    batch_size_ += frame_size_;
+    frame_size_ = 0;
+  }
+
+  // A frame has seldom more than a few events. Longer ones are split.
+  static constexpr int kMaxFrameSize = 64;
+  static constexpr int kMaxBatchSize = kReadBatchSize + kMaxFrameSize + 1;
+  const VirtualDevice* out_device_;
+  struct input_event frame_[kMaxFrameSize + 1];
+  int frame_size_ = 0;
+  bool dropping_ = false;
+  struct input_event batch_[kMaxBatchSize];
+  int batch_size_ = 0;
+  Counters counters_;
+};
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const FrameForwarder::Counters& counters) {
+  return os << counters.split << " split, " << counters.dropped
+            << " dropped by the kernel";
+}
+
+// Adds relative events for the motion to the current frame.
+void AddPointerMotion(const PointerMotion& motion, FrameForwarder& forwarder) {
+  struct input_event ie;
+  memset(&ie, 0, sizeof(ie));
+  ie.type = EV_REL;
+  const auto add = [&](int code, int value) {
+    if (value == 0) return;
+    ie.code = code;
+    ie.value = value;
+    forwarder.Add(ie);
+  };
+  add(REL_X, motion.x);
+  add(REL_Y, motion.y);
+  add(REL_WHEEL, motion.wheel);
+  add(REL_WHEEL_HI_RES, motion.wheel_hi_res);
+  add(REL_HWHEEL, motion.hwheel);
+  add(REL_HWHEEL_HI_RES, motion.hwheel_hi_res);
+}
+
+// Optional parts of the main loop.
+struct MainLoopOptions {
+  // Shows the key events read, for --dry-run.
+  bool echo_inputs = false;
+  bool busy_poll = false;
+  // Null if not enabled.
+  StuckKeyReconciler* reconciler = nullptr;
+  Debouncer* debouncer = nullptr;
+  ControlServer* control = nullptr;
+  // For requests on the control socket. Reads the config files again.
+  std::function<ErrorStrOr<void>()> reload;
+  // Shows the counters, all of them or only those which counted anything.
+  std::function<void(std::ostream& os, bool all)> print_stats;
+};
+
+template <typename PipelineType>
+int MainLoop(InputDevice& device, KeyRemapper& remapper,
+             PipelineType& pipeline, ReadErrorBreaker& read_errors,
+             FrameForwarder& forwarder, KeyStateNormalizer& key_output,
+             const MainLoopOptions& options) {
   // Set up handlers which will set kInterrupded on any error.
   std::signal(SIGINT, SignalHandler);
   std::signal(SIGTERM, SignalHandler);
   std::signal(SIGHUP, SignalHandler);
+  std::signal(SIGUSR1, NextProfileSignalHandler);
+  // Busy polling does not poll the control socket, it signals instead.
+  ControlServer* const control = options.control;
+  if (control != nullptr && options.busy_poll) {
+    std::signal(SIGIO, WakeSignalHandler);
+    control->SignalOnInput(SIGIO);
+  }
 
   // Most of the mess below is to set up timeouts. Had we not needed that, we'd
   // just change the if to while and put the kExitMainloopNow detection within
@@ -141,76 +525,582 @@ int MainLoop(InputDevice& device, Remapper& remapper, bool echo_inputs) {
   // until a key is pressed - we don't want that.
   const int fd = device.get_fd();
 
-  struct pollfd fds[1];
+  // Wakes up at the deadlines of the remapper's timers, e.g. for autofire.
+  TimerFd timer;
+
+  struct pollfd fds[3];
   fds[0].fd = fd;
   fds[0].events = POLLIN;
+  fds[1].fd = timer.fd();
+  fds[1].events = POLLIN;
+  // Ignored by poll() if negative.
+  fds[2].fd = control != nullptr ? control->fd() : -1;
+  fds[2].events = POLLIN;
 
-  struct input_event ie;
+  // With --busy-poll, reads never block and are retried until data arrives.
+  BusyPoller busy_poller;
+  if (options.busy_poll) {
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      perror("ERROR making device non-blocking");
+      return 1;
+    }
+  }
+
+  // With --reconcile-keys, compares with the keys held on the keyboard.
+  std::bitset<KEY_CNT> keyboard_pressed;
+  const auto reconcile = [&]() {
+    if (options.reconciler != nullptr &&
+        device.GetKeyState(keyboard_pressed)) {
+      options.reconciler->Run(keyboard_pressed, remapper, pipeline,
+                              key_output);
+    }
+  };
+
+  // After events were dropped by the kernel, the keys pressed and released
+  // meanwhile are made up for from the key state. Events read along with the
+  // SYN_REPORT which ends the drop are processed first, as the key state
+  // already includes them.
+  bool resync = false;
+  const auto resync_keys = [&]() {
+    resync = false;
+    if (!device.GetKeyState(keyboard_pressed)) return;
+    if (options.reconciler != nullptr) {
+      options.reconciler->Run(keyboard_pressed, remapper, pipeline,
+                              key_output);
+      return;
+    }
+    remapper.Reconcile(keyboard_pressed);
+    pipeline.Flush();
+  };
+
+  // Shows the key events read, with --dry-run or if turned on from the
+  // control socket.
+  bool tracing = options.echo_inputs;
+  bool layer_deactivated = false;
+  const auto process_key = [&](const struct input_event& ie) {
+    if (tracing) [[unlikely]] {
+      std::cout << "In: ";
+      std::cout << (ie.value == 1   ? "P "
+                    : ie.value == 0 ? "R "
+                                    : "T ")
+                << KeyCodeToName(ie.code);
+      std::cout << std::endl;
+    }
+
+    // Keys not used in the config go out with their frame, as they are.
+    if (!options.echo_inputs && remapper.ProcessFast(ie.code, ie.value))
+        [[likely]] {
+      forwarder.Add(ie);
+      key_output.Sent(ie.code, ie.value);
+      return;
+    }
+
+    // Anything forwarded so far must go out first.
+    forwarder.CloseFrame();
+    forwarder.Flush();
+    const int num_layers = remapper.num_active_layers();
+    pipeline.Process(ToTimedKeyEvent(ie));
+    layer_deactivated |= remapper.num_active_layers() < num_layers;
+  };
+
+  // With --debounce-ms, sends key states held back once their window is over.
+  Debouncer* const debouncer = options.debouncer;
+  const auto expire_debounced = [&]() {
+    if (debouncer == nullptr || !debouncer->has_pending()) [[likely]] {
+      return;
+    }
+    debouncer->Expire(SteadyClockNowUs(), process_key);
+    forwarder.CloseFrame();
+    forwarder.Flush();
+  };
+
+  // Chord keys held back past the chord window are processed on their own,
+  // texts are typed a burst at a time, and mouse keys move the pointer.
+  const auto run_timers = [&]() {
+    if (!remapper.has_timers()) [[likely]] {
+      return;
+    }
+    remapper.RunTimers(SteadyClockNowUs());
+    pipeline.Flush();
+    // The steps run are sent as one frame.
+    const PointerMotion motion = remapper.TakePointerMotion();
+    if (!motion.empty()) {
+      AddPointerMotion(motion, forwarder);
+      forwarder.CloseFrame();
+      forwarder.Flush();
+    }
+  };
+
+  // Requests on the control socket are answered between events, like
+  // profile switches.
+  const ControlServer::Handler handle_control =
+      [&](ControlCommand command, std::span<const uint8_t> payload,
+          std::vector<uint8_t>& reply) {
+        const auto error = [&reply](const std::string& message) {
+          reply.insert(reply.end(), message.begin(), message.end());
+          return ControlStatus::kError;
+        };
+        switch (command) {
+          case ControlCommand::kQueryState:
+            EncodeControlState(
+                ControlState{remapper.profile(), remapper.profile_name(),
+                             remapper.ActiveLayerKeys(),
+                             KeyCodesIn(remapper.HeldKeys())},
+                reply);
+            return ControlStatus::kOk;
+          case ControlCommand::kSwitchProfile: {
+            const int index = remapper.ProfileIndex(
+                std::string(payload.begin(), payload.end()));
+            if (index < 0) return error("No such profile.");
+            remapper.SwitchProfile(index);
+            return ControlStatus::kOk;
+          }
+          case ControlCommand::kReload: {
+            if (!options.reload) return error("Reload is not supported.");
+            const auto reloaded = options.reload();
+            if (!reloaded) return error(reloaded.error());
+            std::cout << "Config reloaded." << std::endl;
+            return ControlStatus::kOk;
+          }
+          case ControlCommand::kStats: {
+            std::ostringstream stats;
+            if (options.print_stats) options.print_stats(stats, /*all=*/true);
+            const std::string text = stats.str();
+            reply.insert(reply.end(), text.begin(), text.end());
+            return ControlStatus::kOk;
+          }
+          case ControlCommand::kSetTracing:
+            if (payload.size() != 1) return error("Expected 1 byte.");
+            tracing = options.echo_inputs || payload[0] != 0;
+            return ControlStatus::kOk;
+        }
+        return ControlStatus::kUnknownCommand;
+      };
+  const auto serve_control = [&]() {
+    control->Serve(handle_control);
+    // Keys released by a profile switch or a reload.
+    pipeline.Flush();
+  };
+
+  // Nothing read for kReadTimeoutMS, a good time to look for stuck keys.
+  const auto on_idle = [&]() {
+    layer_deactivated = false;
+    expire_debounced();
+    run_timers();
+    if (control != nullptr && control->has_pending()) serve_control();
+    reconcile();
+  };
+
+  struct input_event events[kReadBatchSize];
+
+  int profile = remapper.profile();
 
   while (true) {
     // Gracefully exit on interruption.
     if (kExitMainloopNow.load()) [[unlikely]]
       return 2;
 
-    const int poll_ret = poll(fds, 1, kReadTimeoutMS);
-    switch (poll_ret) {
-      [[unlikely]] case -1:
-        // This can also occur when the interrupt happens amidst system call.
-        // perror(x) will show "x: Interrupted system call".
+    // Between events, so this is a quiescent point for switching profiles.
+    if (kWakeMainloop.load(std::memory_order_relaxed)) [[unlikely]] {
+      kWakeMainloop.store(false);
+      if (kNextProfileNow.exchange(false) && remapper.num_profiles() > 1) {
+        remapper.SwitchProfile((remapper.profile() + 1) %
+                               remapper.num_profiles());
+        pipeline.Flush();
+      }
+      if (control != nullptr && options.busy_poll) serve_control();
+    }
+    // Also switched by profile:NAME in the config.
+    if (remapper.profile() != profile) [[unlikely]] {
+      profile = remapper.profile();
+      std::cout << "Profile: " << remapper.profile_name() << std::endl;
+    }
+
+    // Wake up in time for the debouncer, which only happens after chatter,
+    // and for the remapper's timers.
+    int timeout_ms = kReadTimeoutMS;
+    if (debouncer != nullptr && debouncer->has_pending()) [[unlikely]] {
+      timeout_ms =
+          std::min(timeout_ms, debouncer->TimeoutMs(SteadyClockNowUs()));
+    }
+    const bool has_timers = remapper.has_timers();
+    if (has_timers) [[unlikely]] {
+      const int64_t deadline_us = remapper.NextTimerUs();
+      if (!timer.ArmAt(deadline_us)) {
+        // Rounded up, so that the deadline is past by then.
+        const int64_t wait_us = deadline_us - SteadyClockNowUs();
+        timeout_ms = std::min<int64_t>(
+            timeout_ms, wait_us > 0 ? (wait_us + 999) / 1000 : 0);
+      }
+    } else {
+      timer.Disarm();
+    }
+    // Requests left over from the last round, which had done enough.
+    if (control != nullptr && control->has_pending()) [[unlikely]] {
+      timeout_ms = 0;
+    }
+
+    ssize_t bytes_read;
+    if (options.busy_poll && !has_timers && timeout_ms == kReadTimeoutMS) {
+      bytes_read = busy_poller.Read(fd, events, sizeof(events), kWakeMainloop,
+                                    kReadTimeoutMS);
+      if (bytes_read < 0) [[unlikely]] {
+        // Woken up by a signal, which is handled at the top of the loop.
+        if (errno == EINTR) continue;
+        if (errno == ETIMEDOUT) {
+          on_idle();
+          continue;
+        }
+      }
+    } else {
+      const int poll_ret = poll(fds, 3, timeout_ms);
+      if (poll_ret == -1) [[unlikely]] {
+        // Interrupted by a signal, which is handled at the top of the loop.
+        if (errno == EINTR) continue;
         perror("ERROR reading device");
         return 1;
-      case 0:
-        // Timeout.
-        break;
-      default:
-        // There is data to be read, and the read is no longer blocking.
-        if (read(fd, &ie, sizeof(struct input_event)) > 0) [[likely]] {
-          if (ie.type != EV_KEY) continue;
-
-          if (echo_inputs) [[unlikely]] {
-            std::cout << "In: ";
-            std::cout << (ie.value == 1   ? "P "
-                          : ie.value == 0 ? "R "
-                                          : "T ")
-                      << KeyCodeToName(ie.code);
-            std::cout << std::endl;
-          }
-
-          // This will call the function set with SetCallback() as new key
-          // events are generated.
-          remapper.Process(ie.code, ie.value);
-        } else [[unlikely]] {
-          if (errno == ENODEV) {
-            // This can happen if the keyboard USB was disconnected.
-            perror("Exiting as device no longer exits");
-            kExitMainloopNow.store(true);
-          } else {
-            // Happens at an alarming rate sometimes!
-            // Counted 1102381 lines in log in a few minites.
-            // EVEY_N_MS ensures we do not spam the journal.
-            EVERY_N_MS_W_SUPPRESSED(500, perror("Failed read"));
-          }
+      }
+      if (poll_ret == 0) {
+        on_idle();
+        continue;
+      }
+      if (fds[1].revents != 0) [[unlikely]] {
+        timer.Consume();
+        run_timers();
+      }
+      if (fds[2].revents != 0 ||
+          (control != nullptr && control->has_pending())) [[unlikely]] {
+        serve_control();
+      }
+      if (fds[0].revents == 0) continue;
+      // There is data to be read, and the read is no longer blocking.
+      bytes_read = read(fd, events, sizeof(events));
+    }
+    if (bytes_read > 0 &&
+        bytes_read % sizeof(struct input_event) == 0) [[likely]] {
+      read_errors.OnSuccess();
+      layer_deactivated = false;
+      expire_debounced();
+      run_timers();
+      const int num_events = bytes_read / sizeof(struct input_event);
+      for (int i = 0; i < num_events; ++i) {
+        const auto& ie = events[i];
+        TRACE_POINT(read_event, ie.type, ie.code, ie.value);
+        switch (ie.type) {
+          [[likely]] case EV_KEY:
+            if (forwarder.dropping()) [[unlikely]] {
+              continue;
+            }
+            if (debouncer != nullptr && !debouncer->Accept(ie)) [[unlikely]] {
+              continue;
+            }
+            process_key(ie);
+            continue;
+          case EV_SYN:
+            resync |= forwarder.OnSyn(ie);
+            continue;
+          case EV_MSC:
+            // The scan code belongs to the key event that follows, which may
+            // be remapped.
+            if (ie.code == MSC_SCAN) continue;
+            forwarder.Add(ie);
+            continue;
+          default:
+            forwarder.Add(ie);
+            continue;
         }
+      }
+      forwarder.Flush();
+      if (resync) [[unlikely]] {
+        resync_keys();
+      } else if (layer_deactivated) {
+        reconcile();
+      }
+    } else [[unlikely]] {
+      // Used to happen at an alarming rate sometimes! Counted 1102381 failed
+      // reads in the log in a few minutes. Back off instead of spinning.
+      switch (read_errors.OnError(bytes_read < 0 ? errno : 0)) {
+        case ReadErrorBreaker::Decision::kRetry:
+          break;
+        case ReadErrorBreaker::Decision::kBackoff:
+          poll(nullptr, 0, read_errors.backoff_ms());
+          break;
+        case ReadErrorBreaker::Decision::kReopen:
+          return kMainLoopDeviceLost;
+        case ReadErrorBreaker::Decision::kDeviceLost:
+          // This can happen if the keyboard USB was disconnected.
+          perror("Device no longer exists");
+          return kMainLoopDeviceLost;
+      }
     }
   }
 }
 
+std::optional<OSMutex> AcquireKbdMutex(const std::string& kbd) {
+  auto mutex = AcquireOSMutex("keyshift_" + kbd);
+  if (!mutex) {
+    std::cerr << "Keyshift: Another instance is starting for same kbd, exiting."
+              << std::endl;
+  }
+  return mutex;
+}
+
+// Moves remaps which the kernel can do to the device's keymap.
+void OffloadToKernel(InputDevice& device, Remapper& remapper) {
+  const auto keymap_key_codes = device.GetKeymapKeyCodes();
+  const auto offloadable = FindKernelOffloadableRemaps(
+      remapper,
+      [&keymap_key_codes](int key_code) {
+        return keymap_key_codes.contains(key_code);
+      });
+  if (offloadable.empty()) return;
+  if (!device.SetKeymapOverrides(offloadable)) {
+    std::cerr << "WARNING: Could not change the keymap, remaps will not be "
+                 "offloaded to the kernel."
+              << std::endl;
+    if (!device.SetKeymapOverrides({})) {
+      std::cerr << "WARNING: Could not restore the keymap." << std::endl;
+    }
+    return;
+  }
+  RemoveOffloadedRemaps(remapper, offloadable);
+  remapper.UpdatePassthroughKeys();
+  printf("Offloaded %zu remap(s) to the kernel.\n", offloadable.size());
+}
+
+template <typename PipelineType>
+void GrabDevice(InputDevice& device, KeyRemapper& remapper,
+                PipelineType& pipeline, bool instant_grab) {
+  if (instant_grab) {
+    // Read the held keys after grabbing, so that the release of each of them
+    // is guaranteed to come to us.
+    device.Grab(/*wait_for_release=*/false);
+    remapper.AdoptHeldKeys(device.GetPressedKeys());
+    pipeline.Flush();
+  } else {
+    device.Grab();
+  }
+}
+
+// Waits for a disconnected device to come back, and grabs it again. The
+// remapper and the virtual device are kept, so this takes only as long as the
+// device takes to reappear.
+// Returns false if interrupted, or if another instance has taken over.
+template <typename PipelineType>
+bool ReattachDevice(InputDevice& device, KeyRemapper& remapper,
+                    PipelineType& pipeline, const std::string& kbd, bool grab,
+                    bool instant_grab) {
+  // Keys held on the lost device will never be released otherwise.
+  remapper.ReleaseAll();
+  pipeline.Flush();
+
+  // Hold the mutex while waiting, so that any instance started when the device
+  // is plugged back (e.g. by a udev rule) exits.
+  std::optional<OSMutex> mutex;
+  if (grab) {
+    mutex = AcquireKbdMutex(kbd);
+    if (!mutex) return false;
+  }
+
+  std::cerr << "Waiting for the device..." << std::endl;
+  while (!device.Reopen(kReadTimeoutMS)) {
+    if (kExitMainloopNow.load()) return false;
+  }
+  const auto reopen_time = std::chrono::steady_clock::now();
+  if (grab) GrabDevice(device, remapper, pipeline, instant_grab);
+  const auto time_to_grab_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - reopen_time)
+          .count();
+  printf("Device reopened (time to grab: %ldms).\n", time_to_grab_ms);
+  return true;
+}
+
 int main(const int argc, const char** argv) {
   auto args_opt = ParseArgs(argc, argv);
   if (!args_opt) return 0;
   auto args = args_opt.value();
   const bool arg_dump = args.GetBool("dump");
+  const bool arg_emit_cpp = args.GetBool("emit-cpp");
+  const bool arg_analyze = args.GetBool("analyze");
   const bool arg_dry_run = args.GetBool("dry-run");
+  const bool arg_instant_grab = args.GetBool("instant-grab");
+  const bool arg_kernel_offload = args.GetBool("kernel-offload");
+  const bool arg_busy_poll = args.GetBool("busy-poll");
+  const bool arg_pm_qos = args.GetBool("pm-qos");
+  const bool arg_reconcile_keys = args.GetBool("reconcile-keys");
+  const auto arg_latency_budget_ms = ParseIntArg(
+      args.GetString("latency-budget-ms"), "latency-budget-ms", 0);
+  const auto arg_debounce_ms =
+      ParseIntArg(args.GetString("debounce-ms"), "debounce-ms", 1);
+  const auto arg_chord_ms =
+      ParseIntArg(args.GetString("chord-ms"), "chord-ms", 1);
+  const auto arg_text_pace_ms =
+      ParseIntArg(args.GetString("text-pace-ms"), "text-pace-ms", 1);
+  const auto arg_mouse_hz = ParseIntArg(args.GetString("mouse-hz"),
+                                        "mouse-hz", 1, kMaxMouseKeysHz);
+  const auto arg_mouse_speed =
+      ParseIntArg(args.GetString("mouse-speed"), "mouse-speed", 1);
+  const auto arg_mouse_accel_ms =
+      ParseIntArg(args.GetString("mouse-accel-ms"), "mouse-accel-ms", 0);
+  for (const auto* arg_int :
+       {&arg_latency_budget_ms, &arg_debounce_ms, &arg_chord_ms,
+        &arg_text_pace_ms, &arg_mouse_hz, &arg_mouse_speed,
+        &arg_mouse_accel_ms}) {
+    if (!arg_int->has_value()) {
+      std::cerr << "ERROR: " << arg_int->error() << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  const bool arg_mouse_keys = arg_mouse_hz->has_value() ||
+                              arg_mouse_speed->has_value() ||
+                              arg_mouse_accel_ms->has_value();
   const std::optional<std::string> arg_config = args.GetString("config");
   const std::optional<std::string> arg_config_file =
       args.GetString("config-file");
+  const auto arg_profiles = ParseProfilesArg(args.GetString("profiles"));
+  if (!arg_profiles) {
+    std::cerr << "ERROR: " << arg_profiles.error() << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::optional<std::string> arg_control_socket =
+      args.GetString("control-socket");
+  const std::optional<std::string> arg_control = args.GetString("control");
+  if (arg_control.has_value()) {
+    return RunControlCommand(arg_control_socket, arg_control.value());
+  }
+
+  // Reloads the config for the control socket.
+  std::function<ErrorStrOr<void>()> reload;
 
-  auto remapper_exc = GetRemapper(arg_config, arg_config_file);
-  if (!remapper_exc) {
-    std::cerr << "ERROR: " << remapper_exc.error() << std::endl;
+#ifdef KEYSHIFT_COMPILED_CONFIG
+  if (arg_config || arg_config_file || arg_kernel_offload || arg_emit_cpp ||
+      arg_analyze || arg_chord_ms->has_value() ||
+      arg_text_pace_ms->has_value() || arg_mouse_keys ||
+      !arg_profiles->empty()) {
+    std::cerr << "ERROR: The config is compiled in, --config, --config-file, "
+                 "--profiles, --kernel-offload, --emit-cpp, --analyze, "
+                 "--chord-ms, --text-pace-ms and --mouse-* are not supported."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  KeyRemapper remapper;
+  const bool uses_mouse_keys = remapper.UsesMouseKeys();
+  reload = []() -> ErrorStrOr<void> {
+    return std::unexpected("The config is compiled in.");
+  };
+#else
+  // The keymap and the emitted code cannot change with the profile.
+  if (!arg_profiles->empty() && (arg_kernel_offload || arg_emit_cpp)) {
+    std::cerr << "ERROR: --profiles cannot be used with --kernel-offload or "
+                 "--emit-cpp."
+              << std::endl;
     return EXIT_FAILURE;
   }
-  Remapper remapper = std::move(remapper_exc.value());
+  std::vector<std::string> profile_names;
+  if (!arg_profiles->empty()) profile_names.push_back(kDefaultProfileName);
+  for (const auto& [name, _] : arg_profiles.value()) {
+    profile_names.push_back(name);
+  }
+  // Flags which change the config apply to every profile.
+  const auto get_remapper =
+      [&](const std::optional<std::string>& config,
+          const std::optional<std::string>& config_file) {
+        auto remapper = GetRemapper(config, config_file, profile_names);
+        if (!remapper) return remapper;
+        if (arg_chord_ms->has_value()) {
+          remapper->SetChordWindowMs(arg_chord_ms->value());
+        }
+        if (arg_text_pace_ms->has_value()) {
+          remapper->SetTextPaceMs(arg_text_pace_ms->value());
+        }
+        if (arg_mouse_keys) {
+          MouseKeysConfig mouse_keys = remapper->config()->mouse_keys;
+          mouse_keys.rate_hz = arg_mouse_hz->value_or(mouse_keys.rate_hz);
+          mouse_keys.max_speed =
+              arg_mouse_speed->value_or(mouse_keys.max_speed);
+          mouse_keys.accel_ms =
+              arg_mouse_accel_ms->value_or(mouse_keys.accel_ms);
+          remapper->SetMouseKeys(mouse_keys);
+        }
+        return remapper;
+      };
+  // The config, and then the --profiles. Each is compiled once here, so that
+  // switching only swaps the tables.
+  const auto load_profiles = [&]() -> ErrorStrOr<std::vector<Profile>> {
+    auto remapper = get_remapper(arg_config, arg_config_file);
+    if (!remapper) return std::unexpected(remapper.error());
+    std::vector<Profile> profiles = {{kDefaultProfileName, remapper->config()}};
+    for (const auto& [name, file] : arg_profiles.value()) {
+      auto profile = get_remapper(std::nullopt, file);
+      if (!profile) {
+        return std::unexpected("Profile " + name + ": " + profile.error());
+      }
+      profiles.push_back({name, profile->config()});
+    }
+    return profiles;
+  };
+  const auto any_uses_mouse_keys = [](const std::vector<Profile>& profiles) {
+    for (const auto& profile : profiles) {
+      if (Remapper(profile.config).UsesMouseKeys()) return true;
+    }
+    return false;
+  };
+  auto profiles_exc = load_profiles();
+  if (!profiles_exc) {
+    std::cerr << "ERROR: " << profiles_exc.error() << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<Profile> profiles = std::move(profiles_exc.value());
+  Remapper remapper(profiles[0].config);
+  const bool uses_mouse_keys = any_uses_mouse_keys(profiles);
+  if (arg_emit_cpp) {
+    const auto emitted = EmitCpp(remapper, std::cout);
+    if (!emitted) {
+      std::cerr << "ERROR: " << emitted.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+  if ((arg_analyze || arg_dump) && !arg_profiles->empty()) {
+    int result = EXIT_SUCCESS;
+    for (const auto& profile : profiles) {
+      std::cout << "Profile: " << profile.name << std::endl;
+      const Remapper profile_remapper(profile.config);
+      if (arg_dump) {
+        profile_remapper.DumpConfig();
+      } else if (AnalyzeAndCheckBudget(profile_remapper,
+                                       arg_latency_budget_ms.value()) !=
+                 EXIT_SUCCESS) {
+        result = EXIT_FAILURE;
+      }
+    }
+    return result;
+  }
+  if (arg_analyze) {
+    return AnalyzeAndCheckBudget(remapper, arg_latency_budget_ms.value());
+  }
+  if (!arg_profiles->empty()) remapper.SetProfiles(std::move(profiles));
+  reload = [&]() -> ErrorStrOr<void> {
+    // The remaps offloaded would be done twice.
+    if (arg_kernel_offload) {
+      return std::unexpected("Cannot reload with --kernel-offload.");
+    }
+    auto reloaded = load_profiles();
+    if (!reloaded) return std::unexpected(reloaded.error());
+    // The virtual device cannot become a mouse.
+    if (!uses_mouse_keys && any_uses_mouse_keys(reloaded.value())) {
+      return std::unexpected("Restart keyshift to use mouse keys.");
+    }
+    const int profile = remapper.profile();
+    remapper.SwitchConfig(reloaded.value()[profile].config);
+    if (!arg_profiles->empty()) {
+      remapper.SetProfiles(std::move(reloaded.value()), profile);
+    }
+    return {};
+  };
+#endif
   if (arg_dump) {
     remapper.DumpConfig();
     return EXIT_SUCCESS;
@@ -228,44 +1118,129 @@ int main(const int argc, const char** argv) {
   std::optional<OSMutex> mutex;
   // Use mutex only if this is not dry-run and we intend to grab the device.
   if (!arg_dry_run) {
-    mutex = AcquireOSMutex("keyshift_" + arg_kbd);
+    mutex = AcquireKbdMutex(arg_kbd);
     if (!mutex) {
-      std::cerr
-          << "Keyshift: Another instance is starting for same kbd, exiting."
-          << std::endl;
       // Normal exit.
       return EXIT_SUCCESS;
     }
   }
+  const auto open_start_time = std::chrono::steady_clock::now();
   InputDevice device(arg_kbd.c_str());
-  VirtualDevice out_device;
+  const auto capabilities = device.GetCapabilities();
+  VirtualDevice out_device(capabilities ? &capabilities.value() : nullptr,
+                           uses_mouse_keys);
+  // Forward non-key events only when grabbing, otherwise they already reach
+  // the system.
+  FrameForwarder forwarder(arg_dry_run ? nullptr : &out_device);
+  KeyStateNormalizer key_output(
+      [&out_device](const struct input_event* events, std::size_t count) {
+        out_device.SendEvents(events, count);
+      });
+
+  // Held until exit, and dropped by the kernel even if we are killed.
+  std::optional<CpuDmaLatencyRequest> cpu_latency;
+  if (arg_pm_qos) cpu_latency.emplace(/*latency_us=*/0);
+  if (arg_busy_poll) printf("Busy polling enabled.\n");
+
+  MainLoopOptions options;
+  options.echo_inputs = arg_dry_run;
+  options.busy_poll = arg_busy_poll;
+  options.reload = reload;
+  std::optional<ControlServer> control;
+  if (arg_control_socket.has_value()) {
+    auto server = ControlServer::Listen(arg_control_socket.value());
+    if (!server) {
+      std::cerr << "ERROR: " << server.error() << std::endl;
+      return EXIT_FAILURE;
+    }
+    control.emplace(std::move(server.value()));
+    options.control = &control.value();
+    printf("Control socket: %s\n", arg_control_socket->c_str());
+  }
+  // Not in dry run, since the keyboard is not grabbed.
+  StuckKeyReconciler reconciler;
+  if (arg_reconcile_keys && !arg_dry_run) options.reconciler = &reconciler;
+  std::optional<Debouncer> debouncer;
+  if (arg_debounce_ms->has_value()) {
+    debouncer.emplace(arg_debounce_ms->value());
+    options.debouncer = &debouncer.value();
+  }
+
+  ReadErrorBreaker read_errors;
+  options.print_stats = [&](std::ostream& os, bool all) {
+    // Logged as errors on exit.
+    if (all || read_errors.counters().non_fatal > 0) {
+      (all ? os : std::cerr) << "Read errors: " << read_errors.counters()
+                             << std::endl;
+    }
+    const auto& dropped = key_output.counters();
+    if (all || dropped.redundant + dropped.collapsed > 0) {
+      os << "Output events dropped: " << dropped << std::endl;
+    }
+    const auto& frames = forwarder.counters();
+    if (all || frames.split + frames.dropped > 0) {
+      os << "Frames forwarded: " << frames << std::endl;
+    }
+    const auto& corrected = reconciler.counters();
+    if (all || corrected.input + corrected.output > 0) {
+      os << "Stuck keys corrected: " << corrected << std::endl;
+    }
+    if (debouncer && (all || debouncer->counters().suppressed > 0)) {
+      os << "Key chatter: " << debouncer->counters() << std::endl;
+    }
+#ifndef KEYSHIFT_COMPILED_CONFIG
+    const auto& chords = remapper.chord_counters();
+    if (all || chords.matched + chords.flushed > 0) {
+      os << "Chords: " << chords << std::endl;
+    }
+    if (all || remapper.autofire_counters().ticks > 0) {
+      os << "Autofire: " << remapper.autofire_counters() << std::endl;
+    }
+    if (all || remapper.mouse_keys_counters().steps > 0) {
+      os << "Mouse keys: " << remapper.mouse_keys_counters() << std::endl;
+    }
+#endif
+  };
+
+  // Control returns from MainLoop only if interrupted, killed, or if the
+  // device was disconnected.
+  const auto run = [&](auto& pipeline) {
+    while (true) {
+      const int result =
+          MainLoop(device, remapper, pipeline, read_errors, forwarder,
+                   key_output, options);
+      options.print_stats(std::cout, /*all=*/false);
+      if (result != kMainLoopDeviceLost) return result;
+      if (!ReattachDevice(device, remapper, pipeline, arg_kbd,
+                          /*grab=*/!arg_dry_run, arg_instant_grab)) {
+        // Same as MainLoop() if interrupted, else another instance took over.
+        return kExitMainloopNow.load() ? 2 : EXIT_SUCCESS;
+      }
+    }
+  };
 
   if (arg_dry_run) {
     DisableEcho();
-    auto echo_on_emit_fn = [](int key_code, int press) {
-      std::cout << "  Out: ";
-      std::cout << (press == 1   ? "P "
-                    : press == 0 ? "R "
-                                 : "T ")
-                << KeyCodeToName(key_code);
-      std::cout << std::endl;
-    };
-    remapper.SetCallback(echo_on_emit_fn);
     printf("Dryrun - processing disabled, echo enabled.\n");
-  } else {
-    remapper.SetCallback([&out_device](int code, int value) {
-      out_device.DoKeyEvent(code, value);
-    });
-    device.Grab();
-    // Preserve the mutex only until a device has been grabbed.
-    // This helps to not maintain the file in /dev/shm.
-    // Also it is sufficeint to ensure if multiple calls happen during
-    // initialization, e.g. because of udev rules matching multiple times, they
-    // are blocked.
-    mutex.reset();
-    printf("Processing enabled.\n");
+    Pipeline pipeline{RemapStage(&remapper), EchoSink()};
+    return run(pipeline);
   }
 
-  // Control returns from MainLoop only if interrupted or killed.
-  return MainLoop(device, remapper, arg_dry_run);
+  Pipeline pipeline{RemapStage(&remapper), KeyOutputSink(&key_output)};
+  GrabDevice(device, remapper, pipeline, arg_instant_grab);
+#ifndef KEYSHIFT_COMPILED_CONFIG
+  if (arg_kernel_offload) OffloadToKernel(device, remapper);
+#endif
+  // Preserve the mutex only until a device has been grabbed.
+  // This helps to not maintain the file in /dev/shm.
+  // Also it is sufficeint to ensure if multiple calls happen during
+  // initialization, e.g. because of udev rules matching multiple times, they
+  // are blocked.
+  mutex.reset();
+  const auto time_to_grab_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - open_start_time)
+          .count();
+  printf("Processing enabled (time to grab: %ldms).\n", time_to_grab_ms);
+  return run(pipeline);
 }
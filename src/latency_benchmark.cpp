@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures keyshift's end to end latency, with and without --busy-poll.
+//
+// Run `sudo ./latency_benchmark ./keyshift`, or add --pm-qos to pass it on
+// to keyshift. This needs /dev/uinput, and root to grab devices.
+//
+// A virtual keyboard is created as the source, and keyshift is started on it
+// with the config A=B, so that every event goes through the main loop and the
+// remapper. Presses and releases of A are written to the source at random
+// intervals, like a key every few milliseconds. The latency is from just
+// before the write, to when B is read from keyshift's own virtual keyboard,
+// as any application would read it.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+const int kSamples = 2000;
+// Not counted, while caches and the CPU frequency settle.
+const int kWarmupSamples = 50;
+const int kMinIntervalUs = 500;
+const int kMaxIntervalUs = 2000;
+// For keyshift to grab the source and create its virtual keyboard, and for
+// each event to come out of it.
+const int kStartTimeoutMs = 5000;
+const int kEventTimeoutMs = 1000;
+
+// Same as in virtual_device.h.
+const int kOutputVendor = 0x549c;
+const int kOutputProduct = 0xb248;
+
+long NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// A virtual keyboard to type into keyshift.
+class SourceDevice {
+ public:
+  SourceDevice() {
+    // Not inherited by keyshift.
+    fd_ = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd_ < 0) {
+      perror("Unable to open /dev/uinput");
+      return;
+    }
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    strcpy(setup.name, "keyshift latency benchmark");
+    if (ioctl(fd_, UI_SET_EVBIT, EV_KEY) < 0 ||
+        ioctl(fd_, UI_SET_KEYBIT, KEY_A) < 0 ||
+        ioctl(fd_, UI_SET_KEYBIT, KEY_B) < 0 ||
+        ioctl(fd_, UI_DEV_SETUP, &setup) < 0 ||
+        ioctl(fd_, UI_DEV_CREATE) < 0) {
+      perror("Unable to create the source device");
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  ~SourceDevice() {
+    if (fd_ < 0) return;
+    ioctl(fd_, UI_DEV_DESTROY);
+    close(fd_);
+  }
+
+  bool IsOpen() const { return fd_ >= 0; }
+
+  // The /dev/input/event* node created for it, or empty on error.
+  std::string EventPath() const {
+    char sysname[64];
+    if (ioctl(fd_, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+      perror("UI_GET_SYSNAME");
+      return "";
+    }
+    const std::string dir =
+        std::string("/sys/devices/virtual/input/") + sysname;
+    DIR* entries = opendir(dir.c_str());
+    if (entries == nullptr) {
+      perror(dir.c_str());
+      return "";
+    }
+    std::string path;
+    while (const struct dirent* entry = readdir(entries)) {
+      if (strncmp(entry->d_name, "event", 5) == 0) {
+        path = std::string("/dev/input/") + entry->d_name;
+        break;
+      }
+    }
+    closedir(entries);
+    return path;
+  }
+
+  // Writes a key event and its SYN_REPORT. Returns false on error.
+  bool KeyEvent(int key_code, int value) const {
+    struct input_event events[2];
+    memset(events, 0, sizeof(events));
+    events[0].type = EV_KEY;
+    events[0].code = key_code;
+    events[0].value = value;
+    events[1].type = EV_SYN;
+    events[1].code = SYN_REPORT;
+    return write(fd_, events, sizeof(events)) == sizeof(events);
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+// Event nodes of keyshift's virtual keyboards.
+std::set<std::string> FindOutputDevices() {
+  std::set<std::string> paths;
+  DIR* entries = opendir("/dev/input");
+  if (entries == nullptr) return paths;
+  while (const struct dirent* entry = readdir(entries)) {
+    if (strncmp(entry->d_name, "event", 5) != 0) continue;
+    const std::string path = std::string("/dev/input/") + entry->d_name;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) continue;
+    struct input_id id;
+    if (ioctl(fd, EVIOCGID, &id) == 0 && id.vendor == kOutputVendor &&
+        id.product == kOutputProduct) {
+      paths.insert(path);
+    }
+    close(fd);
+  }
+  closedir(entries);
+  return paths;
+}
+
+// Runs keyshift on the source device until destroyed.
+class Keyshift {
+ public:
+  Keyshift(const std::string& binary, const std::string& kbd,
+           const std::vector<std::string>& flags) {
+    std::vector<std::string> args = {binary, "--kbd", kbd, "--config", "A=B",
+                                     "--instant-grab"};
+    args.insert(args.end(), flags.begin(), flags.end());
+    pid_ = fork();
+    if (pid_ < 0) {
+      perror("fork");
+      return;
+    }
+    if (pid_ == 0) {
+      std::vector<char*> argv;
+      for (auto& arg : args) argv.push_back(arg.data());
+      argv.push_back(nullptr);
+      execv(argv[0], argv.data());
+      perror("execv");
+      _exit(127);
+    }
+  }
+
+  ~Keyshift() {
+    if (pid_ <= 0) return;
+    kill(pid_, SIGTERM);
+    waitpid(pid_, nullptr, 0);
+  }
+
+  bool IsRunning() const {
+    return pid_ > 0 && waitpid(pid_, nullptr, WNOHANG) == 0;
+  }
+
+ private:
+  pid_t pid_ = -1;
+};
+
+// Waits for keyshift to create a virtual keyboard not in before, and opens it.
+// Returns -1 on timeout.
+int OpenNewOutputDevice(const std::set<std::string>& before,
+                        const Keyshift& keyshift) {
+  const long deadline_ns = NowNs() + kStartTimeoutMs * 1000000L;
+  while (NowNs() < deadline_ns && keyshift.IsRunning()) {
+    for (const auto& path : FindOutputDevices()) {
+      if (before.contains(path)) continue;
+      const int fd = open(path.c_str(), O_RDONLY);
+      if (fd >= 0) return fd;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return -1;
+}
+
+// Reads from the output until the key event arrives. Returns false on error
+// or timeout.
+bool WaitForKeyEvent(int fd, int key_code, int value) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  struct input_event events[64];
+  while (true) {
+    const int ready = poll(&pfd, 1, kEventTimeoutMs);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready <= 0) return false;
+    const ssize_t bytes_read = read(fd, events, sizeof(events));
+    if (bytes_read <= 0) return false;
+    for (std::size_t i = 0; i < bytes_read / sizeof(struct input_event); ++i) {
+      if (events[i].type == EV_KEY && events[i].code == key_code &&
+          events[i].value == value) {
+        return true;
+      }
+    }
+  }
+}
+
+// Returns the latency of each event in nano seconds, sorted, or nothing on
+// error after showing it.
+std::optional<std::vector<long>> Measure(
+    const std::string& binary, const std::vector<std::string>& flags) {
+  SourceDevice source;
+  if (!source.IsOpen()) return std::nullopt;
+  const std::string kbd = source.EventPath();
+  if (kbd.empty()) return std::nullopt;
+
+  const auto before = FindOutputDevices();
+  Keyshift keyshift(binary, kbd, flags);
+  const int out_fd = OpenNewOutputDevice(before, keyshift);
+  if (out_fd < 0) {
+    std::cerr << "ERROR: keyshift did not create its virtual keyboard."
+              << std::endl;
+    return std::nullopt;
+  }
+
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<> interval_us(kMinIntervalUs, kMaxIntervalUs);
+  std::vector<long> latencies;
+  for (int i = 0; i < kWarmupSamples + kSamples; ++i) {
+    std::this_thread::sleep_for(std::chrono::microseconds(interval_us(gen)));
+    // Presses and releases alternate.
+    const int value = i % 2 == 0 ? 1 : 0;
+    const long sent_ns = NowNs();
+    if (!source.KeyEvent(KEY_A, value)) {
+      perror("Could not write to the source device");
+      close(out_fd);
+      return std::nullopt;
+    }
+    if (!WaitForKeyEvent(out_fd, KEY_B, value)) {
+      std::cerr << "ERROR: No output from keyshift." << std::endl;
+      close(out_fd);
+      return std::nullopt;
+    }
+    if (i >= kWarmupSamples) latencies.push_back(NowNs() - sent_ns);
+  }
+  // Leaves the key released.
+  if (kSamples % 2 != 0) source.KeyEvent(KEY_A, 0);
+  close(out_fd);
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+void ShowPercentiles(const std::string& name, const std::vector<long>& sorted) {
+  std::cout << std::left << std::setw(10) << name << std::right;
+  for (const double percentile : {50.0, 90.0, 99.0, 99.9}) {
+    const auto index = static_cast<std::size_t>(percentile / 100 *
+                                                (sorted.size() - 1));
+    std::cout << std::setw(10) << sorted[index] / 1000.0;
+  }
+  std::cout << std::setw(10) << sorted.back() / 1000.0 << std::endl;
+}
+
+int main(int argc, const char** argv) {
+  if (argc < 2 || (argc == 3 && std::string(argv[2]) != "--pm-qos") ||
+      argc > 3) {
+    std::cerr << "Usage: sudo " << argv[0] << " path/to/keyshift [--pm-qos]"
+              << std::endl;
+    return 1;
+  }
+  const std::string binary = argv[1];
+  std::vector<std::string> flags;
+  if (argc == 3) flags.push_back("--pm-qos");
+
+  const auto by_poll = Measure(binary, flags);
+  if (!by_poll) return 1;
+  flags.push_back("--busy-poll");
+  const auto by_busy_poll = Measure(binary, flags);
+  if (!by_busy_poll) return 1;
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "End to end latency in us, over " << kSamples << " events"
+            << (argc == 3 ? ", with PM QoS" : "") << "." << std::endl;
+  std::cout << std::left << std::setw(10) << "" << std::right;
+  for (const char* header : {"p50", "p90", "p99", "p99.9", "max"}) {
+    std::cout << std::setw(10) << header;
+  }
+  std::cout << std::endl;
+  ShowPercentiles("poll", by_poll.value());
+  ShowPercentiles("busy-poll", by_busy_poll.value());
+  return 0;
+}
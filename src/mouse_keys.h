@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __MOUSE_KEYS_H
+#define __MOUSE_KEYS_H
+
+// Mouse keys, i.e. moving the pointer and scrolling while keys are held.
+//
+// Motion is integrated in fixed steps of 1 / rate_hz, at absolute times from
+// when it started. So the distance covered does not depend on when the steps
+// actually run: steps which are late are all run at once, and the motion is
+// sent as a single frame. Fractions of a pixel are carried over to the next
+// step, which keeps slow motion smooth.
+//
+// The speed follows an acceleration curve: it starts at kMouseKeysStartFraction
+// of max_speed, and rises with the square of the time held to max_speed after
+// accel_ms. Scrolling follows the same curve.
+//
+// Nothing is allocated, as steps run at up to kMaxMouseKeysHz.
+
+#include <linux/input-event-codes.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+// Opposite directions cancel out.
+enum class MouseKeyDirection {
+  kLeft,
+  kRight,
+  kUp,
+  kDown,
+  kWheelUp,
+  kWheelDown,
+  kWheelLeft,
+  kWheelRight,
+};
+const int kNumMouseKeyDirections = 8;
+
+// As written in the config, in the order of MouseKeyDirection.
+inline const std::array<const char*, kNumMouseKeyDirections> kMouseKeyNames = {
+    "MOUSE_LEFT", "MOUSE_RIGHT", "MOUSE_UP",   "MOUSE_DOWN",
+    "WHEEL_UP",   "WHEEL_DOWN",  "WHEEL_LEFT", "WHEEL_RIGHT"};
+
+const int kMaxMouseKeysHz = 1000;
+const double kMouseKeysStartFraction = 0.1;
+// Scrolling by a notch is as fast as moving this many pixels.
+const int kMouseKeysPixelsPerNotch = 80;
+// Steps later than this are dropped instead of caught up with, e.g. after the
+// process was stopped, so that the pointer does not jump.
+const int kMouseKeysMaxCatchUpMs = 50;
+
+struct MouseKeysConfig {
+  // Steps per second, up to kMaxMouseKeysHz.
+  int rate_hz = 250;
+  // In pixels per second.
+  int max_speed = 1200;
+  // Time held to reach max_speed.
+  int accel_ms = 1000;
+};
+
+// Relative motion, as sent in one frame.
+struct PointerMotion {
+  // Pixels, with y down.
+  int x = 0;
+  int y = 0;
+  // Wheel, in notches and in 1/120 of a notch as for REL_WHEEL_HI_RES. Up and
+  // right are positive.
+  int wheel = 0;
+  int hwheel = 0;
+  int wheel_hi_res = 0;
+  int hwheel_hi_res = 0;
+
+  bool empty() const {
+    return x == 0 && y == 0 && wheel_hi_res == 0 && hwheel_hi_res == 0;
+  }
+};
+
+class MouseKeys {
+ public:
+  struct Counters {
+    long steps = 0;
+    // How late steps ran after their deadlines, i.e. the jitter.
+    int64_t total_late_us = 0;
+    int64_t max_late_us = 0;
+    // Steps dropped, see kMouseKeysMaxCatchUpMs.
+    long skipped = 0;
+  };
+
+  bool moving() const { return num_held_ > 0; }
+
+  // Holds a direction, until Stop() for the key which started it.
+  void Start(MouseKeyDirection direction, int key_origin, int event_seq_num,
+             int64_t now_us) {
+    if (!moving()) {
+      start_us_ = now_us;
+      steps_ = 0;
+      remainders_.fill(0);
+      notch_hi_res_.fill(0);
+    }
+    auto& held = held_[int(direction)];
+    if (held.key_origin < 0) ++num_held_;
+    held = Held{key_origin, event_seq_num};
+  }
+
+  // Releases the directions for which stop(key_origin, event_seq_num) is true.
+  template <typename Predicate>
+  void Stop(Predicate stop) {
+    for (auto& held : held_) {
+      if (held.key_origin < 0 || !stop(held.key_origin, held.event_seq_num)) {
+        continue;
+      }
+      held.key_origin = -1;
+      --num_held_;
+    }
+  }
+
+  // When the next step is due, or -1 if not moving.
+  int64_t NextStepUs(const MouseKeysConfig& config) const {
+    if (!moving()) return -1;
+    return StepUs(steps_ + 1, config);
+  }
+
+  // Runs the steps due, adding to the motion to send.
+  void Run(int64_t now_us, const MouseKeysConfig& config) {
+    if (!moving()) return;
+    const int max_steps =
+        std::max(1, kMouseKeysMaxCatchUpMs * config.rate_hz / 1000);
+    for (int step = 0; StepUs(steps_ + 1, config) <= now_us; ++step) {
+      if (step == max_steps) {
+        const int64_t skip =
+            (now_us - start_us_) * config.rate_hz / 1000000 - steps_;
+        if (skip > 0) {
+          counters_.skipped += skip;
+          steps_ += skip;
+        }
+        return;
+      }
+      ++steps_;
+      const int64_t late_us = now_us - StepUs(steps_, config);
+      ++counters_.steps;
+      counters_.total_late_us += late_us;
+      counters_.max_late_us = std::max(counters_.max_late_us, late_us);
+      Step(config);
+    }
+  }
+
+  // The motion since the last call.
+  PointerMotion TakeMotion() {
+    const PointerMotion motion = motion_;
+    motion_ = PointerMotion();
+    return motion;
+  }
+
+  const Counters& counters() const { return counters_; }
+
+ private:
+  struct Held {
+    // Input key which holds the direction, or -1.
+    int key_origin = -1;
+    int event_seq_num = 0;
+  };
+
+  int64_t StepUs(int64_t step, const MouseKeysConfig& config) const {
+    return start_us_ + step * 1000000 / config.rate_hz;
+  }
+
+  // Integrates one step, at the speed for its time.
+  void Step(const MouseKeysConfig& config) {
+    const double held_us = double(steps_) * 1000000 / config.rate_hz;
+    const double ramp =
+        config.accel_ms > 0 ? std::min(1.0, held_us / config.accel_ms / 1000)
+                            : 1.0;
+    const double speed =
+        config.max_speed * (kMouseKeysStartFraction +
+                            (1 - kMouseKeysStartFraction) * ramp * ramp);
+    const double pixels = speed / config.rate_hz;
+    const double hi_res = pixels * 120 / kMouseKeysPixelsPerNotch;
+    motion_.x += Advance(0, MouseKeyDirection::kRight,
+                         MouseKeyDirection::kLeft, pixels);
+    motion_.y += Advance(1, MouseKeyDirection::kDown, MouseKeyDirection::kUp,
+                         pixels);
+    const int wheel = Advance(2, MouseKeyDirection::kWheelUp,
+                              MouseKeyDirection::kWheelDown, hi_res);
+    motion_.wheel_hi_res += wheel;
+    motion_.wheel += Notches(0, wheel);
+    const int hwheel = Advance(3, MouseKeyDirection::kWheelRight,
+                               MouseKeyDirection::kWheelLeft, hi_res);
+    motion_.hwheel_hi_res += hwheel;
+    motion_.hwheel += Notches(1, hwheel);
+  }
+
+  // Moves an axis by distance if one of its directions is held. Returns the
+  // whole units moved, and keeps the fraction for the next step.
+  int Advance(int axis, MouseKeyDirection positive,
+              MouseKeyDirection negative, double distance) {
+    const int sign = (held_[int(positive)].key_origin >= 0 ? 1 : 0) -
+                     (held_[int(negative)].key_origin >= 0 ? 1 : 0);
+    double& remainder = remainders_[axis];
+    if (sign == 0) {
+      remainder = 0;
+      return 0;
+    }
+    remainder += sign * distance;
+    const int whole = int(remainder);
+    remainder -= whole;
+    return whole;
+  }
+
+  // Whole notches scrolled, given the hi-res units just scrolled.
+  int Notches(int wheel, int hi_res) {
+    notch_hi_res_[wheel] += hi_res;
+    const int notches = notch_hi_res_[wheel] / 120;
+    notch_hi_res_[wheel] -= notches * 120;
+    return notches;
+  }
+
+  std::array<Held, kNumMouseKeyDirections> held_{};
+  int num_held_ = 0;
+  // Step n is due at start_us_ + n / rate_hz.
+  int64_t start_us_ = 0;
+  int64_t steps_ = 0;
+  // Fractions of a unit, for x, y, wheel and hwheel.
+  std::array<double, 4> remainders_{};
+  // Hi-res units towards the next notch, for wheel and hwheel.
+  std::array<int, 2> notch_hi_res_{};
+  PointerMotion motion_;
+  Counters counters_;
+};
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const MouseKeys::Counters& counters) {
+  return os << counters.steps << " steps, late by "
+            << (counters.steps > 0 ? counters.total_late_us / counters.steps
+                                   : 0)
+            << "us on average and " << counters.max_late_us << "us at most, "
+            << counters.skipped << " skipped";
+}
+
+#endif  // __MOUSE_KEYS_H
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mouse_keys.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+const int64_t kStartUs = 1'000'000;
+
+MouseKeysConfig MakeConfig(int rate_hz, int max_speed, int accel_ms) {
+  MouseKeysConfig config;
+  config.rate_hz = rate_hz;
+  config.max_speed = max_speed;
+  config.accel_ms = accel_ms;
+  return config;
+}
+
+TEST_CASE("Carries fractions of a pixel over", "[mouse_keys]") {
+  // A tenth of the max speed at first, i.e. a quarter pixel per step.
+  const auto config = MakeConfig(100, 250, 1000000);
+  MouseKeys mouse_keys;
+  mouse_keys.Start(MouseKeyDirection::kRight, KEY_L, 0, kStartUs);
+  CHECK(mouse_keys.NextStepUs(config) == kStartUs + 10000);
+  for (int step = 1; step <= 3; ++step) {
+    mouse_keys.Run(kStartUs + step * 10000, config);
+    CHECK(mouse_keys.TakeMotion().empty());
+  }
+  mouse_keys.Run(kStartUs + 40000, config);
+  CHECK(mouse_keys.TakeMotion().x == 1);
+  CHECK(mouse_keys.counters().steps == 4);
+  CHECK(mouse_keys.counters().max_late_us == 0);
+}
+
+TEST_CASE("Covers the same distance however late steps run",
+          "[mouse_keys]") {
+  const auto config = MakeConfig(1000, 2000, 30);
+  MouseKeys on_time;
+  MouseKeys late;
+  on_time.Start(MouseKeyDirection::kDown, KEY_J, 0, kStartUs);
+  late.Start(MouseKeyDirection::kDown, KEY_J, 0, kStartUs);
+  int y = 0;
+  for (int step = 1; step <= 40; ++step) {
+    on_time.Run(kStartUs + step * 1000, config);
+    y += on_time.TakeMotion().y;
+  }
+  late.Run(kStartUs + 40000, config);
+  const auto motion = late.TakeMotion();
+  CHECK(motion.y == y);
+  CHECK(motion.x == 0);
+  CHECK(late.counters().steps == 40);
+  CHECK(late.counters().max_late_us == 39000);
+  CHECK(late.counters().skipped == 0);
+}
+
+TEST_CASE("Accelerates to the max speed", "[mouse_keys]") {
+  const auto config = MakeConfig(1000, 1000, 100);
+  MouseKeys mouse_keys;
+  mouse_keys.Start(MouseKeyDirection::kLeft, KEY_H, 0, kStartUs);
+  mouse_keys.Run(kStartUs + 50000, config);
+  const int first_half = mouse_keys.TakeMotion().x;
+  mouse_keys.Run(kStartUs + 100000, config);
+  const int second_half = mouse_keys.TakeMotion().x;
+  // Slow at first, speeding up.
+  CHECK(first_half > -50);
+  CHECK(second_half < first_half);
+  // A pixel per step at max speed.
+  mouse_keys.Run(kStartUs + 140000, config);
+  CHECK(mouse_keys.TakeMotion().x == -40);
+}
+
+TEST_CASE("Skips steps too late to catch up with", "[mouse_keys]") {
+  const auto config = MakeConfig(1000, 1000, 0);
+  MouseKeys mouse_keys;
+  mouse_keys.Start(MouseKeyDirection::kUp, KEY_K, 0, kStartUs);
+  mouse_keys.Run(kStartUs + 1000000, config);
+  CHECK(mouse_keys.TakeMotion().y == -kMouseKeysMaxCatchUpMs);
+  CHECK(mouse_keys.counters().skipped == 1000 - kMouseKeysMaxCatchUpMs);
+  CHECK(mouse_keys.NextStepUs(config) == kStartUs + 1001000);
+}
+
+TEST_CASE("Scrolls in notches and hi-res units", "[mouse_keys]") {
+  // 12 hi-res units per step.
+  const auto config = MakeConfig(100, 10 * kMouseKeysPixelsPerNotch, 0);
+  MouseKeys mouse_keys;
+  mouse_keys.Start(MouseKeyDirection::kWheelDown, KEY_D, 0, kStartUs);
+  mouse_keys.Run(kStartUs + 50000, config);
+  auto motion = mouse_keys.TakeMotion();
+  CHECK(motion.wheel_hi_res == -60);
+  CHECK(motion.wheel == 0);
+  CHECK_FALSE(motion.empty());
+  mouse_keys.Run(kStartUs + 100000, config);
+  motion = mouse_keys.TakeMotion();
+  CHECK(motion.wheel_hi_res == -60);
+  CHECK(motion.wheel == -1);
+}
+
+TEST_CASE("Stops with the keys holding it", "[mouse_keys]") {
+  const auto config = MakeConfig(100, 1000, 0);
+  MouseKeys mouse_keys;
+  mouse_keys.Start(MouseKeyDirection::kLeft, KEY_H, 0, kStartUs);
+  mouse_keys.Start(MouseKeyDirection::kRight, KEY_L, 1, kStartUs);
+  // Opposite directions cancel out.
+  mouse_keys.Run(kStartUs + 10000, config);
+  CHECK(mouse_keys.TakeMotion().empty());
+
+  mouse_keys.Stop([](int key_origin, int) { return key_origin == KEY_H; });
+  REQUIRE(mouse_keys.moving());
+  mouse_keys.Run(kStartUs + 20000, config);
+  CHECK(mouse_keys.TakeMotion().x == 10);
+
+  mouse_keys.Stop([](int, int event_seq_num) { return event_seq_num > 0; });
+  CHECK_FALSE(mouse_keys.moving());
+  CHECK(mouse_keys.NextStepUs(config) == -1);
+}
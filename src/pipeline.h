@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+// Stages that key events flow through, composed at compile time. E.g. -
+//
+//   Pipeline pipeline{RemapStage(&remapper), KeyOutputSink(&key_output)};
+//   pipeline.Process(key_event);
+//
+// Each stage takes a span of key events, and passes on spans of its own to the
+// next. Stages call each other directly, without virtual calls or
+// std::function, so there is no indirection per event. Events carry their
+// time, so that stages like debouncing can be timed by them.
+//
+// A stage has -
+//
+//   // Calls emit(std::span<const TimedKeyEvent>) with its output, any number
+//   // of times.
+//   template <typename Emit>
+//   void Process(std::span<const TimedKeyEvent> events, Emit&& emit);
+//
+//   // Passes on anything held back, e.g. events from outside Process().
+//   template <typename Emit>
+//   void Flush(Emit&& emit);
+//
+//   // Lets the stage flush itself and the rest of the pipeline at any time,
+//   // e.g. before sleeping.
+//   void BindFlush(std::function<void()> flush);
+//
+// The last stage is the sink, and only has -
+//
+//   void Process(std::span<const TimedKeyEvent> events);
+
+#include <linux/input.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <span>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "key_state_normalizer.h"
+#include "keycode_lookup.h"
+#include "remap_operator.h"
+
+// A key event, and when it happened, on the clock of SteadyClockNowUs().
+struct TimedKeyEvent : KeyEvent {
+  int64_t time_us = 0;
+};
+
+// The event as read from a device. InputDevice switches devices to
+// CLOCK_MONOTONIC, so that their times compare with SteadyClockNowUs().
+inline TimedKeyEvent ToTimedKeyEvent(const struct input_event& ie) {
+  return {{ie.code, KeyEventType(ie.value)},
+          int64_t(ie.time.tv_sec) * 1000000 + ie.time.tv_usec};
+}
+
+template <typename... Stages>
+class Pipeline {
+ public:
+  explicit Pipeline(Stages... stages) : stages_(std::move(stages)...) {
+    BindFlushFrom<0>();
+  }
+
+  // Stages keep pointers back to the pipeline.
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  void Process(std::span<const TimedKeyEvent> events) {
+    ProcessFrom<0>(events);
+  }
+  void Process(const TimedKeyEvent& event) { ProcessFrom<0>({&event, 1}); }
+
+  // Sends on anything held back by the stages, e.g. key releases from
+  // Remapper::ReleaseAll().
+  void Flush() { FlushFrom<0>(); }
+
+  template <std::size_t I>
+  auto& stage() {
+    return std::get<I>(stages_);
+  }
+
+ private:
+  static constexpr std::size_t kNumStages = sizeof...(Stages);
+
+  template <std::size_t I>
+  void ProcessFrom(std::span<const TimedKeyEvent> events) {
+    if constexpr (I + 1 == kNumStages) {
+      std::get<I>(stages_).Process(events);
+    } else {
+      std::get<I>(stages_).Process(
+          events, [this](std::span<const TimedKeyEvent> output) {
+            ProcessFrom<I + 1>(output);
+          });
+    }
+  }
+
+  template <std::size_t I>
+  void FlushFrom() {
+    if constexpr (I + 1 < kNumStages) {
+      std::get<I>(stages_).Flush(
+          [this](std::span<const TimedKeyEvent> output) {
+            ProcessFrom<I + 1>(output);
+          });
+      FlushFrom<I + 1>();
+    }
+  }
+
+  template <std::size_t I>
+  void BindFlushFrom() {
+    if constexpr (I + 1 < kNumStages) {
+      std::get<I>(stages_).BindFlush([this]() { FlushFrom<I>(); });
+      BindFlushFrom<I + 1>();
+    }
+  }
+
+  std::tuple<Stages...> stages_;
+};
+
+// Runs a Remapper, or any CompiledRemapper. The remapper must not have a
+// callback set, so that it collects what it emits, see Remapper::emitted().
+// Events emitted for an event get its time. Those emitted after a wait, or by
+// timers, get the time they are taken from the remapper.
+template <typename RemapperType>
+class RemapStage {
+ public:
+  explicit RemapStage(RemapperType* remapper) : remapper_(remapper) {}
+
+  RemapStage(RemapStage&& other)
+      : remapper_(std::exchange(other.remapper_, nullptr)),
+        output_(std::move(other.output_)) {}
+  RemapStage& operator=(RemapStage&& other) = delete;
+
+  // The wait callback points into the pipeline.
+  ~RemapStage() {
+    if (remapper_ != nullptr) remapper_->SetWaitCallback(nullptr);
+  }
+
+  template <typename Emit>
+  void Process(std::span<const TimedKeyEvent> events, Emit&& emit) {
+    for (const auto& event : events) {
+      time_us_ = event.time_us;
+      remapper_->Process(event.key_code, int(event.value));
+      TakeEmitted();
+    }
+    time_us_ = -1;
+    Send(emit);
+  }
+
+  // Also called by the remapper before a wait.
+  template <typename Emit>
+  void Flush(Emit&& emit) {
+    TakeEmitted();
+    time_us_ = -1;
+    Send(emit);
+  }
+
+  // Events before a wait must go out before it.
+  void BindFlush(std::function<void()> flush) {
+    remapper_->SetWaitCallback(flush);
+  }
+
+ private:
+  void TakeEmitted() {
+    if (remapper_->emitted().empty()) return;
+    const int64_t time_us = time_us_ >= 0 ? time_us_ : SteadyClockNowUs();
+    for (const auto& event : remapper_->emitted()) {
+      output_.push_back({event, time_us});
+    }
+    remapper_->ClearEmitted();
+  }
+
+  template <typename Emit>
+  void Send(Emit&& emit) {
+    if (output_.empty()) return;
+    emit(std::span<const TimedKeyEvent>(output_));
+    output_.clear();
+  }
+
+  RemapperType* remapper_;
+  // Time of the event being processed, or -1 outside of Process() and after a
+  // wait.
+  int64_t time_us_ = -1;
+  // Kept to not allocate per event.
+  std::vector<TimedKeyEvent> output_;
+};
+
+// Sends key events to the virtual device, through the KeyStateNormalizer.
+class KeyOutputSink {
+ public:
+  explicit KeyOutputSink(KeyStateNormalizer* key_output)
+      : key_output_(key_output) {}
+
+  void Process(std::span<const TimedKeyEvent> events) {
+    for (const auto& event : events) {
+      key_output_->KeyEvent(event.key_code, int(event.value));
+    }
+    key_output_->Flush();
+  }
+
+ private:
+  KeyStateNormalizer* key_output_;
+};
+
+// Prints key events, for --dry-run.
+class EchoSink {
+ public:
+  void Process(std::span<const TimedKeyEvent> events) {
+    for (const auto& event : events) {
+      std::cout << "  Out: ";
+      std::cout << (event.value == KeyEventType::kKeyPress     ? "P "
+                    : event.value == KeyEventType::kKeyRelease ? "R "
+                                                               : "T ")
+                << KeyCodeToName(event.key_code);
+      std::cout << std::endl;
+    }
+  }
+};
+
+#endif  // __PIPELINE_H
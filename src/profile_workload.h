@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __PROFILE_WORKLOAD_H
+#define __PROFILE_WORKLOAD_H
+
+// Workload shared by profile and compiled_benchmark, run on the config in
+// profile.keyshift. Works with Remapper and any CompiledRemapper.
+
+#include <linux/input-event-codes.h>
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+inline std::vector<std::string> ReadConfigLines(const std::string& path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    throw std::runtime_error("Could not open " + path);
+  }
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(file, line)) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// Returns the number of events processed.
+template <typename RemapperType>
+long RunProfileWorkload(RemapperType& remapper, int iterations) {
+  long num_events = 0;
+  for (int i = 0; i < iterations; ++i) {
+    for (int j = 0; j < 5; ++j) {
+      for (const int keycode :
+           {KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_1, KEY_2}) {
+        remapper.Process(keycode, 1);
+        remapper.Process(keycode, 2);
+        num_events += 2;
+      }
+    }
+    remapper.Process(KEY_LEFTSHIFT, 1);
+    for (const int keycode : {KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_1,
+                              KEY_2, KEY_ESC, KEY_X}) {
+      remapper.Process(keycode, 1);
+      remapper.Process(keycode, 2);
+      num_events += 2;
+    }
+    remapper.Process(KEY_LEFTSHIFT, 0);
+    num_events += 2;
+  }
+  return num_events;
+}
+
+#endif  // __PROFILE_WORKLOAD_H
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "read_error_breaker.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+ReadErrorBreaker::Decision ReadErrorBreaker::OnError(int error_number) {
+  ++consecutive_failures_;
+
+  switch (error_number) {
+    case ENODEV:
+      ++counters_.device_lost;
+      return Decision::kDeviceLost;
+
+    case EINTR:
+    case EAGAIN:
+      ++counters_.transient;
+      if (consecutive_failures_ <= kMaxConsecutiveTransientErrors) {
+        return Decision::kRetry;
+      }
+      // Too many in a row, treat as any other failure.
+      break;
+
+    case EBADF:
+    case EINVAL:
+    case EFAULT:
+      // The file descriptor itself is unusable, reading again cannot help.
+      if (consecutive_non_fatal_ == 0) {
+        std::cerr << "Read failed: " << strerror(error_number)
+                  << ", reopening (" << counters_ << ")" << std::endl;
+        ++counters_.non_fatal;
+        ++counters_.reopens;
+        ++consecutive_non_fatal_;
+        return Decision::kReopen;
+      }
+      // Reopening did not help, back off as usual.
+      break;
+  }
+
+  // Non-fatal, e.g. EIO or a short read.
+  ++counters_.non_fatal;
+  ++consecutive_non_fatal_;
+  if (consecutive_non_fatal_ % kReadErrorsBeforeReopen == 0) {
+    std::cerr << "Read failed " << consecutive_non_fatal_
+              << " times in a row, reopening (" << counters_ << ")"
+              << std::endl;
+    ++counters_.reopens;
+    return Decision::kReopen;
+  }
+  // Not reset on reopen, so that a device which keeps failing is retried less
+  // and less often.
+  const int exponent = std::min(consecutive_non_fatal_ - 1, 16);
+  backoff_ms_ = std::min(kReadErrorInitialBackoffMs << exponent,
+                         kReadErrorMaxBackoffMs);
+  // Only log once per streak, subsequent ones are in the counters.
+  if (consecutive_non_fatal_ == 1) {
+    std::cerr << "Read failed: "
+              << (error_number == 0 ? "short read" : strerror(error_number))
+              << ", backing off" << std::endl;
+  }
+  return Decision::kBackoff;
+}
+
+void ReadErrorBreaker::Recovered() {
+  if (consecutive_non_fatal_ > 0) {
+    std::cerr << "Reads recovered after " << consecutive_failures_
+              << " failure(s) (" << counters_ << ")" << std::endl;
+  }
+  consecutive_failures_ = 0;
+  consecutive_non_fatal_ = 0;
+  backoff_ms_ = 0;
+}
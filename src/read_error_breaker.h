@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __READ_ERROR_BREAKER_H
+#define __READ_ERROR_BREAKER_H
+
+// Decides what to do when reading from the keyboard fails.
+//
+// Some devices fail reads continuously. Retrying right away then spins the
+// main loop at 100% CPU. Instead, repeated failures are backed off
+// exponentially, and if they persist the device is reopened.
+
+#include <cstdint>
+#include <iostream>
+
+// Consecutive non-fatal failures after which the device is reopened.
+const int kReadErrorsBeforeReopen = 8;
+// Backoff starts at this, and doubles on every consecutive failure.
+const int kReadErrorInitialBackoffMs = 1;
+const int kReadErrorMaxBackoffMs = 1000;
+// Transient errors (e.g. EINTR) are retried right away, but only so many times
+// in a row.
+const int kMaxConsecutiveTransientErrors = 64;
+
+class ReadErrorBreaker {
+ public:
+  enum class Decision {
+    // Read again right away.
+    kRetry,
+    // Wait for backoff_ms() before reading again.
+    kBackoff,
+    // Close and open the device again.
+    kReopen,
+    // Device is gone, e.g. unplugged.
+    kDeviceLost,
+  };
+
+  struct Counters {
+    uint64_t transient = 0;
+    uint64_t non_fatal = 0;
+    uint64_t reopens = 0;
+    uint64_t device_lost = 0;
+
+    friend std::ostream& operator<<(std::ostream& os, const Counters& c) {
+      os << "transient=" << c.transient << " non_fatal=" << c.non_fatal
+         << " reopens=" << c.reopens << " device_lost=" << c.device_lost;
+      return os;
+    }
+  };
+
+  // Call on every failed read, with the errno. For a short read, pass 0.
+  Decision OnError(int error_number);
+
+  // Call on every successful read.
+  inline void OnSuccess() {
+    if (consecutive_failures_ != 0) [[unlikely]] {
+      Recovered();
+    }
+  }
+
+  // Valid after OnError() returned kBackoff.
+  int backoff_ms() const { return backoff_ms_; }
+
+  const Counters& counters() const { return counters_; }
+
+ private:
+  void Recovered();
+
+  // Both transient and non-fatal.
+  int consecutive_failures_ = 0;
+  int consecutive_non_fatal_ = 0;
+  int backoff_ms_ = 0;
+  Counters counters_;
+};
+
+#endif  // __READ_ERROR_BREAKER_H
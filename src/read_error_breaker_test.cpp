@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "read_error_breaker.h"
+
+#include <errno.h>
+
+#include <catch2/catch_test_macros.hpp>
+#include <vector>
+
+using Decision = ReadErrorBreaker::Decision;
+
+TEST_CASE("Device lost", "[read_error_breaker]") {
+  ReadErrorBreaker breaker;
+  CHECK(breaker.OnError(ENODEV) == Decision::kDeviceLost);
+  CHECK(breaker.counters().device_lost == 1);
+}
+
+TEST_CASE("Transient errors retry, but not forever", "[read_error_breaker]") {
+  ReadErrorBreaker breaker;
+  for (int i = 0; i < kMaxConsecutiveTransientErrors; ++i) {
+    REQUIRE(breaker.OnError(EINTR) == Decision::kRetry);
+  }
+  CHECK(breaker.OnError(EAGAIN) == Decision::kBackoff);
+  CHECK(breaker.counters().transient == kMaxConsecutiveTransientErrors + 1);
+}
+
+TEST_CASE("Backoff doubles, then reopens", "[read_error_breaker]") {
+  ReadErrorBreaker breaker;
+  std::vector<int> backoffs;
+  for (int i = 1; i < kReadErrorsBeforeReopen; ++i) {
+    REQUIRE(breaker.OnError(EIO) == Decision::kBackoff);
+    backoffs.push_back(breaker.backoff_ms());
+  }
+  CHECK(backoffs == std::vector<int>{1, 2, 4, 8, 16, 32, 64});
+  CHECK(breaker.OnError(EIO) == Decision::kReopen);
+  CHECK(breaker.counters().reopens == 1);
+
+  SECTION("Keeps backing off after reopen, up to the max") {
+    for (int i = 0; i < 5; ++i) {
+      REQUIRE(breaker.OnError(EIO) == Decision::kBackoff);
+    }
+    CHECK(breaker.backoff_ms() == kReadErrorMaxBackoffMs);
+  }
+
+  SECTION("Success resets the backoff") {
+    breaker.OnSuccess();
+    CHECK(breaker.OnError(EIO) == Decision::kBackoff);
+    CHECK(breaker.backoff_ms() == kReadErrorInitialBackoffMs);
+  }
+}
+
+TEST_CASE("Unusable file descriptor", "[read_error_breaker]") {
+  ReadErrorBreaker breaker;
+  CHECK(breaker.OnError(EBADF) == Decision::kReopen);
+  // If reopening does not help, do not reopen in a tight loop.
+  CHECK(breaker.OnError(EBADF) == Decision::kBackoff);
+}
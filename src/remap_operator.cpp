@@ -19,7 +19,9 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <bit>
 #include <chrono>
+#include <format>
 #include <functional>
 #include <iostream>
 #include <optional>
@@ -33,8 +35,7 @@
 
 #include "keycode_lookup.h"
 #include "utility/essentials.h"
-
-const std::string kKillCombo = "KEYSHIFTRESERVEDCMDKILL";
+#include "utility/trace_points.h"
 
 KeyEvent KeyPressEvent(int key_code) {
   return KeyEvent{key_code, KeyEventType::kKeyPress};
@@ -44,38 +45,50 @@ KeyEvent KeyReleaseEvent(int key_code) {
   return KeyEvent{key_code, KeyEventType::kKeyRelease};
 }
 
-Remapper::Remapper() {
+Remapper::Remapper() : mutable_config_(std::make_shared<CompiledConfig>()) {
+  config_ = mutable_config_;
   // Ensure "" has index 0.
   if (StateNameToIndex("") != 0) {
     // Should not happen!
     throw std::runtime_error("Could not assert first index to be 0");
   }
 
-  // StateNameToIndex("") should have added an element to all_states_.
-  // We will henceforth use all_state_[0] without checking.
-  if (all_states_.size() != 1) {
+  // StateNameToIndex("") should have added an element to states.
+  // We will henceforth use states[0] without checking.
+  if (config_->states.size() != 1) {
     // Should not happen!
-    throw std::runtime_error("Unexpected all_states_ init failure");
+    throw std::runtime_error("Unexpected states init failure");
   }
 
-  // Initialize kill combo keycodes from string.
-  for (const char c : kKillCombo) {
-    auto key_code = NameToKeyCode(std::string("KEY_") + c);
-    if (!key_code.has_value()) {
-      throw std::runtime_error("Cannot create combo for kKillCombo");
-    }
-    combo_kill_keycodes_.push_back(key_code.value());
+  // Sequence 0.
+  if (!AddSequence({KillComboKeyCodes(), {}})) {
+    // Should not happen!
+    throw std::runtime_error("Cannot create combo for kKillCombo");
   }
+  CompileSequences();
+}
+
+Remapper::Remapper(std::shared_ptr<const CompiledConfig> config) : Remapper() {
+  SetConfig(config);
 }
 
 void Remapper::SetCallback(std::function<void(int, int)> emit_key_code) {
   emit_key_code_ = emit_key_code;
 }
 
+void Remapper::SetWaitCallback(std::function<void()> before_wait) {
+  before_wait_ = before_wait;
+}
+
 // Default state_name is "".
 void Remapper::AddMapping(const std::string& state_name, KeyEvent key_event,
                           const std::vector<Action>& actions) {
-  auto& keyboard_state = all_states_[StateNameToIndex(state_name)];
+  AddMapping(StateNameToIndex(state_name), key_event, actions);
+}
+
+void Remapper::AddMapping(int state_index, KeyEvent key_event,
+                          const std::vector<Action>& actions) {
+  auto& keyboard_state = MutableConfig().states[state_index];
 
   // If exists, append. Else set.
   const auto it = keyboard_state.action_map.find(key_event);
@@ -86,72 +99,522 @@ void Remapper::AddMapping(const std::string& state_name, KeyEvent key_event,
   }
 }
 
+void Remapper::AddModifiedMapping(uint8_t modifiers, KeyEvent key_event,
+                                  const std::vector<Action>& actions) {
+  auto& config = MutableConfig();
+  // If exists, append, as for AddMapping().
+  auto& mapped =
+      config.modified_action_map[WithModifiers(key_event, modifiers)];
+  mapped.insert(mapped.end(), actions.begin(), actions.end());
+  config.modified_keys.set(key_event.key_code);
+}
+
 void Remapper::SetNullEventActions(const std::string& state_name,
                                    const std::vector<Action> actions) {
-  auto& keyboard_state = all_states_[StateNameToIndex(state_name)];
-  keyboard_state.null_event_actions = actions;
+  SetNullEventActions(StateNameToIndex(state_name), actions);
+}
+
+void Remapper::SetNullEventActions(int state_index,
+                                   const std::vector<Action> actions) {
+  MutableConfig().states[state_index].null_event_actions = actions;
 }
 
 void Remapper::SetAllowOtherKeys(const std::string& state_name,
                                  bool allow_other_keys) {
-  auto& keyboard_state = all_states_[StateNameToIndex(state_name)];
-  keyboard_state.allow_other_keys = allow_other_keys;
+  SetAllowOtherKeys(StateNameToIndex(state_name), allow_other_keys);
+}
+
+void Remapper::SetAllowOtherKeys(int state_index, bool allow_other_keys) {
+  MutableConfig().states[state_index].allow_other_keys = allow_other_keys;
+}
+
+int Remapper::LayerStateIndex(const std::vector<int>& layer_keys) {
+  if (layer_keys.empty()) return 0;
+  const auto it = config_->layer_states.find(layer_keys);
+  if (it != config_->layer_states.end()) return it->second;
+
+  auto& config = MutableConfig();
+  const int index = config.states.size();
+  config.states.push_back(KeyboardState{});
+  config.layer_states.emplace(layer_keys, index);
+  ResizeState();
+  return index;
+}
+
+void Remapper::CompileLayers() {
+  bool any_nested = false;
+  for (const auto& [layer_keys, _] : config_->layer_states) {
+    any_nested |= layer_keys.size() > 1;
+  }
+  if (!any_nested) return;
+
+  auto& config = MutableConfig();
+  // Layers come before the layers nested in them, so a parent is already
+  // merged with its own parent when it is merged into a nested layer.
+  for (const auto& [layer_keys, index] : config.layer_states) {
+    auto& state = config.states[index];
+    if (layer_keys.size() < 2 || !state.allow_other_keys) continue;
+    const std::vector<int> parent_keys(layer_keys.begin(),
+                                       layer_keys.end() - 1);
+    const auto& parent = config.states[config.layer_states.at(parent_keys)];
+    // Mappings of the nested layer come first. Its own layer keys are held,
+    // and deactivate it on release, so theirs would never be used.
+    for (const auto& [trigger, actions] : parent.action_map) {
+      if (std::find(layer_keys.begin(), layer_keys.end(), trigger.key_code) !=
+          layer_keys.end()) {
+        continue;
+      }
+      state.action_map.try_emplace(trigger, actions);
+    }
+    state.allow_other_keys = parent.allow_other_keys;
+  }
+}
+
+void Remapper::RemoveMapping(const std::string& state_name,
+                             KeyEvent key_event) {
+  MutableConfig().states[StateNameToIndex(state_name)].action_map.erase(
+      key_event);
+}
+
+ErrorStrOr<void> Remapper::AddChord(const Chord& chord) {
+  std::bitset<KEY_CNT> keys;
+  for (const int key_code : chord.keys) {
+    if (key_code < 0 || key_code >= KEY_CNT) {
+      return std::unexpected("Invalid key in chord.");
+    }
+    keys.set(key_code);
+  }
+  if (keys.count() < 2 || keys.count() != chord.keys.size()) {
+    return std::unexpected("A chord must have at least 2 different keys.");
+  }
+  auto& config = MutableConfig();
+  for (const auto& other : config.chords) {
+    std::bitset<KEY_CNT> other_keys;
+    for (const int key_code : other.keys) other_keys.set(key_code);
+    if (other_keys == keys) return std::unexpected("Chord is already defined.");
+  }
+  if (config.chords.size() >= kMaxChords) {
+    return std::unexpected(
+        std::format("Cannot have more than {} chords.", kMaxChords));
+  }
+  const uint64_t bit = uint64_t(1) << config.chords.size();
+  config.chords.push_back(chord);
+  for (const int key_code : chord.keys) config.chords_by_key[key_code] |= bit;
+  if (config.chords_by_size.size() <= chord.keys.size()) {
+    config.chords_by_size.resize(chord.keys.size() + 1, 0);
+  }
+  config.chords_by_size[chord.keys.size()] |= bit;
+  return {};
+}
+
+void Remapper::SetChordWindowMs(int window_ms) {
+  MutableConfig().chord_window_ms = window_ms;
+}
+
+ErrorStrOr<void> Remapper::AddSequence(const Sequence& sequence) {
+  auto& config = MutableConfig();
+  const int index = config.sequence_matcher.Add(sequence.keys);
+  if (index < 0) return std::unexpected("Sequence is already defined.");
+  config.sequences.push_back(sequence);
+  return {};
+}
+
+void Remapper::CompileSequences() {
+  MutableConfig().sequence_matcher.Build();
+}
+
+ActionText Remapper::AddText(std::vector<KeyEvent> key_events) {
+  auto& texts = MutableConfig().texts;
+  texts.push_back(std::move(key_events));
+  return ActionText{int(texts.size()) - 1};
+}
+
+void Remapper::SetTextPaceMs(int pace_ms) {
+  MutableConfig().text_pace_ms = pace_ms;
+}
+
+void Remapper::SetMouseKeys(const MouseKeysConfig& mouse_keys) {
+  MutableConfig().mouse_keys = mouse_keys;
 }
 
 ActionLayerChange Remapper::ActionActivateState(std::string state_name) {
-  return ActionLayerChange{StateNameToIndex(state_name)};
+  return ActionActivateState(StateNameToIndex(state_name));
+}
+
+ActionLayerChange Remapper::ActionActivateState(int state_index) {
+  return ActionLayerChange{state_index};
 }
 
-void Remapper::Process(const int key_code_int, const int value) {
+void Remapper::ProcessInput(const int key_code_int, const int value) {
+  TRACE_POINT(process_enter, key_code_int, value);
   const KeyEvent key_event{key_code_int, KeyEventType(value)};
-  currently_processing_ = key_event;
+  state_.currently_processing = key_event;
+  if (state_.fast_keys_held.any()) [[unlikely]] {
+    TakeOverFastKeysHeld();
+  }
+  if (key_code_int >= 0 && key_code_int < KEY_CNT) [[likely]] {
+    if (key_event.value == KeyEventType::kKeyPress) {
+      state_.input_pressed.set(key_code_int);
+      state_.modifiers |= ModifierBit(key_code_int);
+    } else if (key_event.value == KeyEventType::kKeyRelease) {
+      state_.input_pressed.reset(key_code_int);
+      state_.modifiers &= ~ModifierBit(key_code_int);
+    }
+  }
 
-  ProcessCombos(key_event);
-  // Check if key_event is in activated keyboard_state stack.
-  if (DeactivateLayerByKey(key_event)) [[unlikely]] {
-    return;
+  if (key_event.value == KeyEventType::kKeyRelease &&
+      !state_.autofires.empty()) [[unlikely]] {
+    StopAutofires([key_code_int](const RemapState::Autofire& autofire) {
+      return autofire.key_origin == key_code_int;
+    });
+  }
+  if (key_event.value == KeyEventType::kKeyRelease && MouseKeysMoving())
+      [[unlikely]] {
+    StopMouseKeys([key_code_int](int key_origin, int) {
+      return key_origin == key_code_int;
+    });
   }
 
-  const auto& actions = ExpandToActions(key_event);
+  const int sequence = ProcessSequences(key_event);
+  // Sequence 0 is the kill combo, which has no actions.
+  if (!config_->chords.empty() || config_->sequences.size() > 1) [[unlikely]] {
+    if (ProcessChordsAndSequences(key_event, sequence)) {
+      TRACE_POINT(process_exit, key_code_int, value);
+      return;
+    }
+    // Keys held back for a chord may have been processed meanwhile.
+    state_.currently_processing = key_event;
+  }
+  ProcessEvent(key_event);
+  TRACE_POINT(process_exit, key_code_int, value);
+}
 
-  if (!actions.empty()) {
-    // Since a key was pressed, null event will not be triggered on
-    // deactivation.
-    active_state().null_event_applicable = false;
+// When the autofire presses or releases its key next.
+static int64_t AutofireDeadlineUs(const RemapState::Autofire& autofire) {
+  return autofire.start_us + autofire.ticks * autofire.period_us / 2;
+}
 
-    ProcessActions(actions);
+int64_t Remapper::NextTimerUs() const {
+  int64_t next_us = -1;
+  const auto until = [&next_us](int64_t deadline_us) {
+    if (next_us < 0 || deadline_us < next_us) next_us = deadline_us;
+  };
+  if (!state_.chords.buffer.empty()) {
+    until(state_.chords.start_us + int64_t(config_->chord_window_ms) * 1000);
+  }
+  if (!state_.text.pending.empty()) until(state_.text.next_us);
+  for (const auto& autofire : state_.autofires) {
+    until(AutofireDeadlineUs(autofire));
   }
+  if (MouseKeysMoving()) {
+    until(state_.mouse_keys->NextStepUs(config_->mouse_keys));
+  }
+  return next_us;
+}
 
-  // If a key is released which is not processed otherwise, still send the
-  // release event. This resolves Issue #5.
-  if (key_event.value == KeyEventType::kKeyRelease &&
-      MapContains(keys_held_, key_event.key_code)) {
-    ProcessActions({KeyReleaseEvent(key_event.key_code)});
+void Remapper::RunTimers(int64_t now_us) {
+  if (!state_.chords.buffer.empty() &&
+      now_us - state_.chords.start_us >=
+          int64_t(config_->chord_window_ms) * 1000) {
+    ResolveChordBuffer(now_us);
+  }
+  if (!state_.text.pending.empty() && state_.text.next_us <= now_us) {
+    TypeText(now_us);
+  }
+  if (!state_.autofires.empty()) RunAutofires(now_us);
+  if (MouseKeysMoving()) state_.mouse_keys->Run(now_us, config_->mouse_keys);
+  // Chords resolved above may switch.
+  if (state_.pending_profile >= 0) [[unlikely]] {
+    SwitchProfile(state_.pending_profile);
+  }
+}
+
+void Remapper::UpdatePassthroughKeys() {
+  auto& config = MutableConfig();
+  auto& passthrough_keys = config.passthrough_keys;
+  passthrough_keys.reset();
+  // Everything would need to be blocked.
+  if (!config.states[0].allow_other_keys) return;
+  passthrough_keys.set();
+  const auto exclude = [&passthrough_keys](int key_code) {
+    if (key_code >= 0 && key_code < KEY_CNT) passthrough_keys.reset(key_code);
+  };
+  const auto exclude_actions = [&exclude](const std::vector<Action>& actions) {
+    for (const auto& action : actions) {
+      if (std::holds_alternative<KeyEvent>(action)) {
+        exclude(std::get<KeyEvent>(action).key_code);
+      }
+    }
+  };
+  // Keys used as outputs are excluded too, so that keys_held never needs to
+  // know about a key pressed on the fast path.
+  for (const auto& state : config.states) {
+    for (const auto& [trigger, actions] : state.action_map) {
+      exclude(trigger.key_code);
+      exclude_actions(actions);
+    }
+    exclude_actions(state.null_event_actions);
+  }
+  for (const auto& [_, actions] : config.modified_action_map) {
+    exclude_actions(actions);
+  }
+  passthrough_keys &= ~config.modified_keys;
+  for (const auto& chord : config.chords) {
+    for (const int key_code : chord.keys) exclude(key_code);
+    exclude_actions(chord.press_actions);
+    exclude_actions(chord.release_actions);
+  }
+  // The last key of a sequence may be replaced by its actions. Other keys in
+  // sequences can be passed through, as they are matched in ProcessFast().
+  for (std::size_t index = 1; index < config.sequences.size(); ++index) {
+    exclude(config.sequences[index].keys.back());
+    exclude_actions(config.sequences[index].actions);
+  }
+  for (const auto& text : config.texts) {
+    for (const auto& key_event : text) exclude(key_event.key_code);
+  }
+  for (const auto& state : config.states) {
+    for (const auto& [_, actions] : state.action_map) {
+      for (const auto& action : actions) {
+        if (std::holds_alternative<ActionAutofire>(action)) {
+          exclude(std::get<ActionAutofire>(action).key_code);
+        }
+      }
+    }
+  }
+}
+
+void Remapper::AdoptHeldKeys(const std::vector<int>& key_codes) {
+  for (const int key_code : key_codes) {
+    if (MapContains(state_.keys_held, key_code)) continue;
+    // Origin is the key itself, same as for any key passed through.
+    state_.keys_held[key_code] =
+        RemapState::KeyHeldInfo{key_code, state_.event_seq_num++};
+    if (key_code >= 0 && key_code < KEY_CNT) {
+      state_.input_pressed.set(key_code);
+    }
+    state_.modifiers |= ModifierBit(key_code);
+    EmitKeyCode(KeyPressEvent(key_code));
+  }
+}
+
+void Remapper::ReleaseAll() {
+  TakeOverFastKeysHeld();
+  StopAutofires([](const RemapState::Autofire&) { return true; });
+  StopMouseKeys([](int, int) { return true; });
+  auto& active_layers = state_.active_layers;
+  while (!active_layers.empty()) {
+    const int state_index = active_layers.back().state_index;
+    TRACE_POINT(layer_deactivate, state_index, int(active_layers.size()),
+                active_layers.back().key_event.key_code);
+    state_.layers[state_index].is_active = false;
+    active_layers.pop_back();
+  }
+  // Release in reverse order of pressing.
+  std::vector<std::pair<int, int>> held_keys;
+  for (const auto& [key_code, info] : state_.keys_held) {
+    held_keys.push_back({info.event_seq_num, key_code});
+  }
+  std::sort(held_keys.rbegin(), held_keys.rend());
+  state_.keys_held.clear();
+  state_.input_pressed.reset();
+  state_.modifiers = 0;
+  state_.modified_keys_pressed.clear();
+  // Keys held back for a chord were never sent. Texts stop between
+  // characters, with no key pressed.
+  state_.chords = RemapState::ChordState{};
+  state_.text = RemapState::TextState{};
+  for (const auto& [_, key_code] : held_keys) {
+    EmitKeyCode(KeyReleaseEvent(key_code));
+  }
+  state_.sequence_state = SequenceMatcher::kStart;
+  state_.keys_consumed.clear();
+}
+
+int Remapper::Reconcile(const std::bitset<KEY_CNT>& keyboard_pressed) {
+  const auto seen = state_.input_pressed | state_.fast_keys_held;
+  const auto missed_releases = seen & ~keyboard_pressed;
+  const auto missed_presses = keyboard_pressed & ~seen;
+  if (missed_releases.none() && missed_presses.none()) [[likely]] {
+    return 0;
+  }
+  for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+    if (missed_releases.test(key_code)) Process(key_code, 0);
+  }
+  for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+    if (missed_presses.test(key_code)) Process(key_code, 1);
+  }
+  return missed_releases.count() + missed_presses.count();
+}
+
+std::bitset<KEY_CNT> Remapper::HeldKeys() const {
+  auto held = state_.fast_keys_held;
+  for (const auto& [key_code, _] : state_.keys_held) {
+    if (key_code >= 0 && key_code < KEY_CNT) held.set(key_code);
+  }
+  for (const auto& autofire : state_.autofires) {
+    // Pressed last, if an odd number of ticks is done.
+    if (autofire.ticks % 2 == 1) held.set(autofire.key_code);
   }
+  return held;
+}
+
+std::vector<int> Remapper::ActiveLayerKeys() const {
+  std::vector<int> key_codes;
+  for (const auto& layer : state_.active_layers) {
+    key_codes.push_back(layer.key_event.key_code);
+  }
+  return key_codes;
+}
+
+bool Remapper::UsesMouseKeys() const {
+  const auto uses = [](const std::vector<Action>& actions) {
+    for (const auto& action : actions) {
+      if (std::holds_alternative<ActionMouseKey>(action)) return true;
+      if (std::holds_alternative<KeyEvent>(action)) {
+        const int key_code = std::get<KeyEvent>(action).key_code;
+        if (key_code >= BTN_MOUSE && key_code < BTN_JOYSTICK) return true;
+      }
+    }
+    return false;
+  };
+  for (const auto& state : config_->states) {
+    for (const auto& [_, actions] : state.action_map) {
+      if (uses(actions)) return true;
+    }
+    if (uses(state.null_event_actions)) return true;
+  }
+  for (const auto& [_, actions] : config_->modified_action_map) {
+    if (uses(actions)) return true;
+  }
+  for (const auto& chord : config_->chords) {
+    if (uses(chord.press_actions) || uses(chord.release_actions)) return true;
+  }
+  for (const auto& sequence : config_->sequences) {
+    if (uses(sequence.actions)) return true;
+  }
+  return false;
+}
+
+void Remapper::SetConfig(std::shared_ptr<const CompiledConfig> config) {
+  ReleaseAll();
+  config_ = config;
+  mutable_config_ = nullptr;
+  ResizeState();
+}
+
+void Remapper::SwitchConfig(std::shared_ptr<const CompiledConfig> config) {
+  TakeOverFastKeysHeld();
+  StopAutofires([](const RemapState::Autofire&) { return true; });
+  StopMouseKeys([](int, int) { return true; });
+  // State indices are only meaningful in this config.
+  auto& active_layers = state_.active_layers;
+  while (!active_layers.empty()) {
+    const int state_index = active_layers.back().state_index;
+    TRACE_POINT(layer_deactivate, state_index, int(active_layers.size()),
+                active_layers.back().key_event.key_code);
+    state_.layers[state_index].is_active = false;
+    active_layers.pop_back();
+  }
+  // Release keys which the new config might not, in reverse order of pressing.
+  std::vector<std::pair<int, int>> released;
+  auto& keys_held = state_.keys_held;
+  for (auto it = keys_held.begin(); it != keys_held.end();) {
+    const int key_code = it->first;
+    if (it->second.key_origin == key_code && key_code >= 0 &&
+        key_code < KEY_CNT && state_.input_pressed.test(key_code)) {
+      ++it;
+    } else {
+      released.push_back({it->second.event_seq_num, key_code});
+      it = keys_held.erase(it);
+    }
+  }
+  std::sort(released.rbegin(), released.rend());
+  for (const auto& [_, key_code] : released) {
+    EmitKeyCode(KeyReleaseEvent(key_code));
+  }
+  state_.chords = RemapState::ChordState{};
+  state_.text = RemapState::TextState{};
+  state_.sequence_state = SequenceMatcher::kStart;
+  state_.keys_consumed.clear();
+  state_.modified_keys_pressed.clear();
+
+  config_ = config;
+  mutable_config_ = nullptr;
+  ResizeState();
+}
+
+void Remapper::SetProfiles(std::vector<Profile> profiles, int profile) {
+  profiles_ = std::move(profiles);
+  profile_ = profile;
+  state_.pending_profile = -1;
+}
+
+void Remapper::SwitchProfile(int profile_index) {
+  state_.pending_profile = -1;
+  if (profile_index < 0 || profile_index >= int(profiles_.size()) ||
+      profile_index == profile_) {
+    return;
+  }
+  TRACE_POINT(profile_switch, profile_, profile_index);
+  profile_ = profile_index;
+  SwitchConfig(profiles_[profile_index].config);
+}
+
+const std::string& Remapper::profile_name() const {
+  static const std::string kNoProfile;
+  return profiles_.empty() ? kNoProfile : profiles_[profile_].name;
+}
+
+int Remapper::ProfileIndex(const std::string& name) const {
+  for (std::size_t index = 0; index < profiles_.size(); ++index) {
+    if (profiles_[index].name == name) return index;
+  }
+  return -1;
 }
 
 void Remapper::DumpConfig(std::ostream& os) const {
-  for (std::size_t state_id = 0; state_id < all_states_.size(); ++state_id) {
-    const auto& state = all_states_[state_id];
+  const auto ShowActions = [this, &os](const std::vector<Action>& actions) {
+    for (const auto& action : actions) {
+      if (std::holds_alternative<KeyEvent>(action)) {
+        const auto& key_event = std::get<KeyEvent>(action);
+        os << "    Key: " << key_event << std::endl;
+      } else if (std::holds_alternative<ActionWait>(action)) {
+        const auto& wait = std::get<ActionWait>(action);
+        os << "    Wait: " << wait.milli_seconds << "ms" << std::endl;
+      } else if (std::holds_alternative<ActionLayerChange>(action)) {
+        const auto& layer_change = std::get<ActionLayerChange>(action);
+        os << "    Layer Change: " << layer_change.layer_index << std::endl;
+      } else if (std::holds_alternative<ActionText>(action)) {
+        const int text_index = std::get<ActionText>(action).text_index;
+        os << "    Text:";
+        for (const auto& key_event : config_->texts[text_index]) {
+          if (key_event.value == KeyEventType::kKeyPress) {
+            os << " " << KeyCodeToName(key_event.key_code);
+          }
+        }
+        os << std::endl;
+      } else if (std::holds_alternative<ActionAutofire>(action)) {
+        const auto& autofire = std::get<ActionAutofire>(action);
+        os << "    Autofire: " << KeyCodeToName(autofire.key_code) << " at "
+           << 1000000 / autofire.period_us << "Hz" << std::endl;
+      } else if (std::holds_alternative<ActionMouseKey>(action)) {
+        const auto direction = std::get<ActionMouseKey>(action).direction;
+        os << "    Mouse key: " << kMouseKeyNames[int(direction)] << std::endl;
+      } else if (std::holds_alternative<ActionSwitchProfile>(action)) {
+        const auto& switch_profile = std::get<ActionSwitchProfile>(action);
+        os << "    Profile: " << switch_profile.profile_index << std::endl;
+      } else {
+        std::cerr << "WARNING: Unknown action." << std::endl;
+      }
+    }
+  };
+  const auto& states = config_->states;
+  for (std::size_t state_id = 0; state_id < states.size(); ++state_id) {
+    const auto& state = states[state_id];
     os << "State #" << state_id << std::endl;
     os << "  Other keys: " << (state.allow_other_keys ? "Allow" : "Block")
        << std::endl;
-    const auto ShowActions = [&os](const std::vector<Action>& actions) {
-      for (const auto& action : actions) {
-        if (std::holds_alternative<KeyEvent>(action)) {
-          const auto& key_event = std::get<KeyEvent>(action);
-          os << "    Key: " << key_event << std::endl;
-        } else if (std::holds_alternative<ActionWait>(action)) {
-          const auto& wait = std::get<ActionWait>(action);
-          os << "    Wait: " << wait.milli_seconds << "ms" << std::endl;
-        } else if (std::holds_alternative<ActionLayerChange>(action)) {
-          const auto& layer_change = std::get<ActionLayerChange>(action);
-          os << "    Layer Change: " << layer_change.layer_index << std::endl;
-        } else {
-          std::cerr << "WARNING: Unknown action." << std::endl;
-        }
-      }
-    };
     for (const auto& [trigger, actions] : state.action_map) {
       os << "  On: " << trigger << std::endl;
       ShowActions(actions);
@@ -161,29 +624,84 @@ void Remapper::DumpConfig(std::ostream& os) const {
       ShowActions(state.null_event_actions);
     }
   }
+  for (const auto& [trigger, actions] : config_->modified_action_map) {
+    os << "Modifiers";
+    for (int bit = 0; bit < 8; ++bit) {
+      if (ModifiersOf(trigger) & (1 << bit)) os << " " << kModifierNames[bit];
+    }
+    os << std::endl << "  On: " << WithoutModifiers(trigger) << std::endl;
+    ShowActions(actions);
+  }
+  for (const auto& chord : config_->chords) {
+    os << "Chord";
+    for (const int key_code : chord.keys) os << " " << KeyCodeToName(key_code);
+    os << std::endl << "  On press:" << std::endl;
+    ShowActions(chord.press_actions);
+    os << "  On release:" << std::endl;
+    ShowActions(chord.release_actions);
+  }
+  if (!config_->chords.empty()) {
+    os << "Chord window: " << config_->chord_window_ms << "ms" << std::endl;
+  }
+  for (std::size_t index = 1; index < config_->sequences.size(); ++index) {
+    const auto& sequence = config_->sequences[index];
+    os << "Sequence";
+    for (const int key_code : sequence.keys) {
+      os << " " << KeyCodeToName(key_code);
+    }
+    os << std::endl;
+    ShowActions(sequence.actions);
+  }
+  if (config_->text_pace_ms > 0) {
+    os << "Text pace: " << config_->text_pace_ms << "ms" << std::endl;
+  }
+  if (UsesMouseKeys()) {
+    const auto& mouse_keys = config_->mouse_keys;
+    os << "Mouse keys: " << mouse_keys.rate_hz << "Hz, up to "
+       << mouse_keys.max_speed << " pixels/s after " << mouse_keys.accel_ms
+       << "ms" << std::endl;
+  }
 }
 
 // PRIVATE
 
+CompiledConfig& Remapper::MutableConfig() {
+  // Copy on write. Other than here, mutable_config_ is only held by config_.
+  if (mutable_config_ == nullptr || mutable_config_.use_count() > 2) {
+    mutable_config_ = std::make_shared<CompiledConfig>(*config_);
+    config_ = mutable_config_;
+  }
+  return *mutable_config_;
+}
+
 // Finds index of keyboard_state name. If it doesn't exist, adds it.
 // This function should be used only to set up, and should not be called during
 // operation.
 int Remapper::StateNameToIndex(const std::string& state_name) {
-  const auto result = MapLookup(state_name_to_index_, state_name);
+  const auto result = MapLookup(config_->state_name_to_index, state_name);
   if (result.has_value()) return *result;
 
-  const int index = state_name_to_index_.size();
-  all_states_.push_back(KeyboardState{});
-  state_name_to_index_.emplace(state_name, index);
+  auto& config = MutableConfig();
+  // Layers from LayerStateIndex() have no name.
+  const int index = config.states.size();
+  config.states.push_back(KeyboardState{});
+  config.state_name_to_index.emplace(state_name, index);
+  ResizeState();
   return index;
 }
 
+void Remapper::ResizeState() {
+  state_.layers.resize(config_->states.size());
+}
+
 void Remapper::EmitKeyCode(const KeyEvent& key_event) {
   // std::cout << "Emit "
   //           << (key_event.value == KeyEventType::kKeyPress ? "P" : "R")
   //           << key_event.key_code << std::endl;
   if (emit_key_code_ != nullptr) {
     emit_key_code_(key_event.key_code, int(key_event.value));
+  } else {
+    emitted_.push_back(key_event);
   }
 }
 
@@ -191,15 +709,13 @@ void Remapper::EmitKeyCode(const KeyEvent& key_event) {
 // deactivate it.
 bool Remapper::DeactivateLayerByKey(const KeyEvent& key_event) {
   if (key_event.value != KeyEventType::kKeyRelease) return false;
-  if (active_layers_.empty()) return false;
+  const auto& active_layers = state_.active_layers;
+  if (active_layers.empty()) return false;
 
-  for (std::size_t layer_index = 0; layer_index < active_layers_.size();
+  for (std::size_t layer_index = 0; layer_index < active_layers.size();
        ++layer_index) {
-    // for (int layer_index = active_layers_.size() - 1; layer_index >= 0;
-    //      --layer_index) {
-    auto layer_to_deactivate = active_layers_[layer_index];
-    if (layer_to_deactivate.key_event.key_code == key_event.key_code) {
-      int num_layers_to_deactivate = active_layers_.size() - layer_index;
+    if (active_layers[layer_index].key_event.key_code == key_event.key_code) {
+      int num_layers_to_deactivate = active_layers.size() - layer_index;
       DeactivateNLayers(num_layers_to_deactivate);
       ProcessKeyEvent(key_event);
       return true;
@@ -210,28 +726,37 @@ bool Remapper::DeactivateLayerByKey(const KeyEvent& key_event) {
 
 void Remapper::DeactivateNLayers(const int n) {
   for (int deactivate_count = 0; deactivate_count < n; ++deactivate_count) {
-    if (active_layers_.empty()) {
+    auto& active_layers = state_.active_layers;
+    if (active_layers.empty()) {
       std::cerr << "WARNING: Trying to deactivate when no layer is active."
                 << std::endl;
       return;
     }
-    auto& layer_to_deactivate = active_layers_.back();
+    const int state_index = active_layers.back().state_index;
+    // Get all the currently pressed keys after this was activated.
+    const int threshold = active_layers.back().event_seq_num;
 
-    auto& state_to_deactivate = layer_to_deactivate.this_state;
-    state_to_deactivate->deactivate();
-    if (state_to_deactivate->null_event_applicable) {
-      ProcessActions(state_to_deactivate->null_event_actions);
+    TRACE_POINT(layer_deactivate, state_index, int(active_layers.size()),
+                active_layers.back().key_event.key_code);
+    state_.layers[state_index].is_active = false;
+    StopAutofires([threshold](const RemapState::Autofire& autofire) {
+      return autofire.event_seq_num > threshold;
+    });
+    StopMouseKeys([threshold](int, int event_seq_num) {
+      return event_seq_num > threshold;
+    });
+    if (state_.layers[state_index].null_event_applicable) {
+      ProcessActions(config_->states[state_index].null_event_actions);
     }
-    // Get all the currently pressed keys after this was activated.
-    const int threshold = layer_to_deactivate.event_seq_num;
     // Key Code to Event Sequence Number.
     std::vector<std::pair<int, int>> removed_keys;
     // Erase keys held after the layer was activated.
-    for (auto it = keys_held_.begin(); it != keys_held_.end();) {
+    auto& keys_held = state_.keys_held;
+    for (auto it = keys_held.begin(); it != keys_held.end();) {
       if (it->second.event_seq_num > threshold &&
           it->second.key_origin != it->first) {
         removed_keys.push_back({it->first, it->second.event_seq_num});
-        it = keys_held_.erase(it);
+        it = keys_held.erase(it);
       } else {
         ++it;
       }
@@ -249,29 +774,29 @@ void Remapper::DeactivateNLayers(const int n) {
       EmitKeyCode({it->first, KeyEventType::kKeyRelease});
     }
     // Done at the very end because .pop_back() invalidates .back().
-    active_layers_.pop_back();
+    active_layers.pop_back();
   }
 }
 
 void Remapper::ProcessKeyEvent(const KeyEvent& key_event) {
   if (key_event.value == KeyEventType::kKeyPress) {
-    keys_held_[key_event.key_code] =
-        KeyHeldInfo{currently_processing_.key_code, event_seq_num_++};
+    state_.keys_held[key_event.key_code] = RemapState::KeyHeldInfo{
+        state_.currently_processing.key_code, state_.event_seq_num++};
     EmitKeyCode(key_event);
   } else if (key_event.value == KeyEventType::kKeyRepeat) {
     // If the repeating key was used to activate a layer, do nothing.
-    for (const auto& layer : active_layers_) {
+    for (const auto& layer : state_.active_layers) {
       if (layer.key_event.key_code == key_event.key_code) return;
     }
     // Else, emit the key.
     EmitKeyCode(key_event);
   } else if (key_event.value == KeyEventType::kKeyRelease) {
-    if (!MapContains(keys_held_, key_event.key_code)) {
+    if (!MapContains(state_.keys_held, key_event.key_code)) {
       // This key is not actually held. This is normal, and can happen when a
       // lead key is released if it was not set up to register a press.
       return;
     }
-    keys_held_.erase(key_event.key_code);
+    state_.keys_held.erase(key_event.key_code);
     EmitKeyCode(key_event);
   } else {
     std::cerr << "WARNING: Unimplemented key code value "
@@ -281,47 +806,53 @@ void Remapper::ProcessKeyEvent(const KeyEvent& key_event) {
 }
 
 // Responsible for mapping user-input to desired outcome actions.
+// Finds the actions for key_event in the map. Returns false if there are none.
+static bool FindActions(const ActionMap& action_map, const KeyEvent& key_event,
+                        std::vector<Action>& result) {
+  const auto it = action_map.find(key_event);
+  if (it != action_map.end()) {
+    // Return the remapped actions.
+    result = it->second;
+    return true;
+  }
+
+  // If it's a repeat, it must be treated similar to release.
+  // Not press, since press can do multiple things; release is simpler.
+  // So we search for release events, but modify the output to repeat.
+  if (key_event.value == KeyEventType::kKeyRepeat) {
+    KeyEvent key_event_as_release = key_event;
+    key_event_as_release.value = KeyEventType::kKeyRelease;
+    const auto it = action_map.find(key_event_as_release);
+    if (it != action_map.end()) {
+      for (auto action : it->second) {
+        if (std::holds_alternative<KeyEvent>(action)) {
+          KeyEvent new_action = std::get<KeyEvent>(action);
+
+          // Move ahead only if the mapped event is release.
+          if (new_action.value != KeyEventType::kKeyRelease) continue;
+
+          // Change it to repeat, and emit.
+          new_action.value = KeyEventType::kKeyRepeat;
+          result.push_back(new_action);
+          // Note: It's kind of ambiguous what happens if release does
+          // multiple things. To break this ambiguity, we just repeat the
+          // first release action.
+          break;
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
 const std::vector<Action> Remapper::ExpandToActions(
     const KeyEvent& key_event) const {
   std::vector<Action> result;
   // Returns true if a decision is reached and no more KeyboardState needs to be
   // examined.
   const auto operate = [&key_event, &result](const KeyboardState& this_state) {
-    const auto it = this_state.action_map.find(key_event);
-    if (it != this_state.action_map.end()) {
-      // Return the remapped actions.
-      result = it->second;
-      return true;
-    }
-
-    // If it's a repeat, it must be treated similar to release.
-    // Not press, since press can do multiple things; release is simpler.
-    // So we search for release events, but modify the output to repeat.
-    if (key_event.value == KeyEventType::kKeyRepeat) {
-      KeyEvent key_event_as_release = key_event;
-      key_event_as_release.value = KeyEventType::kKeyRelease;
-      const auto it = this_state.action_map.find(key_event_as_release);
-      if (it != this_state.action_map.end()) {
-        std::cout << "Found " << key_event_as_release << std::endl;
-        for (auto action : it->second) {
-          if (std::holds_alternative<KeyEvent>(action)) {
-            KeyEvent new_action = std::get<KeyEvent>(action);
-
-            // Move ahead only if the mapped event is release.
-            if (new_action.value != KeyEventType::kKeyRelease) continue;
-
-            // Change it to repeat, and emit.
-            new_action.value = KeyEventType::kKeyRepeat;
-            result.push_back(new_action);
-            // Note: It's kind of ambiguous what happens if release does
-            // multiple things. To break this ambiguity, we just repeat the
-            // first release action.
-            break;
-          }
-        }
-        return true;
-      }
-    }
+    if (FindActions(this_state.action_map, key_event, result)) return true;
 
     // Not remapped but all other keys not allowed.
     if (!this_state.allow_other_keys) {
@@ -331,13 +862,35 @@ const std::vector<Action> Remapper::ExpandToActions(
     return false;
   };
 
-  // Iterate: active_layers_.reverse() + {default_state_}.
-  for (auto it = active_layers_.rbegin(); it != active_layers_.rend(); ++it) {
-    if (operate(*it->this_state)) return result;
+  // Iterate: active_layers.reverse() + {states[0]}.
+  const auto& states = config_->states;
+  const auto& active_layers = state_.active_layers;
+  for (auto it = active_layers.rbegin(); it != active_layers.rend(); ++it) {
+    if (operate(states[it->state_index])) {
+      TRACE_POINT(expand, key_event.key_code, int(key_event.value),
+                  it->state_index, int(result.size()));
+      return result;
+    }
+  }
+  // Modifier conditions, as if in the default state.
+  const int key_code = key_event.key_code;
+  if (key_code >= 0 && key_code < KEY_CNT &&
+      config_->modified_keys.test(key_code) &&
+      FindActions(config_->modified_action_map,
+                  WithModifiers(key_event, PressModifiers(key_code)),
+                  result)) {
+    TRACE_POINT(expand, key_event.key_code, int(key_event.value), 0,
+                int(result.size()));
+    return result;
+  }
+  if (operate(states[0])) {
+    TRACE_POINT(expand, key_event.key_code, int(key_event.value), 0,
+                int(result.size()));
+    return result;
   }
-  if (operate(all_states_[0])) return result;
 
   // Nothing matched or blocked.
+  TRACE_POINT(expand, key_event.key_code, int(key_event.value), -1, 1);
   return {key_event};
 }
 
@@ -347,36 +900,300 @@ void Remapper::ProcessActions(const std::vector<Action>& actions) {
       ProcessKeyEvent(std::get<KeyEvent>(action));
     } else if (std::holds_alternative<ActionWait>(action)) {
       const auto& wait = std::get<ActionWait>(action);
+      if (before_wait_ != nullptr) before_wait_();
       std::this_thread::sleep_for(
           std::chrono::milliseconds(wait.milli_seconds));
     } else if (std::holds_alternative<ActionLayerChange>(action)) {
       const auto& layer_change = std::get<ActionLayerChange>(action);
-      if (layer_change.layer_index < (int)all_states_.size()) {
-        auto* new_state = &all_states_[layer_change.layer_index];
-        if (new_state->activate()) {
-          active_layers_.push_back(LayerActivation{
-              event_seq_num_++, currently_processing_, new_state});
+      const int state_index = layer_change.layer_index;
+      if (state_index < (int)config_->states.size()) {
+        if (state_.layers[state_index].is_active) {
+          std::cerr << "WARNING: Attempt to activate an already active layer. "
+                       "Denied."
+                    << std::endl;
+        } else {
+          state_.layers[state_index].is_active = true;
+          state_.layers[state_index].null_event_applicable = true;
+          state_.active_layers.push_back(RemapState::LayerActivation{
+              state_.event_seq_num++, state_.currently_processing,
+              state_index});
+          TRACE_POINT(layer_activate, state_index,
+                      int(state_.active_layers.size()),
+                      state_.currently_processing.key_code);
         }
       } else {
         std::cerr << "WARNING: Invalid keyboard_state code. This is "
                      "unexpected, please report a bug."
                   << std::endl;
       }
+    } else if (std::holds_alternative<ActionText>(action)) {
+      auto& pending = state_.text.pending;
+      pending.push_back(std::get<ActionText>(action).text_index);
+      // Else it follows the texts being typed.
+      if (pending.size() == 1) TypeText(SteadyClockNowUs());
+    } else if (std::holds_alternative<ActionAutofire>(action)) {
+      const auto& autofire = std::get<ActionAutofire>(action);
+      const int key_origin = state_.currently_processing.key_code;
+      // If the release of the input key was missed, starts over.
+      StopAutofires([&](const RemapState::Autofire& other) {
+        return other.key_origin == key_origin &&
+               other.key_code == autofire.key_code;
+      });
+      state_.autofires.push_back(RemapState::Autofire{
+          key_origin, autofire.key_code, autofire.period_us,
+          state_.event_seq_num++, SteadyClockNowUs(), 0});
+      // Pressed right away.
+      RunAutofires(state_.autofires.back().start_us);
+    } else if (std::holds_alternative<ActionMouseKey>(action)) {
+      if (!state_.mouse_keys) state_.mouse_keys = std::make_unique<MouseKeys>();
+      state_.mouse_keys->Start(std::get<ActionMouseKey>(action).direction,
+                               state_.currently_processing.key_code,
+                               state_.event_seq_num++, SteadyClockNowUs());
+    } else if (std::holds_alternative<ActionSwitchProfile>(action)) {
+      // Switching now would change the config under the actions being done.
+      state_.pending_profile =
+          std::get<ActionSwitchProfile>(action).profile_index;
     } else {
       std::cerr << "WARNING: Unknown action." << std::endl;
     }
   }
 }
 
-// Keep track of the special combination to kill the program.
-void Remapper::ProcessCombos(const KeyEvent& key_event) {
-  if (key_event.value != KeyEventType::kKeyPress) return;
-  if (key_event.key_code == combo_kill_keycodes_[combo_kill_progress_])
-      [[unlikely]] {
-    if (++combo_kill_progress_ >= combo_kill_keycodes_.size()) {
-      throw std::runtime_error("Kill combo accepted.");
+void Remapper::TypeText(int64_t now_us) {
+  auto& text = state_.text;
+  const int pace_ms = config_->text_pace_ms;
+  int chars_left = pace_ms > 0 ? 1 : kTextBurstChars;
+  // A Shift held already, e.g. by the user, is left alone. The text's release
+  // would release it on the output, while it is still held.
+  const bool shift_held = HeldKeys().test(KEY_LEFTSHIFT);
+  while (!text.pending.empty()) {
+    if (chars_left == 0) {
+      const int gap_ms = pace_ms > 0 ? pace_ms : kTextBurstGapMs;
+      text.next_us = now_us + int64_t(gap_ms) * 1000;
+      return;
+    }
+    const auto& key_events = config_->texts[text.pending.front()];
+    // A character ends when no key is pressed.
+    int pressed = 0;
+    while (text.next_key < int(key_events.size()) && chars_left > 0) {
+      const KeyEvent& key_event = key_events[text.next_key++];
+      if (!shift_held || key_event.key_code != KEY_LEFTSHIFT) {
+        EmitKeyCode(key_event);
+      }
+      pressed += key_event.value == KeyEventType::kKeyPress ? 1 : -1;
+      if (pressed == 0) --chars_left;
     }
-  } else [[likely]] {
-    combo_kill_progress_ = 0;
+    if (text.next_key < int(key_events.size())) continue;
+    text.next_key = 0;
+    text.pending.erase(text.pending.begin());
+  }
+}
+
+void Remapper::RunAutofires(int64_t now_us) {
+  for (auto& autofire : state_.autofires) {
+    const int64_t deadline_us = AutofireDeadlineUs(autofire);
+    if (deadline_us > now_us) continue;
+    const int64_t late_us = now_us - deadline_us;
+    ++autofire_counters_.ticks;
+    autofire_counters_.total_late_us += late_us;
+    autofire_counters_.max_late_us =
+        std::max(autofire_counters_.max_late_us, late_us);
+    EmitKeyCode(autofire.ticks % 2 == 0 ? KeyPressEvent(autofire.key_code)
+                                        : KeyReleaseEvent(autofire.key_code));
+    ++autofire.ticks;
+    // Whole periods missed are skipped, so that the key is not pressed in a
+    // burst to catch up.
+    while (AutofireDeadlineUs(autofire) <= now_us) {
+      autofire.ticks += 2;
+      autofire_counters_.skipped += 2;
+    }
+  }
+}
+
+template <typename Predicate>
+void Remapper::StopAutofires(Predicate stop) {
+  auto& autofires = state_.autofires;
+  for (auto it = autofires.begin(); it != autofires.end();) {
+    if (!stop(*it)) {
+      ++it;
+      continue;
+    }
+    if (it->ticks % 2 == 1) EmitKeyCode(KeyReleaseEvent(it->key_code));
+    it = autofires.erase(it);
+  }
+}
+
+int Remapper::ProcessSequences(const KeyEvent& key_event) {
+  if (key_event.value != KeyEventType::kKeyPress) return -1;
+  const auto& matcher = config_->sequence_matcher;
+  state_.sequence_state =
+      matcher.Next(state_.sequence_state, key_event.key_code);
+  const int sequence = matcher.Match(state_.sequence_state);
+  if (sequence == 0) [[unlikely]] {
+    throw std::runtime_error("Kill combo accepted.");
+  }
+  return sequence;
+}
+
+bool Remapper::ProcessChordsAndSequences(const KeyEvent& key_event,
+                                         int sequence) {
+  auto& chords = state_.chords;
+  const int key_code = key_event.key_code;
+  const uint64_t key_chords = key_code >= 0 && key_code < KEY_CNT
+                                  ? config_->chords_by_key[key_code]
+                                  : uint64_t(0);
+  const bool is_press = key_event.value == KeyEventType::kKeyPress;
+
+  if (!chords.buffer.empty()) {
+    const int64_t now_us = SteadyClockNowUs();
+    const uint64_t candidates = chords.candidates & key_chords;
+    const bool in_window = now_us - chords.start_us <
+                           int64_t(config_->chord_window_ms) * 1000;
+    if (is_press && candidates != 0 && in_window && sequence < 0) {
+      chords.buffer.push_back(key_code);
+      chords.candidates = candidates;
+      // No need to wait, if no larger chord is possible.
+      if ((candidates & ~config_->chords_by_size[chords.buffer.size()]) ==
+          0) {
+        ResolveChordBuffer(now_us);
+      }
+      return true;
+    }
+    // Anything else ends the chord.
+    ResolveChordBuffer(now_us);
+  }
+
+  auto& consumed = state_.keys_consumed;
+  const auto consumed_it =
+      std::find(consumed.begin(), consumed.end(), key_code);
+  if (consumed_it != consumed.end()) {
+    const uint64_t key_active = chords.active & key_chords;
+    if (key_event.value == KeyEventType::kKeyRepeat) {
+      // Repeats the first key released, as ExpandToActions() does for keys.
+      for (uint64_t bits = key_active; bits != 0; bits &= bits - 1) {
+        const auto& chord = config_->chords[std::countr_zero(bits)];
+        for (const auto& action : chord.release_actions) {
+          if (!std::holds_alternative<KeyEvent>(action)) continue;
+          const auto& key_action = std::get<KeyEvent>(action);
+          if (key_action.value != KeyEventType::kKeyRelease) continue;
+          ProcessKeyEvent({key_action.key_code, KeyEventType::kKeyRepeat});
+          break;
+        }
+      }
+      return true;
+    }
+    // Released, or pressed again if the release was missed.
+    consumed.erase(consumed_it);
+    chords.active &= ~key_active;
+    for (uint64_t bits = key_active; bits != 0; bits &= bits - 1) {
+      ProcessActions(config_->chords[std::countr_zero(bits)].release_actions);
+    }
+    if (!is_press) return true;
+  }
+
+  if (sequence > 0) {
+    // The key is replaced by the sequence's actions.
+    consumed.push_back(key_code);
+    state_.layers[active_state()].null_event_applicable = false;
+    ProcessActions(config_->sequences[sequence].actions);
+    return true;
+  }
+
+  // Chords are part of the default state.
+  if (is_press && key_chords != 0 && state_.active_layers.empty()) {
+    chords.buffer.push_back(key_code);
+    chords.candidates = key_chords;
+    chords.start_us = SteadyClockNowUs();
+    return true;
+  }
+  return false;
+}
+
+void Remapper::ResolveChordBuffer(int64_t now_us) {
+  auto& chords = state_.chords;
+  chord_counters_.max_hold_us =
+      std::max(chord_counters_.max_hold_us, now_us - chords.start_us);
+  const std::vector<int> buffer = std::exchange(chords.buffer, {});
+  // Chords are unique, so at most one has exactly the buffered keys.
+  const uint64_t matched =
+      buffer.size() < config_->chords_by_size.size()
+          ? chords.candidates & config_->chords_by_size[buffer.size()]
+          : uint64_t(0);
+  chords.candidates = 0;
+
+  if (matched != 0) {
+    ++chord_counters_.matched;
+    state_.keys_consumed.insert(state_.keys_consumed.end(), buffer.begin(),
+                                buffer.end());
+    chords.active |= matched;
+    state_.layers[active_state()].null_event_applicable = false;
+    ProcessActions(config_->chords[std::countr_zero(matched)].press_actions);
+    return;
+  }
+
+  ++chord_counters_.flushed;
+  for (const int key_code : buffer) {
+    state_.currently_processing = KeyPressEvent(key_code);
+    ProcessEvent(state_.currently_processing);
+  }
+}
+
+uint8_t Remapper::PressModifiers(int key_code) const {
+  for (const auto& [pressed, modifiers] : state_.modified_keys_pressed) {
+    if (pressed == key_code) return modifiers;
+  }
+  return 0;
+}
+
+void Remapper::ProcessEvent(const KeyEvent& key_event) {
+  // Check if key_event is in activated keyboard_state stack.
+  if (DeactivateLayerByKey(key_event)) [[unlikely]] {
+    return;
+  }
+
+  const int key_code = key_event.key_code;
+  const bool modified_key = key_code >= 0 && key_code < KEY_CNT &&
+                            config_->modified_keys.test(key_code);
+  auto& modified_keys_pressed = state_.modified_keys_pressed;
+  const auto forget_modifiers = [&]() {
+    std::erase_if(modified_keys_pressed, [key_code](const auto& pressed) {
+      return pressed.first == key_code;
+    });
+  };
+  if (modified_key && key_event.value == KeyEventType::kKeyPress)
+      [[unlikely]] {
+    forget_modifiers();
+    modified_keys_pressed.push_back({key_code, state_.modifiers});
+  }
+  const auto& actions = ExpandToActions(key_event);
+  if (modified_key && key_event.value == KeyEventType::kKeyRelease)
+      [[unlikely]] {
+    forget_modifiers();
+  }
+
+  if (!actions.empty()) {
+    // Since a key was pressed, null event will not be triggered on
+    // deactivation.
+    state_.layers[active_state()].null_event_applicable = false;
+
+    ProcessActions(actions);
+  }
+
+  // If a key is released which is not processed otherwise, still send the
+  // release event. This resolves Issue #5.
+  if (key_event.value == KeyEventType::kKeyRelease &&
+      MapContains(state_.keys_held, key_event.key_code)) {
+    ProcessActions({KeyReleaseEvent(key_event.key_code)});
+  }
+}
+
+void Remapper::TakeOverFastKeysHeld() {
+  // They were pressed when no layer was active, so before any active layer.
+  for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+    if (!state_.fast_keys_held.test(key_code)) continue;
+    state_.keys_held[key_code] =
+        RemapState::KeyHeldInfo{key_code, state_.event_seq_num++};
   }
+  state_.input_pressed |= state_.fast_keys_held;
+  state_.fast_keys_held.reset();
 }
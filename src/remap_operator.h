@@ -25,16 +25,29 @@
 // - Implement json config parsing.
 // - Need to handle repeats. 1 is press. 0 is release. And repeat is code 2.
 
+#include <linux/input-event-codes.h>
+
+#include <array>
+#include <bitset>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <map>
+#include <memory>
 #include <optional>
 #include <stack>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 
 #include "keycode_lookup.h"
+#include "mouse_keys.h"
+#include "sequence_matcher.h"
+#include "utility/essentials.h"
+#include "utility/trace_points.h"
 
 // Note: Negative, -key_code is interpreted as key realease, both as condition
 // and as an action.
@@ -46,6 +59,22 @@ enum class KeyEventType {
   kKeyRepeat = 2,
 };
 
+// Typing this deactivates keyshift. Acts on the keys as read.
+inline const std::string kKillCombo = "KEYSHIFTRESERVEDCMDKILL";
+
+// Key codes of kKillCombo.
+inline std::vector<int> KillComboKeyCodes() {
+  std::vector<int> key_codes;
+  for (const char c : kKillCombo) {
+    auto key_code = NameToKeyCode(std::string("KEY_") + c);
+    if (!key_code.has_value()) {
+      throw std::runtime_error("Cannot create combo for kKillCombo");
+    }
+    key_codes.push_back(key_code.value());
+  }
+  return key_codes;
+}
+
 // Should change key_code to KeyEvent, which will contain the value.
 struct KeyEvent {
   int key_code;
@@ -95,6 +124,52 @@ KeyEvent KeyPressEvent(int key_code);
 
 KeyEvent KeyReleaseEvent(int key_code);
 
+// Modifier keys are tracked as a mask of 8 bits, in the order of the USB HID
+// modifier byte. As written in the config, e.g. `[leftctrl] C = ...`.
+inline const std::array<const char*, 8> kModifierNames = {
+    "leftctrl",  "leftshift",  "leftalt",  "leftmeta",
+    "rightctrl", "rightshift", "rightalt", "rightmeta"};
+
+// The bit of a modifier key in the mask, or 0 for other keys.
+inline uint8_t ModifierBit(int key_code) {
+  switch (key_code) {
+    case KEY_LEFTCTRL:
+      return 1 << 0;
+    case KEY_LEFTSHIFT:
+      return 1 << 1;
+    case KEY_LEFTALT:
+      return 1 << 2;
+    case KEY_LEFTMETA:
+      return 1 << 3;
+    case KEY_RIGHTCTRL:
+      return 1 << 4;
+    case KEY_RIGHTSHIFT:
+      return 1 << 5;
+    case KEY_RIGHTALT:
+      return 1 << 6;
+    case KEY_RIGHTMETA:
+      return 1 << 7;
+    default:
+      return 0;
+  }
+}
+
+// Combines a key event with a modifier mask, for a single lookup in
+// CompiledConfig::modified_action_map. Key codes are all below 1 << 16.
+inline KeyEvent WithModifiers(KeyEvent key_event, uint8_t modifiers) {
+  key_event.key_code |= int(modifiers) << 16;
+  return key_event;
+}
+
+// The key event and the modifiers, from WithModifiers().
+inline KeyEvent WithoutModifiers(KeyEvent key_event) {
+  key_event.key_code &= 0xffff;
+  return key_event;
+}
+inline uint8_t ModifiersOf(const KeyEvent& key_event) {
+  return key_event.key_code >> 16;
+}
+
 // Actions.
 // In addition to below, there is KeyEvent which can directly act as an action.
 struct ActionLayerChange {
@@ -105,14 +180,42 @@ struct ActionWait {
   int milli_seconds;
 };
 
-using Action = std::variant<KeyEvent, ActionLayerChange, ActionWait>;
+// Types a text, e.g. from `= "Hello"`. The key events are built when the config
+// is loaded, see CompiledConfig::texts. Typing goes on after the action is
+// done, and texts are typed one after another.
+struct ActionText {
+  int text_index;
+};
+
+// Presses and releases a key periodically, until the input key which started
+// it is released, or the layer it was started in is deactivated. Each has its
+// own phase, from when it was started.
+struct ActionAutofire {
+  int key_code;
+  int period_us;
+};
+
+// Moves the pointer or scrolls, until the input key which started it is
+// released, or the layer it was started in is deactivated. See MouseKeys.
+struct ActionMouseKey {
+  MouseKeyDirection direction;
+};
+
+// Switches to another profile, see Remapper::SetProfiles(). Done once the
+// input event is processed in full.
+struct ActionSwitchProfile {
+  int profile_index;
+};
+
+using Action =
+    std::variant<KeyEvent, ActionLayerChange, ActionWait, ActionText,
+                 ActionAutofire, ActionMouseKey, ActionSwitchProfile>;
 
 // KeyEvent to which action they are mapped.
 using ActionMap = std::unordered_map<KeyEvent, std::vector<Action>,
                                      KeyEvent::Hash, KeyEvent::Equal>;
 
-// Encapsulates the state in which the mapper is right now.
-// Layers are a kind of state.
+// A state of the config. Layers are a kind of state.
 // This has three major components -
 // 1. ActionMap key - What events are we looking for.
 // 2. ActionMap value - What do we do when that event occurs.
@@ -124,42 +227,229 @@ struct KeyboardState {
   // If no interesting event such as keypress occurs while in this state, null
   // events are activated.
   std::vector<Action> null_event_actions;
+};
 
-  // Following are internal state, maintained by the remapper.
+// Keys pressed together, within the chord window, act as a key of their own.
+struct Chord {
+  // At least two.
+  std::vector<int> keys;
+  // Done when the chord is matched, and when the first of its keys is
+  // released.
+  std::vector<Action> press_actions;
+  std::vector<Action> release_actions;
+};
 
-  bool null_event_applicable;
+// Keys typed in order. The last key press is replaced by the actions.
+struct Sequence {
+  std::vector<int> keys;
+  std::vector<Action> actions;
+};
 
-  // Called before activation. Activation is ignored if returns false.
-  [[nodiscard]] bool activate() {
-    if (is_active_) {
-      std::cerr
-          << "WARNING: Attempt to activate an already active layer. Denied."
-          << std::endl;
-      return false;
-    }
-    // std::cerr << "Activated" << this << "\n";
-    is_active_ = true;
-    null_event_applicable = true;
-    return true;
-  }
-  // Called on deactivation.
-  void deactivate() {
-    // std::cerr << "Deactivated" << this << "\n";
-    is_active_ = false;
+// Chords are matched with bit masks of chord indices.
+const int kMaxChords = 64;
+const int kDefaultChordWindowMs = 50;
+
+// Texts are typed this many characters at a time, and each burst is written at
+// once. Readers of the virtual device buffer only 64 events by default,
+// including SYN_REPORTs, so a whole text in a single write would overflow it.
+const int kTextBurstChars = 8;
+// Time between bursts, for readers to catch up.
+const int kTextBurstGapMs = 1;
+
+// Faster than any game is likely to poll.
+const int kMaxAutofireHz = 100;
+
+// The parsed config. It is not changed once processing starts, and can be
+// shared by any number of Remappers, e.g. one per device, without copies.
+struct CompiledConfig {
+  // Index 0 is the default state "".
+  std::vector<KeyboardState> states;
+  std::unordered_map<std::string, int> state_name_to_index;
+  // States of layers, by the keys held in order to activate them, e.g.
+  // {KEY_CAPSLOCK, KEY_LEFTALT} for `CAPSLOCK + LEFTALT + 4 = F4`. Ordered, so
+  // that a layer comes right before the layers nested in it.
+  std::map<std::vector<int>, int> layer_states;
+  // Keys not used by any state, see Remapper::UpdatePassthroughKeys().
+  std::bitset<KEY_CNT> passthrough_keys;
+
+  std::vector<Chord> chords;
+  // Bit i is set for chords[i], in chords_by_key for the chords a key is part
+  // of, and in chords_by_size for the chords of that many keys.
+  std::array<uint64_t, KEY_CNT> chords_by_key{};
+  std::vector<uint64_t> chords_by_size;
+  // How long chord keys are held back, at most.
+  int chord_window_ms = kDefaultChordWindowMs;
+
+  // Index 0 is kKillCombo, which has no actions and is handled specially.
+  std::vector<Sequence> sequences;
+  // Matches all of sequences, with the same indices.
+  SequenceMatcher sequence_matcher;
+
+  // Key events for each ActionText. Every key pressed is released right after,
+  // so that a text can be stopped between any two characters.
+  std::vector<std::vector<KeyEvent>> texts;
+  // If set, texts are typed one character every this many milliseconds
+  // instead of in bursts.
+  int text_pace_ms = 0;
+
+  MouseKeysConfig mouse_keys;
+
+  // Mappings with modifier conditions like `[ctrl] C = ...`, by
+  // WithModifiers(key_event, modifiers) for the exact modifiers held. They
+  // come after the active layers, and before the default state.
+  ActionMap modified_action_map;
+  // Keys in modified_action_map.
+  std::bitset<KEY_CNT> modified_keys;
+};
+
+// A config which can be switched to while running, e.g. for a game.
+struct Profile {
+  std::string name;
+  std::shared_ptr<const CompiledConfig> config;
+};
+
+// What the remapper is doing right now, for one device.
+struct alignas(64) RemapState {
+  // These will be stored in a stack as new layers get activated.
+  struct LayerActivation {
+    int event_seq_num;         // When the layer was activated.
+    const KeyEvent key_event;  // key_code that activated this layer.
+    int state_index;
+  };
+  std::vector<LayerActivation> active_layers;
+
+  // Current keys being held. Maps to event_seq_num, i.e. when it was held.
+  // If somehow a key is pressed multiple times (e.g. repeats maybe?) then this
+  // holds the last occurrence, as per the event_seq_num.
+  struct KeyHeldInfo {
+    // Which physical key resulted in this event.
+    // Used while deactivation of a parent layer, to check if this key should
+    // also be released.
+    int key_origin;
+    int event_seq_num;
+  };
+  std::unordered_map<int, KeyHeldInfo> keys_held;
+  // Keys pressed via ProcessFast(), and not yet in keys_held.
+  std::bitset<KEY_CNT> fast_keys_held;
+  // Keys seen pressed on the keyboard, except those in fast_keys_held.
+  std::bitset<KEY_CNT> input_pressed;
+
+  struct LayerFlags {
+    // Double activation is not expected, but tracked so that it is denied
+    // with a warning, e.g. on logical errors in the config.
+    bool is_active = false;
+    // If no key is pressed while a layer is active, its null events are
+    // activated on deactivation.
+    bool null_event_applicable = false;
+  };
+  // Per state. One vector for both, to keep RemapState small.
+  std::vector<LayerFlags> layers;
+
+  // Can only increase.
+  int event_seq_num = 0;
+
+  // Progress to typing any sequence, including the kill combo.
+  int sequence_state = SequenceMatcher::kStart;
+
+  // Keys which triggered a chord or a sequence, still held. Their repeats and
+  // releases are not processed as usual. Few, so not a bitset, which would
+  // make RemapState larger.
+  std::vector<int> keys_consumed;
+
+  struct ChordState {
+    // Chord keys held back while a chord is still possible, in order of
+    // pressing.
+    std::vector<int> buffer;
+    // Chords which contain all of the buffered keys.
+    uint64_t candidates = 0;
+    // When the first buffered key was processed.
+    int64_t start_us = 0;
+    // Chords matched whose release actions are not done yet.
+    uint64_t active = 0;
+  };
+  ChordState chords;
+
+  struct TextState {
+    // Indices of texts to type, in order.
+    std::vector<int> pending;
+    // Next key event of the first pending text.
+    int next_key = 0;
+    // When to type more.
+    int64_t next_us = 0;
+  };
+  TextState text;
+
+  struct Autofire {
+    // Input key which started it.
+    int key_origin;
+    int key_code;
+    int period_us;
+    int event_seq_num;
+    int64_t start_us;
+    // Half periods since start_us, at which the key is pressed if even and
+    // released if odd.
+    int64_t ticks;
+  };
+  std::vector<Autofire> autofires;
+
+  // The original key event being processed. Set on process().
+  KeyEvent currently_processing;
+
+  // Modifier keys held on the keyboard, see ModifierBit().
+  uint8_t modifiers = 0;
+  // Set by ActionSwitchProfile, and switched to once the event is processed.
+  int pending_profile = -1;
+  // Keys in CompiledConfig::modified_keys which are held, with the modifiers
+  // held when they were pressed. Their repeats and releases are looked up
+  // with the same, so that letting go of a modifier first does not leave a
+  // key stuck. Few, so not a table by key code.
+  std::vector<std::pair<int, uint8_t>> modified_keys_pressed;
+
+  // Allocated on the first mouse key pressed, as most configs have none and
+  // MouseKeys would take a third of RemapState. Kept once allocated, so that
+  // nothing is allocated as it steps.
+  std::unique_ptr<MouseKeys> mouse_keys;
+};
+
+struct AutofireCounters {
+  // Presses and releases.
+  long ticks = 0;
+  // How late ticks were after their deadlines, i.e. the jitter.
+  int64_t total_late_us = 0;
+  int64_t max_late_us = 0;
+  // Ticks missed entirely, e.g. while the process was not scheduled. The key
+  // keeps its phase.
+  long skipped = 0;
+
+  friend std::ostream& operator<<(std::ostream& os,
+                                  const AutofireCounters& counters) {
+    return os << counters.ticks << " ticks, late by "
+              << (counters.ticks > 0 ? counters.total_late_us / counters.ticks
+                                     : 0)
+              << "us on average and " << counters.max_late_us
+              << "us at most, " << counters.skipped << " skipped";
   }
+};
 
- private:
-  // Double activation is not expected.
-  // The error below makes complexity of managing is_active_ is justified,
-  // because it will help us catch unexpected double activations.
-  // E.g. due to logical errors, or due to things like the same key pressed
-  // twice (though reasonably that seems impossible).
-  bool is_active_;
+struct ChordCounters {
+  long matched = 0;
+  // Keys held back and then processed on their own.
+  long flushed = 0;
+  // Longest time keys were held back, at most the chord window.
+  int64_t max_hold_us = 0;
+
+  friend std::ostream& operator<<(std::ostream& os,
+                                  const ChordCounters& counters) {
+    return os << counters.matched << " matched, " << counters.flushed
+              << " flushed, held back up to " << counters.max_hold_us << "us";
+  }
 };
 
 class Remapper {
  public:
   Remapper();
+  // Shares the config, e.g. with another remapper for another device.
+  explicit Remapper(std::shared_ptr<const CompiledConfig> config);
 
   // Movable but not copyable.
   Remapper(Remapper&& other) = default;
@@ -167,28 +457,230 @@ class Remapper {
 
   void SetCallback(std::function<void(int, int)> emit_key_code);
 
+  // Called before sleeping for a wait action, e.g. to send out the key events
+  // emitted so far.
+  void SetWaitCallback(std::function<void()> before_wait);
+
+  // Setting up the config. If the config is shared, these change a copy of it.
+
   // Default state_name is "".
   void AddMapping(const std::string& state_name, KeyEvent key_event,
                   const std::vector<Action>& actions);
+  void AddMapping(int state_index, KeyEvent key_event,
+                  const std::vector<Action>& actions);
 
   void SetNullEventActions(const std::string& state_name,
                            const std::vector<Action> actions);
+  void SetNullEventActions(int state_index, const std::vector<Action> actions);
 
   void SetAllowOtherKeys(const std::string& state_name, bool allow_other_keys);
+  void SetAllowOtherKeys(int state_index, bool allow_other_keys);
+
+  // Finds the state of the layer activated by holding layer_keys in order,
+  // adding it if it does not exist. No keys is the default state.
+  int LayerStateIndex(const std::vector<int>& layer_keys);
+
+  // Merges each nested layer which lets other keys through, from `... + * =
+  // *`, with the layer it is nested in. A key is then decided by a single
+  // lookup in the layer on top. Call once the config is loaded.
+  void CompileLayers();
+
+  // Adds a mapping which is only used while exactly the modifiers are held,
+  // see ModifierBit().
+  void AddModifiedMapping(uint8_t modifiers, KeyEvent key_event,
+                          const std::vector<Action>& actions);
+
+  // Removes all actions for key_event in the state.
+  void RemoveMapping(const std::string& state_name, KeyEvent key_event);
+
+  // Adds a chord to the default state. Fails if the same keys are a chord
+  // already, or there are kMaxChords.
+  ErrorStrOr<void> AddChord(const Chord& chord);
+
+  void SetChordWindowMs(int window_ms);
+
+  // Adds a sequence of keys, which are matched as they are read. Fails if the
+  // sequence exists already. CompileSequences() must be called after.
+  ErrorStrOr<void> AddSequence(const Sequence& sequence);
+
+  // Builds the matcher for all sequences added, see SequenceMatcher::Build().
+  // Call once the config is loaded.
+  void CompileSequences();
+
+  // Adds a text as the key events to type it, which must leave no key pressed.
+  // Returns the action to type it.
+  ActionText AddText(std::vector<KeyEvent> key_events);
+
+  void SetTextPaceMs(int pace_ms);
+
+  void SetMouseKeys(const MouseKeysConfig& mouse_keys);
 
   // Returns an action to activate a state. Can be part of actions in
   // AddMapping().
   ActionLayerChange ActionActivateState(std::string state_name);
+  ActionLayerChange ActionActivateState(int state_index);
+
+  // Finds keys which the config does not use at all, to be passed through by
+  // ProcessFast(). Call once the config is loaded, and again if it changes.
+  void UpdatePassthroughKeys();
+
+  // The config, to share with other remappers.
+  std::shared_ptr<const CompiledConfig> config() const { return config_; }
+
+  // Switches to another config. All keys are released first, as in
+  // ReleaseAll().
+  void SetConfig(std::shared_ptr<const CompiledConfig> config);
+
+  // Switches to another config, keeping keys which are held as themselves,
+  // e.g. a Shift passed through. They are released as usual when released on
+  // the keyboard. Layers are deactivated without their null events, and keys
+  // held due to the current config are released.
+  void SwitchConfig(std::shared_ptr<const CompiledConfig> config);
+
+  // Configs to switch between with SwitchProfile() or ActionSwitchProfile.
+  // The current config should be that of profiles[profile], e.g. after a
+  // reload.
+  void SetProfiles(std::vector<Profile> profiles, int profile = 0);
+
+  // Switches to a profile with SwitchConfig(). Out of range indices are
+  // ignored.
+  void SwitchProfile(int profile_index);
+
+  // The current profile, 0 if there are none.
+  int profile() const { return profile_; }
+  int num_profiles() const { return profiles_.size(); }
+  // Empty if there are no profiles.
+  const std::string& profile_name() const;
+  // -1 if there is no such profile.
+  int ProfileIndex(const std::string& name) const;
+
+  // Processing.
+
+  void Process(const int key_code_int, const int value) {
+    ProcessInput(key_code_int, value);
+    // A quiescent point, with the actions of the event all done.
+    if (state_.pending_profile >= 0) [[unlikely]] {
+      SwitchProfile(state_.pending_profile);
+    }
+  }
+
+  // Fast path for keys which the config does not use, while no layer is
+  // active. If the event passes through unchanged, returns true and the caller
+  // must send it on as is. Otherwise returns false, and Process() must be
+  // called instead.
+  inline bool ProcessFast(const int key_code, const int value) {
+    if (!state_.active_layers.empty() || !state_.chords.buffer.empty() ||
+        key_code < 0 || key_code >= KEY_CNT ||
+        !config_->passthrough_keys.test(key_code)) {
+      return false;
+    }
+    switch (KeyEventType(value)) {
+      case KeyEventType::kKeyPress:
+        // Cannot end a sequence with actions, as those keys are not passed
+        // through.
+        ProcessSequences(KeyPressEvent(key_code));
+        state_.fast_keys_held.set(key_code);
+        state_.modifiers |= ModifierBit(key_code);
+        break;
+      case KeyEventType::kKeyRepeat:
+        break;
+      case KeyEventType::kKeyRelease:
+        // May have been pressed on the slow path, e.g. while a layer was on.
+        if (!state_.fast_keys_held.test(key_code)) return false;
+        state_.fast_keys_held.reset(key_code);
+        state_.modifiers &= ~ModifierBit(key_code);
+        break;
+      default:
+        return false;
+    }
+    TRACE_POINT(process_fast, key_code, value);
+    return true;
+  }
+
+  // Takes over keys which were already held when the device was grabbed. They
+  // are treated as pass-through keys, and pressed on the output so that their
+  // eventual release is consistent. Call after SetCallback().
+  void AdoptHeldKeys(const std::vector<int>& key_codes);
+
+  // Releases all held keys and deactivates all layers, e.g. when the keyboard
+  // is disconnected. Null event actions are not run.
+  void ReleaseAll();
+
+  // Catches up with the keyboard, given the keys pressed on it, e.g. if
+  // events were lost. Releases and presses which were missed are processed
+  // now, releases first. Returns the number of keys corrected.
+  int Reconcile(const std::bitset<KEY_CNT>& keyboard_pressed);
+
+  // Keys held on the output.
+  std::bitset<KEY_CNT> HeldKeys() const;
+
+  int num_active_layers() const { return state_.active_layers.size(); }
+  // Keys holding the active layers, innermost last.
+  std::vector<int> ActiveLayerKeys() const;
+
+  // Timers run while keys are held back for a chord, a text is typed, a key
+  // autofires, or mouse keys move.
+  bool has_timers() const {
+    return !state_.chords.buffer.empty() || !state_.text.pending.empty() ||
+           !state_.autofires.empty() || MouseKeysMoving();
+  }
+
+  // When RunTimers() next has work to do, or -1 without timers. Times are
+  // from SteadyClockNowUs().
+  int64_t NextTimerUs() const;
+
+  // Processes keys held back for a chord once the chord window is over, types
+  // the next part of a text, autofires keys, and steps mouse keys, as they are
+  // due.
+  void RunTimers(int64_t now_us);
+
+  const AutofireCounters& autofire_counters() const {
+    return autofire_counters_;
+  }
+
+  const ChordCounters& chord_counters() const { return chord_counters_; }
+
+  const MouseKeys::Counters& mouse_keys_counters() const {
+    static const MouseKeys::Counters kNoCounters;
+    return state_.mouse_keys ? state_.mouse_keys->counters() : kNoCounters;
+  }
 
-  void Process(const int key_code_int, const int value);
+  // Whether the config moves the pointer, scrolls or clicks, so that the
+  // virtual device must be a mouse too.
+  bool UsesMouseKeys() const;
+
+  // Pointer motion from mouse keys since the last call, to send as a frame.
+  PointerMotion TakePointerMotion() {
+    return state_.mouse_keys ? state_.mouse_keys->TakeMotion()
+                             : PointerMotion();
+  }
+
+  // Without a callback, emitted key events are collected here instead, until
+  // ClearEmitted(). This is how the remapper runs in a Pipeline.
+  const std::vector<KeyEvent>& emitted() const { return emitted_; }
+  void ClearEmitted() { emitted_.clear(); }
 
   // Prints the existing config to terminal.
   void DumpConfig(std::ostream& os = std::cout) const;
 
+  // All states, for analysis of the config. Index 0 is the default state.
+  const std::vector<KeyboardState>& states() const { return config_->states; }
+
+  // Keys passed through by ProcessFast(), see UpdatePassthroughKeys().
+  const std::bitset<KEY_CNT>& passthrough_keys() const {
+    return config_->passthrough_keys;
+  }
+
  private:
+  // Returns the config to change, copying it first if it is shared.
+  CompiledConfig& MutableConfig();
+
   // Finds index of keyboard_state name. If it doesn't exist, adds it.
   int StateNameToIndex(const std::string& state_name);
 
+  // Sizes the per state parts of state_ for the config.
+  void ResizeState();
+
   void EmitKeyCode(const KeyEvent& key_event);
 
   // Check if any layer was activated by the current key_code, and if so,
@@ -199,60 +691,77 @@ class Remapper {
 
   void ProcessKeyEvent(const KeyEvent& key_event);
 
+  // Process(), apart from switching profiles.
+  void ProcessInput(const int key_code_int, const int value);
+
   // Expands an user-keypress into actions to be processed.
   const std::vector<Action> ExpandToActions(const KeyEvent& key_event) const;
+  // Modifiers held when a key in modified_keys was pressed, 0 if not held.
+  uint8_t PressModifiers(int key_code) const;
 
   void ProcessActions(const std::vector<Action>& actions);
 
-  void ProcessCombos(const KeyEvent& key_event);
+  // Follows the sequences typed, and throws if it is the kill combo. Returns
+  // the index of the sequence completed, or -1.
+  int ProcessSequences(const KeyEvent& key_event);
 
-  // TODO: Optimization to keep the active state updated in a variable?
-  inline KeyboardState& active_state() {
-    return active_layers_.size() > 0 ? *active_layers_.back().this_state
-                                     : all_states_[0];
+  // Returns true if the key event was taken by a chord or a sequence, or held
+  // back for a chord. sequence is from ProcessSequences().
+  bool ProcessChordsAndSequences(const KeyEvent& key_event, int sequence);
+
+  // Does the chord the buffered keys make, if any. Else processes them as
+  // they were pressed.
+  void ResolveChordBuffer(int64_t now_us);
+
+  // Types the pending texts, as much as may be sent at once.
+  void TypeText(int64_t now_us);
+
+  // Presses or releases autofiring keys whose deadlines are past.
+  void RunAutofires(int64_t now_us);
+
+  // Stops the autofires for which stop(autofire) is true, releasing their
+  // keys.
+  template <typename Predicate>
+  void StopAutofires(Predicate stop);
+
+  bool MouseKeysMoving() const {
+    return state_.mouse_keys && state_.mouse_keys->moving();
   }
 
-  // These will be stored in a stack as new layers get activated.
-  struct LayerActivation {
-    int event_seq_num;         // When the layer was activated.
-    const KeyEvent key_event;  // key_code that activated this layer.
-    KeyboardState* this_state = nullptr;
-  };
+  // See MouseKeys::Stop().
+  template <typename Predicate>
+  void StopMouseKeys(Predicate stop) {
+    if (MouseKeysMoving()) state_.mouse_keys->Stop(stop);
+  }
 
-  // Do not use this directly, use StateNameToIndex().
-  std::unordered_map<std::string, int> state_name_to_index_;
+  // Process() once combos and chords are done.
+  void ProcessEvent(const KeyEvent& key_event);
 
-  // Index can be looked up from state name with StateToNameIndex().
-  std::vector<KeyboardState> all_states_;
+  // Moves keys pressed via ProcessFast() into keys_held.
+  void TakeOverFastKeysHeld();
 
-  // Previous mappings. This is used as mappings get deactivated.
-  // Pair of key_code, mapping_index.
-  std::vector<LayerActivation> active_layers_;
+  inline int active_state() const {
+    const auto& active_layers = state_.active_layers;
+    return active_layers.empty() ? 0 : active_layers.back().state_index;
+  }
 
-  // Current keys being held. Maps to event_seq_num, i.e. when it was held.
-  // If somehow a key is pressed multiple times (e.g. repeats maybe?) then this
-  // holds the last occurrence, as per the event_seq_num.
-  struct KeyHeldInfo {
-    // Which physical key resulted in this event.
-    // Used while deactivation of a parent layer, to check if this key should
-    // also be released.
-    int key_origin;
-    int event_seq_num;
-  };
-  std::unordered_map<int, KeyHeldInfo> keys_held_;
+  // Never null. Shared, so only changed via MutableConfig().
+  std::shared_ptr<const CompiledConfig> config_;
+  // Same as config_ if it may be changed in place, i.e. it was not shared yet.
+  std::shared_ptr<CompiledConfig> mutable_config_;
 
-  // Can only increase.
-  int event_seq_num_ = 0;
+  RemapState state_;
 
   // On Process(), key_codes are emitted via this callback.
   std::function<void(int, int)> emit_key_code_ = nullptr;
+  std::function<void()> before_wait_ = nullptr;
+  std::vector<KeyEvent> emitted_;
 
-  // Progress to typing the kill combo.
-  std::vector<int> combo_kill_keycodes_;
-  std::size_t combo_kill_progress_ = 0;
+  ChordCounters chord_counters_;
+  AutofireCounters autofire_counters_;
 
-  // The original key event being processed. Set on process().
-  KeyEvent currently_processing_;
+  std::vector<Profile> profiles_;
+  int profile_ = 0;
 };
 
-#endif  // __REMAP_OPERATOR_H
\ No newline at end of file
+#endif  // __REMAP_OPERATOR_H
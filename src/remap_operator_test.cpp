@@ -22,10 +22,12 @@
 #include <catch2/catch_test_macros.hpp>
 #include <functional>
 #include <iostream>
+#include <span>
 #include <string>
 #include <vector>
 
 #include "keycode_lookup.h"
+#include "pipeline.h"
 #include "test_utils.h"
 
 using std::string;
@@ -181,3 +183,229 @@ SCENARIO("Must repeat - both mapped and passthru keys") {
     }
   }
 }
+
+SCENARIO("Keys held before grabbing are released") {
+  Remapper remapper;
+  remapper.AddMapping("", KeyPressEvent(KEY_A), {KeyPressEvent(KEY_B)});
+  remapper.AddMapping("", KeyReleaseEvent(KEY_A), {KeyReleaseEvent(KEY_B)});
+
+  vector<string> adopted;
+  remapper.SetCallback([&adopted](int keycode, int press) {
+    adopted.push_back((press == 1 ? "P " : "R ") + KeyCodeToName(keycode));
+  });
+  remapper.AdoptHeldKeys({KEY_A, KEY_W});
+  CHECK(adopted == vector<string>{"P KEY_A", "P KEY_W"});
+
+  THEN("Held keys release as themselves, even if mapped") {
+    CHECK(GetOutcomes(remapper, false,
+                      {{KEY_W, 2}, {KEY_W, 0}, {KEY_A, 0}, {KEY_A, 1}}) ==
+          vector<string>{"Out: T KEY_W", "Out: R KEY_W", "Out: R KEY_A",
+                         "Out: P KEY_B"});
+  }
+}
+
+SCENARIO("ReleaseAll releases everything") {
+  Remapper remapper;
+  remapper.AddMapping("", KeyPressEvent(KEY_DELETE),
+                      {remapper.ActionActivateState("del")});
+  remapper.AddMapping("del", KeyPressEvent(KEY_END),
+                      {KeyPressEvent(KEY_VOLUMEUP)});
+  remapper.SetNullEventActions(
+      "del", {KeyPressEvent(KEY_DELETE), KeyReleaseEvent(KEY_DELETE)});
+
+  CHECK(GetOutcomes(remapper, false,
+                    {{KEY_A, 1}, {KEY_DELETE, 1}, {KEY_END, 1}}) ==
+        vector<string>{"Out: P KEY_A", "Out: P KEY_VOLUMEUP"});
+
+  vector<string> released;
+  remapper.SetCallback([&released](int keycode, int press) {
+    released.push_back((press == 1 ? "P " : "R ") + KeyCodeToName(keycode));
+  });
+  remapper.ReleaseAll();
+  // Reverse order of press, and no null event for the layer.
+  CHECK(released == vector<string>{"R KEY_VOLUMEUP", "R KEY_A"});
+
+  THEN("Layer is no longer active") {
+    CHECK(GetOutcomes(remapper, false, {{KEY_END, 1}, {KEY_END, 0}}) ==
+          vector<string>{"Out: P KEY_END", "Out: R KEY_END"});
+  }
+}
+
+SCENARIO("Wait callback is called before waiting") {
+  Remapper remapper;
+  remapper.AddMapping("", KeyPressEvent(KEY_A),
+                      {KeyPressEvent(KEY_B), ActionWait{1},
+                       KeyReleaseEvent(KEY_B)});
+
+  vector<string> outcomes;
+  remapper.SetCallback([&outcomes](int keycode, int press) {
+    outcomes.push_back((press == 1 ? "P " : "R ") + KeyCodeToName(keycode));
+  });
+  remapper.SetWaitCallback([&outcomes]() { outcomes.push_back("Wait"); });
+  remapper.Process(KEY_A, 1);
+  CHECK(outcomes == vector<string>{"P KEY_B", "Wait", "R KEY_B"});
+}
+
+SCENARIO("Pipeline sends events out before a wait") {
+  Remapper remapper;
+  remapper.AddMapping("", KeyPressEvent(KEY_A),
+                      {KeyPressEvent(KEY_B), ActionWait{1},
+                       KeyReleaseEvent(KEY_B)});
+
+  // Each span that reaches the sink.
+  struct BatchSink {
+    vector<vector<string>>* batches;
+    void Process(std::span<const TimedKeyEvent> events) {
+      auto& batch = batches->emplace_back();
+      for (const auto& event : events) {
+        batch.push_back((event.value == KeyEventType::kKeyPress ? "P " : "R ") +
+                        KeyCodeToName(event.key_code));
+      }
+    }
+  };
+  vector<vector<string>> batches;
+  Pipeline pipeline{RemapStage(&remapper), BatchSink{&batches}};
+  pipeline.Process(TimedKeyEvent{KeyPressEvent(KEY_A), SteadyClockNowUs()});
+  CHECK(batches == vector<vector<string>>{{"P KEY_B"}, {"R KEY_B"}});
+}
+
+SCENARIO("Pipeline passes on the time of events") {
+  Remapper remapper;
+  remapper.AddMapping("", KeyPressEvent(KEY_A),
+                      {KeyPressEvent(KEY_B), ActionWait{1},
+                       KeyReleaseEvent(KEY_B)});
+
+  struct TimeSink {
+    vector<int64_t>* times;
+    void Process(std::span<const TimedKeyEvent> events) {
+      for (const auto& event : events) times->push_back(event.time_us);
+    }
+  };
+  vector<int64_t> times;
+  Pipeline pipeline{RemapStage(&remapper), TimeSink{&times}};
+  const int64_t start_us = SteadyClockNowUs();
+  pipeline.Process(TimedKeyEvent{KeyPressEvent(KEY_A), 1234});
+  REQUIRE(times.size() == 2);
+  // The press is for the event, the release comes after the wait.
+  CHECK(times[0] == 1234);
+  CHECK(times[1] >= start_us);
+}
+
+SCENARIO("Fast path does not change outcomes") {
+  // A = B, CAPSLOCK + 1 = F1.
+  const auto set_up = [](Remapper& remapper) {
+    remapper.AddMapping("", KeyPressEvent(KEY_A), {KeyPressEvent(KEY_B)});
+    remapper.AddMapping("", KeyReleaseEvent(KEY_A), {KeyReleaseEvent(KEY_B)});
+    remapper.AddMapping("", KeyPressEvent(KEY_CAPSLOCK),
+                        {remapper.ActionActivateState("caps")});
+    remapper.AddMapping("caps", KeyPressEvent(KEY_1), {KeyPressEvent(KEY_F1)});
+    remapper.AddMapping("caps", KeyReleaseEvent(KEY_1),
+                        {KeyReleaseEvent(KEY_F1)});
+  };
+  const std::vector<std::pair<int, int>> events = {
+      // Passthrough while no layer is active.
+      {KEY_W, 1}, {KEY_W, 2}, {KEY_W, 0},
+      // Released while a layer is active.
+      {KEY_W, 1}, {KEY_CAPSLOCK, 1}, {KEY_W, 0}, {KEY_1, 1}, {KEY_1, 0},
+      // Pressed while a layer is active, released after.
+      {KEY_E, 1}, {KEY_CAPSLOCK, 0}, {KEY_E, 0},
+      // Mapped and passthrough together.
+      {KEY_A, 1}, {KEY_W, 1}, {KEY_A, 0}, {KEY_W, 0}};
+
+  Remapper slow_remapper;
+  set_up(slow_remapper);
+  Remapper fast_remapper;
+  set_up(fast_remapper);
+  fast_remapper.UpdatePassthroughKeys();
+
+  THEN("Only keys not in the config are passed through") {
+    CHECK(fast_remapper.ProcessFast(KEY_W, 1));
+    CHECK(fast_remapper.ProcessFast(KEY_W, 0));
+    CHECK_FALSE(fast_remapper.ProcessFast(KEY_A, 1));
+    CHECK_FALSE(fast_remapper.ProcessFast(KEY_B, 1));
+    CHECK_FALSE(fast_remapper.ProcessFast(KEY_1, 1));
+    CHECK_FALSE(fast_remapper.ProcessFast(KEY_F1, 1));
+  }
+
+  THEN("Outcomes are same as the slow path") {
+    CHECK(GetOutcomes(fast_remapper, true, events, /*fast_path=*/true) ==
+          GetOutcomes(slow_remapper, true, events));
+  }
+
+  THEN("Keys pressed on the fast path are released by ReleaseAll") {
+    CHECK(fast_remapper.ProcessFast(KEY_W, 1));
+    vector<string> released;
+    fast_remapper.SetCallback([&released](int keycode, int press) {
+      released.push_back((press == 1 ? "P " : "R ") + KeyCodeToName(keycode));
+    });
+    fast_remapper.ReleaseAll();
+    CHECK(released == vector<string>{"R KEY_W"});
+  }
+}
+
+SCENARIO("No fast path if other keys are blocked") {
+  Remapper remapper;
+  remapper.SetAllowOtherKeys("", false);
+  remapper.UpdatePassthroughKeys();
+  CHECK_FALSE(remapper.ProcessFast(KEY_W, 1));
+}
+
+SCENARIO("Remappers sharing a config") {
+  Remapper first;
+  first.AddMapping("", KeyPressEvent(KEY_CAPSLOCK),
+                   {first.ActionActivateState("caps")});
+  first.AddMapping("caps", KeyPressEvent(KEY_1), {KeyPressEvent(KEY_F1)});
+  first.AddMapping("caps", KeyReleaseEvent(KEY_1), {KeyReleaseEvent(KEY_F1)});
+  Remapper second(first.config());
+  CHECK(second.config() == first.config());
+  // Per device state stays small.
+  CHECK(sizeof(RemapState) <= 512);
+
+  THEN("Layers are per remapper") {
+    CHECK(GetOutcomes(first, false, {{KEY_CAPSLOCK, 1}}).empty());
+    CHECK(GetOutcomes(second, false, {{KEY_1, 1}, {KEY_1, 0}}) ==
+          vector<string>{"Out: P KEY_1", "Out: R KEY_1"});
+    CHECK(GetOutcomes(first, false, {{KEY_1, 1}, {KEY_1, 0}}) ==
+          vector<string>{"Out: P KEY_F1", "Out: R KEY_F1"});
+  }
+
+  THEN("Changing one copies the config") {
+    second.AddMapping("", KeyPressEvent(KEY_A), {KeyPressEvent(KEY_B)});
+    CHECK(second.config() != first.config());
+    CHECK(GetOutcomes(first, false, {{KEY_A, 1}}) ==
+          vector<string>{"Out: P KEY_A"});
+    CHECK(GetOutcomes(second, false, {{KEY_A, 1}}) ==
+          vector<string>{"Out: P KEY_B"});
+  }
+
+  THEN("Switching config releases held keys") {
+    Remapper other;
+    other.AddMapping("", KeyPressEvent(KEY_A), {KeyPressEvent(KEY_B)});
+    CHECK(GetOutcomes(first, false, {{KEY_W, 1}, {KEY_CAPSLOCK, 1}}) ==
+          vector<string>{"Out: P KEY_W"});
+    vector<string> released;
+    first.SetCallback([&released](int keycode, int press) {
+      released.push_back((press == 1 ? "P " : "R ") + KeyCodeToName(keycode));
+    });
+    first.SetConfig(other.config());
+    CHECK(released == vector<string>{"R KEY_W"});
+    CHECK(GetOutcomes(first, false, {{KEY_A, 1}, {KEY_1, 1}}) ==
+          vector<string>{"Out: P KEY_B", "Out: P KEY_1"});
+  }
+}
+
+SCENARIO("Kill combo after a false start") {
+  Remapper remapper;
+  // The combo starts with K, so a counter of keys matched would miss this.
+  vector<std::pair<int, int>> keys = {{KEY_K, 1}, {KEY_K, 0}};
+  for (const int key_code : KillComboKeyCodes()) {
+    keys.push_back({key_code, 1});
+    keys.push_back({key_code, 0});
+  }
+  CHECK_THROWS(GetOutcomes(remapper, false, keys));
+  remapper.ReleaseAll();
+  keys.erase(keys.begin(), keys.begin() + 2);
+  keys.pop_back();
+  keys.pop_back();
+  CHECK_NOTHROW(GetOutcomes(remapper, false, keys));
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __SEQUENCE_MATCHER_H
+#define __SEQUENCE_MATCHER_H
+
+// Matches sequences of key presses as they are typed, e.g. the kill combo or
+// an abbreviation.
+//
+// This is an Aho-Corasick automaton over key codes. Build() turns it into a
+// table of transitions, so each key press is a single lookup, however many
+// sequences there are. Sequences may overlap, and may be prefixes or suffixes
+// of one another.
+//
+// Matching does not change the matcher, so it can be shared. The state of
+// matching is an int kept by the caller, starting with kStart.
+
+#include <linux/input-event-codes.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+class SequenceMatcher {
+ public:
+  static constexpr int kStart = 0;
+
+  SequenceMatcher() { Build(); }
+
+  // Adds a sequence of at least one key code, and returns its index. Indices
+  // are in the order added. Returns -1, and changes nothing, if the sequence
+  // was added before or has a key code out of range.
+  // Call Build() before matching, once after adding all the sequences.
+  int Add(const std::vector<int>& key_codes) {
+    if (key_codes.empty()) return -1;
+    for (const int key_code : key_codes) {
+      if (key_code <= 0 || key_code >= KEY_CNT) return -1;
+    }
+    int node = kStart;
+    for (const int key_code : key_codes) {
+      uint16_t& symbol = symbols_[key_code];
+      if (symbol == 0) symbol = num_symbols_++;
+      const auto [it, added] = trie_[node].try_emplace(symbol, trie_.size());
+      if (added) {
+        trie_.emplace_back();
+        terminal_.push_back(-1);
+      }
+      node = it->second;
+    }
+    if (terminal_[node] >= 0) return -1;
+    terminal_[node] = num_sequences_++;
+    return terminal_[node];
+  }
+
+  // Computes the transitions. States are numbered by the trie nodes, so states
+  // from before stay valid.
+  void Build() {
+    const int num_states = trie_.size();
+    next_.assign(std::size_t(num_states) * num_symbols_, kStart);
+    match_.assign(num_states, -1);
+    // Longest proper suffix of a state that is also a state.
+    std::vector<int> fail(num_states, kStart);
+    // Breadth first, so that shorter states, including any fail state, are
+    // done first.
+    std::vector<int> queue = {kStart};
+    for (std::size_t head = 0; head < queue.size(); ++head) {
+      const int state = queue[head];
+      // The state's own sequence is the longest one ending here.
+      match_[state] =
+          terminal_[state] >= 0 || state == kStart
+              ? terminal_[state]
+              : match_[fail[state]];
+      int* const row = &next_[std::size_t(state) * num_symbols_];
+      const int* const fail_row =
+          &next_[std::size_t(fail[state]) * num_symbols_];
+      // Symbol 0 is for keys in no sequence, which always go back to start.
+      for (int symbol = 1; symbol < num_symbols_; ++symbol) {
+        const auto it = trie_[state].find(symbol);
+        if (it == trie_[state].end()) {
+          row[symbol] = state == kStart ? kStart : fail_row[symbol];
+          continue;
+        }
+        const int child = it->second;
+        fail[child] = state == kStart ? kStart : fail_row[symbol];
+        row[symbol] = child;
+        queue.push_back(child);
+      }
+    }
+  }
+
+  // The state once key_code is pressed.
+  inline int Next(int state, int key_code) const {
+    const int symbol =
+        key_code >= 0 && key_code < KEY_CNT ? symbols_[key_code] : 0;
+    return next_[std::size_t(state) * num_symbols_ + symbol];
+  }
+
+  // Index of the longest sequence just completed in the state, or -1.
+  inline int Match(int state) const { return match_[state]; }
+
+  int num_sequences() const { return num_sequences_; }
+  int num_states() const { return trie_.size(); }
+
+ private:
+  // Key codes in any sequence are numbered from 1, so that the table only has
+  // a column for each of them.
+  std::array<uint16_t, KEY_CNT> symbols_{};
+  int num_symbols_ = 1;
+  int num_sequences_ = 0;
+
+  // The trie, from symbol to child. Only used by Add() and Build().
+  std::vector<std::map<int, int>> trie_ = {{}};
+  // Index of the sequence ending at each node, or -1.
+  std::vector<int> terminal_ = {-1};
+
+  // Built tables, per state.
+  std::vector<int> next_;
+  std::vector<int> match_;
+};
+
+#endif  // __SEQUENCE_MATCHER_H
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "sequence_matcher.h"
+
+#include <algorithm>
+#include <catch2/catch_test_macros.hpp>
+#include <random>
+#include <vector>
+
+// Presses the keys, and returns the match after each.
+std::vector<int> Type(const SequenceMatcher& matcher, int& state,
+                      const std::vector<int>& key_codes) {
+  std::vector<int> matches;
+  for (const int key_code : key_codes) {
+    state = matcher.Next(state, key_code);
+    matches.push_back(matcher.Match(state));
+  }
+  return matches;
+}
+
+TEST_CASE("Matches sequences as typed", "[sequence_matcher]") {
+  SequenceMatcher matcher;
+  CHECK(matcher.Add({KEY_A, KEY_B, KEY_C}) == 0);
+  CHECK(matcher.Add({KEY_B, KEY_C}) == 1);
+  CHECK(matcher.Add({KEY_A, KEY_B, KEY_C}) == -1);
+  CHECK(matcher.Add({}) == -1);
+  matcher.Build();
+  CHECK(matcher.num_sequences() == 2);
+
+  int state = SequenceMatcher::kStart;
+  // The longest one is matched.
+  CHECK(Type(matcher, state, {KEY_A, KEY_B, KEY_C}) ==
+        std::vector<int>{-1, -1, 0});
+  CHECK(Type(matcher, state, {KEY_X, KEY_B, KEY_C}) ==
+        std::vector<int>{-1, -1, 1});
+  // Any other key starts over.
+  CHECK(Type(matcher, state, {KEY_A, KEY_B, KEY_X, KEY_C}) ==
+        std::vector<int>{-1, -1, -1, -1});
+  // A sequence can follow right after another.
+  CHECK(Type(matcher, state, {KEY_A, KEY_B, KEY_C, KEY_B, KEY_C}) ==
+        std::vector<int>{-1, -1, 0, -1, 1});
+}
+
+TEST_CASE("Rejected sequences change nothing", "[sequence_matcher]") {
+  SequenceMatcher matcher;
+  CHECK(matcher.Add({KEY_A, KEY_B}) == 0);
+  const int num_states = matcher.num_states();
+  CHECK(matcher.Add({KEY_C, KEY_D, KEY_CNT}) == -1);
+  CHECK(matcher.Add({KEY_A, KEY_B}) == -1);
+  CHECK(matcher.num_states() == num_states);
+  matcher.Build();
+  int state = SequenceMatcher::kStart;
+  CHECK(Type(matcher, state, {KEY_C, KEY_D, KEY_A, KEY_B}) ==
+        std::vector<int>{-1, -1, -1, 0});
+}
+
+TEST_CASE("Matches after a false start", "[sequence_matcher]") {
+  SequenceMatcher matcher;
+  CHECK(matcher.Add({KEY_A, KEY_A, KEY_B}) == 0);
+  matcher.Build();
+  int state = SequenceMatcher::kStart;
+  // A counter of keys matched so far would miss this.
+  CHECK(Type(matcher, state, {KEY_A, KEY_A, KEY_A, KEY_B}) ==
+        std::vector<int>{-1, -1, -1, 0});
+}
+
+TEST_CASE("Adding keeps states valid", "[sequence_matcher]") {
+  SequenceMatcher matcher;
+  matcher.Add({KEY_A, KEY_B});
+  matcher.Build();
+  int state = SequenceMatcher::kStart;
+  CHECK(Type(matcher, state, {KEY_A}) == std::vector<int>{-1});
+  matcher.Add({KEY_C, KEY_D});
+  matcher.Build();
+  CHECK(Type(matcher, state, {KEY_B, KEY_C, KEY_D}) ==
+        std::vector<int>{0, -1, 1});
+}
+
+TEST_CASE("Matches many sequences", "[sequence_matcher]") {
+  const std::vector<int> letters = {KEY_A, KEY_B, KEY_C, KEY_D, KEY_E,
+                                    KEY_F, KEY_G, KEY_H, KEY_I, KEY_J};
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> letter(0, letters.size() - 1);
+  std::uniform_int_distribution<int> length(4, 8);
+
+  SequenceMatcher matcher;
+  std::vector<std::vector<int>> sequences;
+  while (sequences.size() < 500) {
+    std::vector<int> sequence(length(rng));
+    for (auto& key_code : sequence) key_code = letters[letter(rng)];
+    if (matcher.Add(sequence) >= 0) sequences.push_back(sequence);
+  }
+  matcher.Build();
+
+  for (std::size_t index = 0; index < sequences.size(); ++index) {
+    int state = SequenceMatcher::kStart;
+    // Start from somewhere else.
+    Type(matcher, state, {letters[letter(rng)], letters[letter(rng)]});
+    const auto matches = Type(matcher, state, sequences[index]);
+    // Another sequence may end here too, but only if it is longer.
+    const int match = matches.back();
+    REQUIRE(match >= 0);
+    if (match != int(index)) {
+      const auto& other = sequences[match];
+      CHECK(other.size() > sequences[index].size());
+      CHECK(std::equal(sequences[index].rbegin(), sequences[index].rend(),
+                       other.rbegin()));
+    }
+  }
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __STUCK_KEY_RECONCILER_H
+#define __STUCK_KEY_RECONCILER_H
+
+// Releases keys which are stuck because events were lost, e.g. after layer
+// juggling while the kernel dropped events. Two comparisons are made -
+// - Keys pressed on the keyboard, as the kernel reports them, against the keys
+//   the remapper has seen pressed. Missed releases (and presses) are processed
+//   by the remapper, so that layers and mappings release as they would have.
+// - Keys pressed on the virtual device against the keys the remapper holds.
+//   Any other key is released.
+//
+// Both are bitwise operations over the KEY_CNT bits, a handful of words, so
+// this is cheap enough to run whenever the keyboard is idle or a layer is
+// deactivated.
+//
+// Keys which a config deliberately keeps held after the key that pressed them
+// is released are not affected, since the remapper still holds them.
+
+#include <linux/input.h>
+
+#include <bitset>
+#include <ostream>
+
+#include "key_state_normalizer.h"
+
+class StuckKeyReconciler {
+ public:
+  struct Counters {
+    long runs = 0;
+    // Keys whose press or release on the keyboard was missed.
+    long input = 0;
+    // Keys released on the virtual device.
+    long output = 0;
+  };
+
+  // Call with the keys pressed on the keyboard, e.g. from
+  // InputDevice::GetKeyState(). The remapper runs in the pipeline, which ends
+  // in key_output.
+  template <typename RemapperType, typename PipelineType>
+  void Run(const std::bitset<KEY_CNT>& keyboard_pressed,
+           RemapperType& remapper, PipelineType& pipeline,
+           KeyStateNormalizer& key_output) {
+    ++counters_.runs;
+    counters_.input += remapper.Reconcile(keyboard_pressed);
+    pipeline.Flush();
+    const auto stuck = key_output.pressed() & ~remapper.HeldKeys();
+    if (stuck.any()) [[unlikely]] {
+      for (int key_code = 0; key_code < KEY_CNT; ++key_code) {
+        if (!stuck.test(key_code)) continue;
+        key_output.KeyEvent(key_code, 0);
+        ++counters_.output;
+      }
+    }
+    key_output.Flush();
+  }
+
+  const Counters& counters() const { return counters_; }
+
+ private:
+  Counters counters_;
+};
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const StuckKeyReconciler::Counters& counters) {
+  return os << counters.input << " input, " << counters.output
+            << " output, in " << counters.runs << " runs";
+}
+
+#endif  // __STUCK_KEY_RECONCILER_H
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "stuck_key_reconciler.h"
+
+#include <linux/input-event-codes.h>
+
+#include <bitset>
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <vector>
+
+#include "key_state_normalizer.h"
+#include "keycode_lookup.h"
+#include "pipeline.h"
+#include "remap_operator.h"
+
+using std::string;
+using std::vector;
+
+// Wires a remapper to a normalizer, and collects what is sent.
+struct Setup {
+  Remapper remapper;
+  vector<string> sent;
+  KeyStateNormalizer key_output{
+      [this](const struct input_event* events, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+          if (events[i].type != EV_KEY) continue;
+          sent.push_back((events[i].value == 1 ? "P " : "R ") +
+                         KeyCodeToName(events[i].code));
+        }
+      }};
+  Pipeline<RemapStage<Remapper>, KeyOutputSink> pipeline{
+      RemapStage<Remapper>(&remapper), KeyOutputSink(&key_output)};
+  StuckKeyReconciler reconciler;
+
+  void Process(int key_code, int value) {
+    pipeline.Process(TimedKeyEvent{{key_code, KeyEventType(value)}, 0});
+  }
+
+  void Reconcile(const vector<int>& keyboard_pressed) {
+    std::bitset<KEY_CNT> pressed;
+    for (const int key_code : keyboard_pressed) pressed.set(key_code);
+    sent.clear();
+    reconciler.Run(pressed, remapper, pipeline, key_output);
+  }
+};
+
+SCENARIO("Nothing to correct") {
+  Setup pipeline;
+  pipeline.Process(KEY_A, 1);
+  pipeline.Reconcile({KEY_A});
+  CHECK(pipeline.sent.empty());
+  CHECK(pipeline.reconciler.counters().runs == 1);
+  CHECK(pipeline.reconciler.counters().input == 0);
+}
+
+SCENARIO("Missed release in a layer") {
+  Setup pipeline;
+  auto& remapper = pipeline.remapper;
+  remapper.AddMapping("", KeyPressEvent(KEY_CAPSLOCK),
+                      {remapper.ActionActivateState("caps")});
+  remapper.AddMapping("caps", KeyPressEvent(KEY_H),
+                      {KeyPressEvent(KEY_LEFTCTRL), KeyPressEvent(KEY_LEFT)});
+  remapper.AddMapping("caps", KeyReleaseEvent(KEY_H),
+                      {KeyReleaseEvent(KEY_LEFT)});
+
+  pipeline.Process(KEY_CAPSLOCK, 1);
+  pipeline.Process(KEY_H, 1);
+  // Release of both keys is lost.
+
+  pipeline.Reconcile({});
+  // Same as if released, H first and then the layer takes its keys with it.
+  CHECK(pipeline.sent == vector<string>{"R KEY_LEFT", "R KEY_LEFTCTRL"});
+  CHECK(pipeline.reconciler.counters().input == 2);
+  CHECK(remapper.num_active_layers() == 0);
+  CHECK(pipeline.key_output.pressed().none());
+}
+
+SCENARIO("Missed press") {
+  Setup pipeline;
+  pipeline.Reconcile({KEY_B});
+  CHECK(pipeline.sent == vector<string>{"P KEY_B"});
+  pipeline.Process(KEY_B, 0);
+  CHECK(pipeline.sent == vector<string>{"P KEY_B", "R KEY_B"});
+}
+
+SCENARIO("Fast path keys are reconciled") {
+  Setup pipeline;
+  auto& remapper = pipeline.remapper;
+  remapper.AddMapping("", KeyPressEvent(KEY_A), {KeyPressEvent(KEY_B)});
+  remapper.UpdatePassthroughKeys();
+
+  // Forwarded as is, outside of the normalizer.
+  REQUIRE(remapper.ProcessFast(KEY_X, 1));
+  pipeline.key_output.Sent(KEY_X, 1);
+
+  pipeline.Reconcile({});
+  CHECK(pipeline.sent == vector<string>{"R KEY_X"});
+}
+
+SCENARIO("Key stuck on the output") {
+  Setup pipeline;
+  // Not held by the remapper.
+  pipeline.key_output.KeyEvent(KEY_LEFTSHIFT, 1);
+  pipeline.key_output.Flush();
+  pipeline.Reconcile({});
+  CHECK(pipeline.sent == vector<string>{"R KEY_LEFTSHIFT"});
+  CHECK(pipeline.reconciler.counters().output == 1);
+}
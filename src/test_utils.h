@@ -18,17 +18,60 @@
 #define __TEST_UTILS_H
 
 #include <iostream>
+#include <span>
 #include <sstream>
 
+#include "pipeline.h"
 #include "remap_operator.h"
 
 using std::string;
 using std::vector;
 
-std::vector<string> GetOutcomes(Remapper& remapper, bool keep_incoming,
-                                std::vector<std::pair<int, int>> keycodes) {
+// Pipeline sink which collects outputs as "Out: P KEY_A" etc.
+class CaptureSink {
+ public:
+  explicit CaptureSink(std::vector<string>* outcomes) : outcomes_(outcomes) {}
+
+  void Process(std::span<const TimedKeyEvent> events) {
+    for (const auto& event : events) {
+      std::ostringstream oss;
+      std::string press_str;
+      switch (event.value) {
+        case KeyEventType::kKeyRelease:
+          press_str = "R ";
+          break;
+        case KeyEventType::kKeyPress:
+          press_str = "P ";
+          break;
+        case KeyEventType::kKeyRepeat:
+          press_str = "T ";
+          break;
+        default:
+          press_str = "U ";
+          break;
+      }
+      oss << "Out: " << press_str << KeyCodeToName(event.key_code);
+      outcomes_->push_back(oss.str());
+    }
+  }
+
+ private:
+  std::vector<string>* outcomes_;
+};
+
+// Runs the remapper in a Pipeline ending in a CaptureSink. Any callback set on
+// the remapper is removed.
+// With fast_path, events go through Remapper::ProcessFast() first, and are
+// output as they are if it accepts them, as in the main loop.
+// Works with Remapper and any CompiledRemapper.
+template <typename RemapperType>
+std::vector<string> GetOutcomes(RemapperType& remapper, bool keep_incoming,
+                                std::vector<std::pair<int, int>> keycodes,
+                                bool fast_path = false) {
   std::vector<string> outcomes;
-  auto process = [&outcomes, &remapper, keep_incoming](int keycode, int value) {
+  remapper.SetCallback(nullptr);
+  Pipeline pipeline{RemapStage(&remapper), CaptureSink(&outcomes)};
+  for (const auto& [keycode, value] : keycodes) {
     if (keep_incoming) {
       std::ostringstream oss;
       oss << "In: ";
@@ -44,34 +87,14 @@ std::vector<string> GetOutcomes(Remapper& remapper, bool keep_incoming,
       oss << KeyCodeToName(abs(keycode));
       outcomes.push_back(oss.str());
     }
-    remapper.Process(keycode, value);
-  };
-
-  remapper.SetCallback([&outcomes](int keycode, int press) {
-    std::ostringstream oss;
-    std::string press_str;
-    switch (press) {
-      case 0:
-        press_str = "R ";
-        break;
-      case 1:
-        press_str = "P ";
-        break;
-      case 2:
-        press_str = "T ";
-        break;
-      default:
-        press_str = "U ";
-        break;
+    const TimedKeyEvent key_event{{keycode, KeyEventType(value)},
+                                  SteadyClockNowUs()};
+    if (fast_path && remapper.ProcessFast(keycode, value)) {
+      pipeline.template stage<1>().Process({&key_event, 1});
+      continue;
     }
-    oss << "Out: " << press_str << KeyCodeToName(keycode);
-    outcomes.push_back(oss.str());
-  });
-
-  for (const auto& [keycode, value] : keycodes) {
-    process(keycode, value);
+    pipeline.Process(key_event);
   }
-
   return outcomes;
 }
 
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "busy_poll.h"
+
+#include <fcntl.h>
+
+#include <catch2/catch_test_macros.hpp>
+
+SCENARIO("BusyPoller") {
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  REQUIRE(fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK) == 0);
+  BusyPoller poller;
+  std::atomic<bool> stop(false);
+  char buffer[8];
+
+  THEN("Data is read") {
+    REQUIRE(write(fds[1], "ab", 2) == 2);
+    CHECK(poller.Read(fds[0], buffer, sizeof(buffer), stop) == 2);
+  }
+
+  THEN("Times out without data") {
+    CHECK(poller.Read(fds[0], buffer, sizeof(buffer), stop,
+                      /*timeout_ms=*/10) == -1);
+    CHECK(errno == ETIMEDOUT);
+    // Not stuck in the timed out state.
+    REQUIRE(write(fds[1], "a", 1) == 1);
+    CHECK(poller.Read(fds[0], buffer, sizeof(buffer), stop,
+                      /*timeout_ms=*/10) == 1);
+  }
+
+  THEN("Stops") {
+    stop = true;
+    CHECK(poller.Read(fds[0], buffer, sizeof(buffer), stop) == -1);
+    CHECK(errno == EINTR);
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __CPU_DMA_LATENCY_H
+#define __CPU_DMA_LATENCY_H
+
+// Holds a PM QoS request on /dev/cpu_dma_latency. While it is held, the kernel
+// keeps the cores out of idle states which take longer than the requested
+// latency to wake up from. With 0, that is all C-states deeper than C1.
+//
+// The request is dropped when the file is closed, i.e. on destruction or when
+// the process exits. See Documentation/power/pm_qos_interface.rst in the
+// kernel.
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+
+class CpuDmaLatencyRequest {
+ public:
+  explicit CpuDmaLatencyRequest(int32_t latency_us) {
+    fd_ = open("/dev/cpu_dma_latency", O_WRONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+      std::cerr << "WARNING: Could not open /dev/cpu_dma_latency: "
+                << strerror(errno) << std::endl;
+      return;
+    }
+    if (write(fd_, &latency_us, sizeof(latency_us)) != sizeof(latency_us)) {
+      std::cerr << "WARNING: Could not write to /dev/cpu_dma_latency: "
+                << strerror(errno) << std::endl;
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  ~CpuDmaLatencyRequest() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  CpuDmaLatencyRequest(const CpuDmaLatencyRequest&) = delete;
+  CpuDmaLatencyRequest& operator=(const CpuDmaLatencyRequest&) = delete;
+
+  // If the request is in effect.
+  bool held() const { return fd_ >= 0; }
+
+ private:
+  int fd_;
+};
+
+#endif  // __CPU_DMA_LATENCY_H
@@ -18,6 +18,8 @@
 #define __ESSENTIALS_H
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <expected>
 #include <functional>
 #include <string>
@@ -128,6 +130,15 @@ std::vector<std::pair<T, U>> Sorted(const std::unordered_map<T, U>& input) {
   return result;
 }
 
+// Time.
+
+// Microseconds since an arbitrary point, on CLOCK_MONOTONIC.
+inline int64_t SteadyClockNowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 // Convenience macro for std::except error handling.
 
 // Provides brevity in place of std::expected<..., std::string> for brevity.
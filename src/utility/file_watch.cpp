@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_watch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+// Only used if no parent directory could be watched, e.g. if neither
+// /dev/input/by-id nor /dev/input exist yet.
+const int kUnwatchedRecheckMs = 100;
+
+int OpenWhenAvailable(const std::string& path, int flags, int timeout_ms) {
+  int fd = open(path.c_str(), flags);
+  if (fd >= 0 || timeout_ms == 0) return fd;
+
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(std::max(timeout_ms, 0));
+
+  // Watch the parent, e.g. /dev/input/by-id where the symlink appears. And the
+  // grandparent, e.g. /dev/input where the event node appears and gets its
+  // permissions, and where by-id itself is created.
+  const int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  const auto parent = std::filesystem::path(path).parent_path();
+  bool watching = false;
+  // Re-run on every wake up, since the parent may have just been created.
+  // Adding an existing watch again is a no-op.
+  const auto add_watches = [&]() {
+    if (inotify_fd < 0) return;
+    for (const auto& dir : {parent, parent.parent_path()}) {
+      if (dir.empty()) continue;
+      if (inotify_add_watch(inotify_fd, dir.c_str(),
+                            IN_CREATE | IN_MOVED_TO | IN_ATTRIB) >= 0) {
+        watching = true;
+      }
+    }
+  };
+
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    add_watches();
+    // Retry after the watches are in place, so that nothing is missed between
+    // the first open() and the watch.
+    fd = open(path.c_str(), flags);
+    if (fd >= 0) break;
+
+    int wait_ms = watching ? -1 : kUnwatchedRecheckMs;
+    if (timeout_ms >= 0) {
+      const auto remaining =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              deadline - std::chrono::steady_clock::now())
+              .count();
+      if (remaining <= 0) break;
+      wait_ms = wait_ms < 0 ? remaining : std::min<long>(wait_ms, remaining);
+    }
+
+    if (watching) {
+      struct pollfd pfd = {inotify_fd, POLLIN, 0};
+      if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) break;
+      // Contents don't matter, anything changed is a reason to retry.
+      while (read(inotify_fd, buffer, sizeof(buffer)) > 0) {
+      }
+    } else {
+      poll(nullptr, 0, wait_ms);
+    }
+  }
+
+  if (inotify_fd >= 0) close(inotify_fd);
+  return fd;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Opens a file which may not exist yet, e.g. a device node which udev is still
+// creating.
+//
+// Instead of polling with sleeps, this watches the parent directory with
+// inotify, and retries as soon as anything there is created or changed.
+//
+// Usage example -
+//   const int fd = OpenWhenAvailable("/dev/input/by-id/some-kbd", O_RDONLY,
+//                                    2500);
+//   if (fd < 0) { /* Timed out. */ }
+//
+#ifndef __FILE_WATCH_H
+#define __FILE_WATCH_H
+
+#include <string>
+
+// Returns a file descriptor, or -1 if it could not be opened within timeout.
+// A negative timeout_ms waits indefinitely.
+int OpenWhenAvailable(const std::string& path, int flags, int timeout_ms);
+
+#endif  // __FILE_WATCH_H
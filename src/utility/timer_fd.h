@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __TIMER_FD_H
+#define __TIMER_FD_H
+
+// A timerfd, to be polled along with the input device. It is armed with
+// absolute deadlines on CLOCK_MONOTONIC, which is what std::chrono::
+// steady_clock and so SteadyClockNowUs() use on Linux.
+//
+// Unlike a poll() timeout, the deadline is not rounded to milliseconds, and
+// does not depend on when the timeout was computed. Periodic timers re-armed
+// at start + n * period do not drift, however late each wake up is.
+
+#include <errno.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+
+class TimerFd {
+ public:
+  TimerFd() {
+    fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd_ < 0) {
+      std::cerr << "WARNING: Could not create a timerfd: " << strerror(errno)
+                << std::endl;
+    }
+  }
+
+  ~TimerFd() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  TimerFd(const TimerFd&) = delete;
+  TimerFd& operator=(const TimerFd&) = delete;
+
+  // Negative if the timerfd could not be created, which poll() ignores.
+  int fd() const { return fd_; }
+
+  // Fires at deadline_us, right away if it is past. Returns false on error,
+  // and then the caller must wake up by other means.
+  bool ArmAt(int64_t deadline_us) {
+    if (fd_ < 0) return false;
+    if (deadline_us == armed_us_) return true;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    // All zero would disarm it.
+    const int64_t value_us = deadline_us > 0 ? deadline_us : 1;
+    spec.it_value.tv_sec = value_us / 1000000;
+    spec.it_value.tv_nsec = (value_us % 1000000) * 1000;
+    if (timerfd_settime(fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+      return false;
+    }
+    armed_us_ = deadline_us;
+    return true;
+  }
+
+  void Disarm() {
+    if (armed_us_ < 0) return;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    timerfd_settime(fd_, 0, &spec, nullptr);
+    armed_us_ = -1;
+  }
+
+  // Call once poll() reports it readable, to clear it.
+  void Consume() {
+    uint64_t expirations;
+    if (read(fd_, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+      perror("ERROR reading timerfd");
+    }
+    armed_us_ = -1;
+  }
+
+ private:
+  int fd_;
+  // Deadline armed, to skip the syscall if it does not change.
+  int64_t armed_us_ = -1;
+};
+
+#endif  // __TIMER_FD_H
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2024 Nomen Aliud (aka Arnab Bose)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Static tracepoints (USDT) which can be attached to with bpftrace or perf.
+//
+// Each probe compiles into a single nop when nobody is attached, so these can
+// be left in the hot path.
+//
+// Usage example -
+//   TRACE_POINT(process_enter, key_code, value);
+//
+// This can then be traced with -
+//   sudo bpftrace -e 'usdt:/usr/bin/keyshift:keyshift:process_enter {
+//     printf("%d %d\n", arg0, arg1); }'
+//
+// See docs/tracing.md for the list of probes.
+//
+// Probes are only compiled in if built with KEYSHIFT_USDT defined, which the
+// CMake config does if <sys/sdt.h> is found (package systemtap-sdt-dev or
+// systemtap). Otherwise TRACE_POINT() expands to nothing.
+//
+#ifndef __TRACE_POINTS_H
+#define __TRACE_POINTS_H
+
+#if defined(KEYSHIFT_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_POINT(name, ...) STAP_PROBEV(keyshift, name, ##__VA_ARGS__)
+#else
+#define TRACE_POINT(name, ...) \
+  do {                         \
+  } while (false)
+#endif
+
+#endif  // __TRACE_POINTS_H
@@ -24,11 +24,20 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <bitset>
 #include <iostream>
 
+#include "device_capabilities.h"
+#include "utility/trace_points.h"
+
 class VirtualDevice {
  public:
-  VirtualDevice() {
+  // If mirror is given, also enables everything that device can report, so
+  // that events not handled by the remapper can be forwarded as is.
+  // If mouse is set, also reports pointer motion, scrolling and mouse buttons,
+  // for mouse keys.
+  VirtualDevice(const DeviceCapabilities* mirror = nullptr,
+                bool mouse = false) {
     const int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
     if (fd < 0) {
       perror("Unable to open /dev/uinput");
@@ -45,23 +54,63 @@ class VirtualDevice {
     setup.id.version = 1;
     strcpy(setup.name, "Virtual Keyboard");
 
-    // Enable the necessary event types and keys
-    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0) {
-      perror("UI_SET_EVBIT failed");
-      close(fd);
-      return;
-    }
-
     // Enable the device to send all possible keys.
     // So far it looks like KEY_MICMUTE is the highest with value 248.
-    for (int keycode = KEY_ESC; keycode <= 255; ++keycode) {
-      if (ioctl(fd, UI_SET_KEYBIT, keycode) < 0) {
-        std::cerr << "Error setting key bit for keycode " << keycode
-                  << std::endl;
-        close(fd);
-        return;
+    std::bitset<KEY_CNT> keys;
+    for (int keycode = KEY_ESC; keycode <= 255; ++keycode) keys.set(keycode);
+    std::bitset<EV_CNT> types;
+    types.set(EV_KEY);
+    std::bitset<REL_CNT> rels;
+    if (mirror != nullptr) {
+      keys |= mirror->key;
+      types |= mirror->ev;
+      rels |= mirror->rel;
+    }
+    if (mouse) {
+      for (const int button : {BTN_LEFT, BTN_RIGHT, BTN_MIDDLE}) {
+        keys.set(button);
+      }
+      types.set(EV_REL);
+      for (const int axis : {REL_X, REL_Y, REL_WHEEL, REL_HWHEEL,
+                             REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES}) {
+        rels.set(axis);
+      }
+    }
+    // Only the types below are mirrored. LEDs, sound and force feedback flow
+    // from the host to the device, and are left to the real device.
+    types &= std::bitset<EV_CNT>((1 << EV_KEY) | (1 << EV_REL) |
+                                 (1 << EV_MSC) | (1 << EV_ABS));
+
+    // Enable the necessary event types and codes.
+    // Note: uinput only takes one bit per ioctl. This runs only once at start.
+    bool ok = SetBits(fd, UI_SET_EVBIT, types, "UI_SET_EVBIT") &&
+              SetBits(fd, UI_SET_KEYBIT, keys, "UI_SET_KEYBIT");
+    if (ok && types.test(EV_REL)) {
+      ok = SetBits(fd, UI_SET_RELBIT, rels, "UI_SET_RELBIT");
+    }
+    if (ok && mirror != nullptr) {
+      if (types.test(EV_MSC)) {
+        ok = ok && SetBits(fd, UI_SET_MSCBIT, mirror->msc, "UI_SET_MSCBIT");
+      }
+      if (types.test(EV_ABS)) {
+        ok = ok && SetBits(fd, UI_SET_ABSBIT, mirror->abs, "UI_SET_ABSBIT");
+        for (int axis = 0; ok && axis < ABS_CNT; ++axis) {
+          if (!mirror->abs.test(axis)) continue;
+          struct uinput_abs_setup abs_setup;
+          memset(&abs_setup, 0, sizeof(abs_setup));
+          abs_setup.code = axis;
+          abs_setup.absinfo = mirror->absinfo[axis];
+          if (ioctl(fd, UI_ABS_SETUP, &abs_setup) < 0) {
+            perror("UI_ABS_SETUP failed");
+            ok = false;
+          }
+        }
       }
     }
+    if (!ok) {
+      close(fd);
+      return;
+    }
 
     if (ioctl(fd, UI_DEV_SETUP, &setup) < 0) {
       perror("UI_DEV_SETUP failed");
@@ -94,24 +143,44 @@ class VirtualDevice {
   inline int IsOpen() const { return file_descriptor_ >= 0; }
 
   void DoKeyEvent(unsigned int code, int value) const {
-    SendEvent(EV_KEY, code, value);
-    SendEvent(EV_SYN, SYN_REPORT, 0);  // Synchronize
+    struct input_event events[2];
+    memset(events, 0, sizeof(events));
+    events[0].type = EV_KEY;
+    events[0].code = code;
+    events[0].value = value;
+    // Synchronize.
+    events[1].type = EV_SYN;
+    events[1].code = SYN_REPORT;
+    SendEvents(events, 2);
   }
 
- private:
-  void SendEvent(unsigned int type, unsigned int code, int value) const {
+  // Writes events as they are, in a single write. Used to forward whole
+  // frames, which must end with a SYN_REPORT.
+  void SendEvents(const struct input_event* events, std::size_t count) const {
     if (!IsOpen()) return;
-    struct input_event ev;
-    memset(&ev, 0, sizeof(ev));
-    ev.type = type;
-    ev.code = code;
-    ev.value = value;
-
-    if (write(file_descriptor_, &ev, sizeof(ev)) < 0) {
+    for (std::size_t i = 0; i < count; ++i) {
+      TRACE_POINT(send_event, events[i].type, events[i].code, events[i].value);
+    }
+    if (write(file_descriptor_, events, count * sizeof(struct input_event)) <
+        0) {
       perror("write failed");
     }
   }
 
+ private:
+  template <std::size_t N>
+  static bool SetBits(int fd, unsigned long request, const std::bitset<N>& bits,
+                      const char* name) {
+    for (std::size_t code = 0; code < N; ++code) {
+      if (!bits.test(code)) continue;
+      if (ioctl(fd, request, code) < 0) {
+        std::cerr << name << " failed for code " << code << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
   // If negative, then the file isn't opened and there was some error.
   int file_descriptor_ = -1;
 };